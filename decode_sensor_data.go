@@ -5,6 +5,7 @@ import (
 	"encoding/binary"
 	"fmt"
 	"os"
+	"time"
 )
 
 // SensorData はM5Core2から送信されるセンサーデータ構造体
@@ -15,12 +16,273 @@ import (
 //	  uint16_t windDirection;  // Byte 1-2: 0-360 (度)
 //	  uint16_t airSpeed100;    // Byte 3-4: 0-5000 (値×100)
 //	  uint16_t virtualTemp100; // Byte 5-6: 0-5000 (値×100)
+//	  uint8_t rssiAbs;         // Byte 7: 0-99 (-rssiの絶対値)
+//	  uint8_t seq;             // Byte 8: 0-255 ローリングシーケンス番号
 //	}
 type SensorData struct {
 	NodeID         uint8  // Byte 0: 0-10
 	WindDirection  uint16 // Byte 1-2: 0-360 (度)
 	AirSpeed100    uint16 // Byte 3-4: 0-5000 (値×100)
 	VirtualTemp100 uint16 // Byte 5-6: 0-5000 (値×100)
+	RssiAbs        uint8  // Byte 7: 0-99 (-rssiの絶対値)
+	Seq            uint8  // Byte 8: 0-255 ローリングシーケンス番号（旧形式の8バイトでは0）
+}
+
+// ペイロード先頭バイトの上位3ビットはフレーム種別、下位5ビットはnodeId
+const (
+	FrameTypeMask   = 0xE0
+	FrameTypeSensor = 0x00
+	FrameTypeEvent  = 0x20
+	FrameTypeBatch  = 0x40
+	FrameTypeDiag   = 0x80
+)
+
+// バッチフレームのフラグ
+const (
+	BatchFlagSynced  = 0x01 // 基準時刻がUNIX時刻（未設定時は起動からの経過時間）
+	BatchFlagTimeReq = 0x02 // 時刻ダウンリンクの要求
+	BatchFlagHeld    = 0x04 // 変化時のみ送信するモード（送信を省いたサンプルを補完する）
+	BatchFlagAnchor  = 0x08 // 先頭サンプルは前のフレームの最後のサンプル（補完の起点、出力しない）
+	batchHeaderSize  = 12
+	batchSampleSize  = 7
+	batchOffsetEsc   = -128
+	batchOffsetEsc16 = -32768
+	batchSampleHeld  = 0x80 // rssiAbs の最上位ビット: 直前に送信を省いたサンプルがある
+)
+
+// BatchSample は時刻付きバッチフレームの1サンプル
+type BatchSample struct {
+	TimeMs         uint64 // サンプル時刻（ミリ秒）
+	Held           bool   // 送信を省いたサンプルを直前の値で補完した行
+	WindDirection  uint16
+	AirSpeed100    uint16
+	VirtualTemp100 uint16
+	RssiAbs        uint8
+}
+
+// BatchData は時刻付きバッチフレーム（include/sensor_data.h の BatchHeader を参照）
+//
+//	ヘッダ12バイト: header, seq, flags, count, baseSec(u32), baseMs(u16), periodMs(u16)
+//	サンプルごとに: 時刻オフセット(int8、-128なら続くint16、それが-32768なら続くint32) + 風向・風速・温度・RSSI（7バイト）
+type BatchData struct {
+	NodeID   uint8
+	Seq      uint8
+	Flags    uint8
+	PeriodMs uint16
+	Samples  []BatchSample
+}
+
+// DecodeBatchData デコード済みのバイト列をバッチフレームとして解釈
+func DecodeBatchData(decoded []byte) (*BatchData, error) {
+	if len(decoded) < batchHeaderSize {
+		return nil, fmt.Errorf("invalid batch length: got %d bytes", len(decoded))
+	}
+	b := &BatchData{
+		NodeID:   decoded[0] &^ FrameTypeMask,
+		Seq:      decoded[1],
+		Flags:    decoded[2],
+		PeriodMs: binary.LittleEndian.Uint16(decoded[10:12]),
+	}
+	count := int(decoded[3])
+	t := uint64(binary.LittleEndian.Uint32(decoded[4:8]))*1000 + uint64(binary.LittleEndian.Uint16(decoded[8:10]))
+	p := decoded[batchHeaderSize:]
+	var prev BatchSample
+	for i := 0; i < count; i++ {
+		if len(p) < 1 {
+			return nil, fmt.Errorf("batch truncated at sample %d", i)
+		}
+		offset := int64(int8(p[0]))
+		p = p[1:]
+		if offset == batchOffsetEsc {
+			if len(p) < 2 {
+				return nil, fmt.Errorf("batch truncated at sample %d", i)
+			}
+			offset = int64(int16(binary.LittleEndian.Uint16(p[0:2])))
+			p = p[2:]
+			if offset == batchOffsetEsc16 {
+				if len(p) < 4 {
+					return nil, fmt.Errorf("batch truncated at sample %d", i)
+				}
+				offset = int64(int32(binary.LittleEndian.Uint32(p[0:4])))
+				p = p[4:]
+			}
+		}
+		if len(p) < batchSampleSize {
+			return nil, fmt.Errorf("batch truncated at sample %d", i)
+		}
+		if i > 0 {
+			offset += int64(b.PeriodMs)
+		}
+		t = uint64(int64(t) + offset)
+		s := BatchSample{
+			TimeMs:         t,
+			WindDirection:  binary.LittleEndian.Uint16(p[0:2]),
+			AirSpeed100:    binary.LittleEndian.Uint16(p[2:4]),
+			VirtualTemp100: binary.LittleEndian.Uint16(p[4:6]),
+			RssiAbs:        p[6] &^ batchSampleHeld,
+		}
+		// 直前に送信を省いたサンプルがあれば、前のサンプルの値を次のサンプルの半周期手前まで公称周期ごとに補完する
+		if b.Flags&BatchFlagHeld != 0 && p[6]&batchSampleHeld != 0 && i > 0 && b.PeriodMs > 0 {
+			period := uint64(b.PeriodMs)
+			for ft := prev.TimeMs + period; ft+period/2 < t; ft += period {
+				h := prev
+				h.TimeMs = ft
+				h.Held = true
+				b.Samples = append(b.Samples, h)
+			}
+		}
+		if i > 0 || b.Flags&BatchFlagAnchor == 0 {
+			b.Samples = append(b.Samples, s)
+		}
+		prev = s
+		p = p[batchSampleSize:]
+	}
+	return b, nil
+}
+
+// PrintBatchData バッチフレームを読みやすい形式で表示
+func PrintBatchData(b *BatchData) {
+	fmt.Println("=== Batch Data ===")
+	fmt.Printf("Node ID:          %d\n", b.NodeID)
+	fmt.Printf("Seq:              %d\n", b.Seq)
+	fmt.Printf("Time Synced:      %v\n", b.Flags&BatchFlagSynced != 0)
+	fmt.Printf("Time Request:     %v\n", b.Flags&BatchFlagTimeReq != 0)
+	fmt.Printf("Report by Exc.:   %v\n", b.Flags&BatchFlagHeld != 0)
+	fmt.Printf("Period:           %d ms\n", b.PeriodMs)
+	for _, s := range b.Samples {
+		ts := fmt.Sprintf("+%d.%03ds", s.TimeMs/1000, s.TimeMs%1000)
+		if b.Flags&BatchFlagSynced != 0 {
+			ts = time.UnixMilli(int64(s.TimeMs)).UTC().Format("2006-01-02T15:04:05.000Z")
+		}
+		held := ""
+		if s.Held {
+			held = "  (held)"
+		}
+		fmt.Printf("%s  %3d°  %6.2f m/s  %6.2f°C  -%d dBm%s\n", ts, s.WindDirection,
+			float64(s.AirSpeed100)/100.0, float64(s.VirtualTemp100)/100.0, s.RssiAbs, held)
+	}
+	fmt.Println("==================")
+}
+
+// イベントの種別とフラグ
+const (
+	EventGust         = 0x01 // 突風
+	EventTempHigh     = 0x02 // 温度が上限を超えた
+	EventTempLow      = 0x04 // 温度が下限を下回った
+	EventSensorSilent = 0x08 // センサーからサンプルが取れない
+	EventFlagSynced   = 0x01 // 検出時刻がUNIX時刻（未設定時は起動からの経過時間）
+	EventFlagAckReq   = 0x02 // 確認応答ダウンリンク [0x02][seq] の要求
+	eventDataSize     = 17
+)
+
+// EventData は優先送信されるイベントフレーム（17バイト）
+//
+//	header, seq, events, flags, timeSec(u32), timeMs(u16), 検出時のサンプル（7バイト）
+type EventData struct {
+	NodeID uint8
+	Seq    uint8
+	Events uint8
+	Flags  uint8
+	TimeMs uint64
+	Sample BatchSample
+}
+
+// DecodeEventData デコード済みのバイト列をイベントフレームとして解釈
+func DecodeEventData(decoded []byte) (*EventData, error) {
+	if len(decoded) < eventDataSize {
+		return nil, fmt.Errorf("invalid event length: expected %d bytes, got %d bytes", eventDataSize, len(decoded))
+	}
+	t := uint64(binary.LittleEndian.Uint32(decoded[4:8]))*1000 + uint64(binary.LittleEndian.Uint16(decoded[8:10]))
+	return &EventData{
+		NodeID: decoded[0] &^ FrameTypeMask,
+		Seq:    decoded[1],
+		Events: decoded[2],
+		Flags:  decoded[3],
+		TimeMs: t,
+		Sample: BatchSample{
+			TimeMs:         t,
+			WindDirection:  binary.LittleEndian.Uint16(decoded[10:12]),
+			AirSpeed100:    binary.LittleEndian.Uint16(decoded[12:14]),
+			VirtualTemp100: binary.LittleEndian.Uint16(decoded[14:16]),
+			RssiAbs:        decoded[16],
+		},
+	}, nil
+}
+
+// PrintEventData イベントフレームを読みやすい形式で表示
+func PrintEventData(e *EventData) {
+	fmt.Println("=== Event Data ===")
+	fmt.Printf("Node ID:          %d\n", e.NodeID)
+	fmt.Printf("Seq:              %d\n", e.Seq)
+	names := ""
+	for _, ev := range []struct {
+		bit  uint8
+		name string
+	}{{EventGust, "gust"}, {EventTempHigh, "temp-high"}, {EventTempLow, "temp-low"}, {EventSensorSilent, "sensor-silent"}} {
+		if e.Events&ev.bit != 0 {
+			names += " " + ev.name
+		}
+	}
+	fmt.Printf("Events:          %s\n", names)
+	ts := fmt.Sprintf("+%d.%03ds", e.TimeMs/1000, e.TimeMs%1000)
+	if e.Flags&EventFlagSynced != 0 {
+		ts = time.UnixMilli(int64(e.TimeMs)).UTC().Format("2006-01-02T15:04:05.000Z")
+	}
+	fmt.Printf("Detected:         %s\n", ts)
+	fmt.Printf("Ack Requested:    %v\n", e.Flags&EventFlagAckReq != 0)
+	fmt.Printf("Sample:           %d°  %.2f m/s  %.2f°C  -%d dBm\n", e.Sample.WindDirection,
+		float64(e.Sample.AirSpeed100)/100.0, float64(e.Sample.VirtualTemp100)/100.0, e.Sample.RssiAbs)
+	if e.Flags&EventFlagAckReq != 0 {
+		fmt.Printf("Ack Downlink:     02%02X\n", e.Seq)
+	}
+	fmt.Println("==================")
+}
+
+// DiagData はメモリ使用状況の診断フレーム（20バイト、ヒープ量は8バイト単位）
+type DiagData struct {
+	NodeID       uint8
+	Seq          uint8
+	FreeHeap     uint32
+	MinFreeHeap  uint32
+	LargestBlock uint32
+	LoopStackHwm uint16
+	Allocs       [4]uint16 // command/session/uplink/display
+	UptimeMin    uint16
+}
+
+// DecodeDiagData デコード済みのバイト列を診断フレームとして解釈
+func DecodeDiagData(decoded []byte) (*DiagData, error) {
+	if len(decoded) < 20 {
+		return nil, fmt.Errorf("invalid diag length: expected 20 bytes, got %d bytes", len(decoded))
+	}
+	d := &DiagData{
+		NodeID:       decoded[0] &^ FrameTypeMask,
+		Seq:          decoded[1],
+		FreeHeap:     uint32(binary.LittleEndian.Uint16(decoded[2:4])) * 8,
+		MinFreeHeap:  uint32(binary.LittleEndian.Uint16(decoded[4:6])) * 8,
+		LargestBlock: uint32(binary.LittleEndian.Uint16(decoded[6:8])) * 8,
+		LoopStackHwm: binary.LittleEndian.Uint16(decoded[8:10]),
+		UptimeMin:    binary.LittleEndian.Uint16(decoded[18:20]),
+	}
+	for i := 0; i < 4; i++ {
+		d.Allocs[i] = binary.LittleEndian.Uint16(decoded[10+2*i : 12+2*i])
+	}
+	return d, nil
+}
+
+// PrintDiagData 診断フレームを読みやすい形式で表示
+func PrintDiagData(d *DiagData) {
+	fmt.Println("=== Diag Data ===")
+	fmt.Printf("Node ID:          %d\n", d.NodeID)
+	fmt.Printf("Seq:              %d\n", d.Seq)
+	fmt.Printf("Free Heap:        %d bytes\n", d.FreeHeap)
+	fmt.Printf("Min Free Heap:    %d bytes\n", d.MinFreeHeap)
+	fmt.Printf("Largest Block:    %d bytes\n", d.LargestBlock)
+	fmt.Printf("Loop Stack HWM:   %d bytes\n", d.LoopStackHwm)
+	fmt.Printf("Allocs:           command=%d session=%d uplink=%d display=%d\n",
+		d.Allocs[0], d.Allocs[1], d.Allocs[2], d.Allocs[3])
+	fmt.Printf("Uptime:           %d min\n", d.UptimeMin)
+	fmt.Println("=================")
 }
 
 // DecodeSensorData base64エンコードされた文字列をデコードしてSensorData構造体に変換
@@ -43,6 +305,10 @@ func DecodeSensorData(base64Str string) (*SensorData, error) {
 		WindDirection:  binary.LittleEndian.Uint16(decoded[1:3]),
 		AirSpeed100:    binary.LittleEndian.Uint16(decoded[3:5]),
 		VirtualTemp100: binary.LittleEndian.Uint16(decoded[5:7]),
+		RssiAbs:        decoded[7],
+	}
+	if len(decoded) >= 9 {
+		data.Seq = decoded[8]
 	}
 
 	return data, nil
@@ -55,6 +321,8 @@ func PrintSensorData(data *SensorData) {
 	fmt.Printf("Wind Direction:   %d°\n", data.WindDirection)
 	fmt.Printf("Air Speed:        %.2f m/s\n", float64(data.AirSpeed100)/100.0)
 	fmt.Printf("Virtual Temp:     %.2f°C\n", float64(data.VirtualTemp100)/100.0)
+	fmt.Printf("RSSI:             -%d dBm\n", data.RssiAbs)
+	fmt.Printf("Seq:              %d\n", data.Seq)
 	fmt.Println("===================")
 }
 
@@ -67,6 +335,42 @@ func main() {
 
 	base64Str := os.Args[1]
 
+	// バッチフレームの判定
+	if decoded, err := base64.StdEncoding.DecodeString(base64Str); err == nil &&
+		len(decoded) > 0 && decoded[0]&FrameTypeMask == FrameTypeBatch {
+		batch, err := DecodeBatchData(decoded)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "Error: %v\n", err)
+			os.Exit(1)
+		}
+		PrintBatchData(batch)
+		return
+	}
+
+	// イベントフレームの判定
+	if decoded, err := base64.StdEncoding.DecodeString(base64Str); err == nil &&
+		len(decoded) > 0 && decoded[0]&FrameTypeMask == FrameTypeEvent {
+		ev, err := DecodeEventData(decoded)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "Error: %v\n", err)
+			os.Exit(1)
+		}
+		PrintEventData(ev)
+		return
+	}
+
+	// 診断フレームの判定
+	if decoded, err := base64.StdEncoding.DecodeString(base64Str); err == nil &&
+		len(decoded) > 0 && decoded[0]&FrameTypeMask == FrameTypeDiag {
+		diag, err := DecodeDiagData(decoded)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "Error: %v\n", err)
+			os.Exit(1)
+		}
+		PrintDiagData(diag)
+		return
+	}
+
 	// Base64デコードと構造体への変換
 	sensorData, err := DecodeSensorData(base64Str)
 	if err != nil {
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 送信時間（エアタイム）の予算
+//
+// LoRa の送信時間をペイロード長とデータレートから計算し、トークンバケットで
+// 一定時間あたりの送信時間の上限を守る。トークンは送信時間（µs）で、経過時間 × 許容率で貯まる。
+// 定期送信は優先クラス（イベント）のぶんの予約を残せる場合のみ送り、
+// 予算が足りなければスロットを見送る（サンプルはリングに残り、次に送れたときにまとめて送られる）。
+// 送信要求の時点で差し引き、モジュールが NG を返した（電波を出していない）ときは戻す。
+// 応答がなかった場合は送信されたかわからないため戻さない。
+
+// LoRaWAN のフレームに付くヘッダ等（MHDR 1 + FHDR 7 + FPort 1 + MIC 4 バイト）
+#define LORAWAN_OVERHEAD_BYTES 13
+
+// AS923 のデータレートでアプリケーションペイロード len バイトを送る時間（µs）
+// DR0-DR5 は SF12-SF7 / 125kHz、DR6 は SF7 / 250kHz。符号化率 4/5、プリアンブル 8、明示ヘッダ、CRC あり
+inline uint32_t loraAirtimeUs(uint8_t dr, size_t len) {
+  if (dr > 6) {
+    return 0;
+  }
+  int sf = dr == 6 ? 7 : 12 - dr;
+  uint32_t symUs = (1u << sf) * (dr == 6 ? 4 : 8); // 2^SF / BW
+  int de = sf >= 11 ? 1 : 0;                      // 低データレート最適化
+  int pl = (int)(len + LORAWAN_OVERHEAD_BYTES);
+  int num = 8 * pl - 4 * sf + 28 + 16;
+  int den = 4 * (sf - 2 * de);
+  int payloadSym = 8 + (num > 0 ? (num + den - 1) / den * 5 : 0);
+  // プリアンブル (8 + 4.25) シンボル + ペイロード
+  return symUs * 49 / 4 + symUs * payloadSym;
+}
+
+class AirtimeBudget {
+public:
+  // dutyPermille: 許容する送信時間の割合（‰）、burstMs: バケットの容量（連続して使える送信時間）
+  AirtimeBudget(uint32_t dutyPermille, uint32_t burstMs)
+      : dutyPermille_(dutyPermille), capacityUs_(burstMs * 1000), tokensUs_(burstMs * 1000) {}
+
+  // 経過時間ぶんのトークンを貯める
+  void update(uint32_t nowMs) {
+    if (!started_) {
+      started_ = true;
+      lastMs_ = nowMs;
+      return;
+    }
+    // 経過 ms × ‰ = 使ってよい送信時間（µs）
+    uint64_t t = tokensUs_ + (uint64_t)(nowMs - lastMs_) * dutyPermille_;
+    tokensUs_ = t > capacityUs_ ? capacityUs_ : (uint32_t)t;
+    lastMs_ = nowMs;
+  }
+
+  // airtimeUs の送信後も reserveUs 以上残るなら true
+  bool canSend(uint32_t airtimeUs, uint32_t reserveUs = 0) const {
+    return tokensUs_ >= airtimeUs + reserveUs;
+  }
+
+  // 送信したぶんを差し引く（予算を超えた送信は次の補充まで0で止める）
+  void consume(uint32_t airtimeUs) {
+    tokensUs_ = tokensUs_ > airtimeUs ? tokensUs_ - airtimeUs : 0;
+    usedUs_ += airtimeUs;
+  }
+
+  // モジュールが送信を拒否した（NG）フレームのぶんを戻す
+  void refund(uint32_t airtimeUs) {
+    uint64_t t = (uint64_t)tokensUs_ + airtimeUs;
+    tokensUs_ = t > capacityUs_ ? capacityUs_ : (uint32_t)t;
+    usedUs_ = usedUs_ > airtimeUs ? usedUs_ - airtimeUs : 0;
+  }
+
+  uint32_t availableUs() const { return tokensUs_; }
+  uint64_t usedUs() const { return usedUs_; }
+  uint32_t dutyPermille() const { return dutyPermille_; }
+
+private:
+  uint32_t dutyPermille_;
+  uint32_t capacityUs_;
+  uint32_t tokensUs_;
+  uint32_t lastMs_ = 0;
+  bool started_ = false;
+  uint64_t usedUs_ = 0;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "sensor_data.h"
+#include <stdint.h>
+
+// 変化時のみ送信するモード（report-by-exception）の判定
+//
+// サンプルごとに、最後に報告した値からの変化を項目ごとの不感帯と比べ、どれかが不感帯を超えた
+// サンプルだけを報告する（SampleRing に積む）。風向は 0/360 度をまたぐ変化を円周上の差で比べる。
+// 変化がなくても maxSilenceMs ごとに1件報告する（ハートビート）。
+// 省いたサンプルの値は、最後に報告した値から各項目の不感帯以内に収まっている。
+//
+// 報告するサンプルの直前に省いたサンプルがあれば rssiAbs に BATCH_SAMPLE_HELD を立てる。
+// デコーダはこのビットが立ったサンプルの手前に、前に報告した値を公称周期ごとに補完する。
+// サンプルが取れなかった場合は interrupt() で保留中の最後のサンプルを報告して補完の区間を閉じ、
+// 取れなかった区間が補完されないようにする。
+
+// 項目ごとの不感帯（windDirection は度、airSpeed100 / virtualTemp100 は ×100 の単位）
+struct Deadbands {
+  uint16_t windDirection = 10;     // 10°
+  uint16_t airSpeed100 = 50;       // 0.5 m/s
+  uint16_t virtualTemp100 = 20;    // 0.2°C
+  uint32_t maxSilenceMs = 300000;  // 変化がなくても5分ごとに報告する
+};
+
+// 風向の差（0-180 度、0/360 度をまたぐ変化も短い方で測る）
+inline uint16_t windDirectionDelta(uint16_t a, uint16_t b) {
+  uint16_t d = (uint16_t)((a > b ? a - b : b - a) % 360);
+  return d > 180 ? (uint16_t)(360 - d) : d;
+}
+
+class DeadbandFilter {
+public:
+  explicit DeadbandFilter(const Deadbands &db) : db_(db) {}
+
+  // サンプルを報告するか判定する。報告するなら true（s に BATCH_SAMPLE_HELD を付ける場合がある）
+  bool offer(BatchSample &s, uint32_t nowMs) {
+    if (hasRef_ && !exceeds(s) && nowMs - refMs_ < db_.maxSilenceMs) {
+      held_++;
+      lastHeld_ = s;
+      lastHeldMs_ = nowMs;
+      suppressed_++;
+      return false;
+    }
+    report(s, nowMs);
+    return true;
+  }
+
+  // サンプルが取れなかった。保留中のサンプルがあれば最後の1件を s / localMs に返して true
+  // 次に取れたサンプルは補完なしで報告する
+  bool interrupt(BatchSample &s, uint32_t &localMs) {
+    bool flush = hasRef_ && held_ > 0;
+    if (flush) {
+      held_--; // 最後のサンプル自体は報告するため、その手前に省いた件数で判定する
+      s = lastHeld_;
+      localMs = lastHeldMs_;
+      suppressed_--;
+      report(s, localMs);
+    }
+    hasRef_ = false;
+    return flush;
+  }
+
+  uint32_t reported() const { return reported_; }
+  uint32_t suppressed() const { return suppressed_; }
+
+private:
+  bool exceeds(const BatchSample &s) const {
+    uint16_t ds = s.airSpeed100 > ref_.airSpeed100 ? s.airSpeed100 - ref_.airSpeed100
+                                                   : ref_.airSpeed100 - s.airSpeed100;
+    uint16_t dt = s.virtualTemp100 > ref_.virtualTemp100 ? s.virtualTemp100 - ref_.virtualTemp100
+                                                         : ref_.virtualTemp100 - s.virtualTemp100;
+    return windDirectionDelta(s.windDirection, ref_.windDirection) > db_.windDirection ||
+           ds > db_.airSpeed100 || dt > db_.virtualTemp100;
+  }
+
+  void report(BatchSample &s, uint32_t nowMs) {
+    s.rssiAbs &= BATCH_RSSI_MASK;
+    ref_ = s;
+    refMs_ = nowMs;
+    hasRef_ = true;
+    if (held_ > 0) {
+      s.rssiAbs |= BATCH_SAMPLE_HELD;
+    }
+    held_ = 0;
+    reported_++;
+  }
+
+  Deadbands db_;
+  BatchSample ref_ = {};
+  uint32_t refMs_ = 0;
+  bool hasRef_ = false;
+  uint32_t held_ = 0;
+  BatchSample lastHeld_ = {};
+  uint32_t lastHeldMs_ = 0;
+  uint32_t reported_ = 0;
+  uint32_t suppressed_ = 0;
+};
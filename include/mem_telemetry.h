@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// メモリ使用状況のテレメトリ
+//
+// 数か月単位で連続稼働させるため、ヒープの空き・最小空き・最大確保可能ブロック、
+// タスクのスタック残量、サブシステムごとの確保回数を定期的に記録する。
+// 確保回数はリンク時に malloc/calloc/realloc をラップして数え、
+// その時点で有効な MemScope のサブシステムに計上する
+// （platformio.ini の -Wl,--wrap=... を参照）。
+// MemScope は loopTask（setup()/loop()）専用。他のタスク（uartTrace・sampleLog・WiFi など）の
+// 確保は、loop() がどのスコープにいても MEM_OTHER に計上する。
+
+// 確保回数を計上するサブシステム
+enum MemSubsystem {
+  MEM_OTHER = 0, // スコープ外（ライブラリ・他タスクなど）
+  MEM_COMMAND,   // sendCommand（設定モードのコマンド送受信）
+  MEM_SESSION,   // モジュール応答の受信・照合
+  MEM_UPLINK,    // アップリンクの組み立て・送信
+  MEM_DISPLAY,   // LCD表示
+  MEM_SUBSYSTEM_COUNT
+};
+
+inline const char *memSubsystemName(MemSubsystem s) {
+  static const char *const kNames[MEM_SUBSYSTEM_COUNT] = {
+      "other", "command", "session", "uplink", "display"};
+  return kNames[s];
+}
+
+// loopTask の現在のサブシステムとサブシステムごとの確保回数（ファームウェアでは src/mem_telemetry.cpp で定義）
+extern volatile uint8_t memCurrentSubsystem;
+extern volatile uint32_t memAllocCounts[MEM_SUBSYSTEM_COUNT];
+
+// 確保を1回計上する。subsystem は確保したタスクのサブシステム
+inline void memCountAlloc(uint8_t subsystem) {
+  __atomic_fetch_add(&memAllocCounts[subsystem], 1, __ATOMIC_RELAXED);
+}
+
+// スコープ内の確保を指定したサブシステムに計上する
+class MemScope {
+public:
+  explicit MemScope(MemSubsystem s) : prev_(memCurrentSubsystem) { memCurrentSubsystem = s; }
+  ~MemScope() { memCurrentSubsystem = prev_; }
+
+private:
+  uint8_t prev_;
+};
+
+// 定期的に取得するメモリの状態
+struct MemSnapshot {
+  uint32_t freeHeap;     // 現在の空きヒープ
+  uint32_t minFreeHeap;  // 起動以来の最小空きヒープ
+  uint32_t largestBlock; // 確保可能な最大ブロック
+  uint32_t loopStackHwm; // loopTask のスタック残量の最小値（バイト）
+  uint32_t allocs[MEM_SUBSYSTEM_COUNT];
+};
+
+#ifdef ARDUINO
+// setup() の先頭で呼ぶ（loopTask のハンドルを記録する）
+void memBegin();
+
+// スタック残量を監視するタスクを登録する（loopTask は自動で監視）
+void memRegisterTask(const char *name, void *taskHandle);
+
+// 現在の状態を取得する
+void memTakeSnapshot(MemSnapshot &snap);
+
+// 状態をシリアルに出力する（前回出力からの確保回数の増分も表示）
+void memLogTelemetry();
+#endif
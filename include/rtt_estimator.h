@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// ES920LR3 コマンドの応答時間推定とタイムアウト算出
+//
+// 呼び出し側で決め打ちしていた待ち時間（1000/2000ms）、NG 102 の3秒待ち、
+// 応答なし時の500ms待ちは、M-BUS 接続時の実際の応答時間と合っていなかった。
+// TCP の再送タイムアウト（RFC 6298）と同様に、コマンド種別ごとに
+//   SRTT   = 7/8 SRTT + 1/8 R
+//   RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+//   RTO    = SRTT + 4 RTTVAR
+// を計算し、タイムアウトとリトライ間隔に使う。
+// 正常時はタイムアウトが縮み、M-BUS 干渉（SOLUTION_RECOMMENDATIONS.md）で
+// 応答が遅れると自動的に伸びる。応答なしでタイムアウトした場合は RTO を倍にし、
+// 次の有効なサンプルが得られるまで維持する（Karn のアルゴリズム）。
+// RTO の下限はコマンド種別ごとに決める。start（Join 開始）や save（フラッシュ書き込み）、
+// 設定コマンドは普段速く返っても時々大きく遅れるため、学習値が縮みすぎないよう1秒を下限にする。
+
+// コマンド種別
+enum CommandType {
+  CMD_MODE = 0, // "2"（プロセッサーモード選択）
+  CMD_VERSION,  // "v"
+  CMD_CONFIG,   // class / deveui / appeui / appkey / datarate など
+  CMD_SHOW,     // "show"
+  CMD_SAVE,     // "save"
+  CMD_START,    // "start"
+  CMD_BUSY,     // NG 102 から送信可能になるまでの時間
+  CMD_UPLINK,   // アップリンク送信から "OK"/NG まで
+  CMD_TYPE_COUNT
+};
+
+inline const char *commandTypeName(CommandType type) {
+  static const char *const kNames[CMD_TYPE_COUNT] = {
+      "mode", "version", "config", "show", "save", "start", "busy", "uplink"};
+  return kNames[type];
+}
+
+// コマンド文字列の先頭の単語から種別を判定する
+inline CommandType commandTypeOf(const char *cmd) {
+  size_t n = 0;
+  while (cmd[n] != '\0' && cmd[n] != ' ') {
+    n++;
+  }
+  if (n == 1 && cmd[0] == '2') {
+    return CMD_MODE;
+  }
+  if (n == 1 && cmd[0] == 'v') {
+    return CMD_VERSION;
+  }
+  if (n == 4 && strncmp(cmd, "show", 4) == 0) {
+    return CMD_SHOW;
+  }
+  if (n == 4 && strncmp(cmd, "save", 4) == 0) {
+    return CMD_SAVE;
+  }
+  if (n == 5 && strncmp(cmd, "start", 5) == 0) {
+    return CMD_START;
+  }
+  return CMD_CONFIG;
+}
+
+class RttEstimator {
+public:
+  static const uint32_t kMinRtoMs = 50;
+  static const uint32_t kMaxRtoMs = 10000;
+
+  // 初期タイムアウト（サンプルがない間に使う値）と RTO の下限を設定する
+  void seed(uint32_t initialRtoMs, uint32_t minRtoMs = kMinRtoMs) {
+    minRto_ = minRtoMs < kMaxRtoMs ? minRtoMs : kMaxRtoMs;
+    srtt_ = 0;
+    rttvar_ = 0;
+    samples_ = 0;
+    rto_ = clamp(initialRtoMs);
+  }
+
+  // 永続化された推定値から再開する
+  void restore(uint32_t srttMs, uint32_t rttvarMs) {
+    srtt_ = srttMs;
+    rttvar_ = rttvarMs;
+    samples_ = 1;
+    update();
+  }
+
+  // 応答時間のサンプルを追加する
+  void sample(uint32_t rttMs) {
+    if (samples_ == 0) {
+      srtt_ = rttMs;
+      rttvar_ = rttMs / 2;
+    } else {
+      uint32_t err = (srtt_ > rttMs) ? (srtt_ - rttMs) : (rttMs - srtt_);
+      rttvar_ = (3 * rttvar_ + err) / 4;
+      srtt_ = (7 * srtt_ + rttMs) / 8;
+    }
+    samples_++;
+    update();
+  }
+
+  // 応答なしでタイムアウトした（RTO を倍にする）
+  void onTimeout() {
+    rto_ = clamp(rto_ * 2);
+    timeouts_++;
+  }
+
+  // 応答待ちのタイムアウト
+  uint32_t timeoutMs() const { return rto_; }
+
+  // リトライ前の待ち時間: 現在の平均応答時間（サンプルがなければ RTO の半分）
+  uint32_t backoffMs() const {
+    return clamp(samples_ > 0 ? srtt_ + rttvar_ : rto_ / 2);
+  }
+
+  uint32_t minRtoMs() const { return minRto_; }
+  uint32_t srttMs() const { return srtt_; }
+  uint32_t rttvarMs() const { return rttvar_; }
+  uint32_t samples() const { return samples_; }
+  uint32_t timeouts() const { return timeouts_; }
+
+private:
+  void update() { rto_ = clamp(srtt_ + 4 * rttvar_); }
+
+  uint32_t clamp(uint32_t ms) const {
+    if (ms < minRto_) {
+      return minRto_;
+    }
+    if (ms > kMaxRtoMs) {
+      return kMaxRtoMs;
+    }
+    return ms;
+  }
+
+  uint32_t minRto_ = kMinRtoMs;
+  uint32_t srtt_ = 0;
+  uint32_t rttvar_ = 0;
+  uint32_t rto_ = 1000;
+  uint32_t samples_ = 0;
+  uint32_t timeouts_ = 0;
+};
+
+// コマンド種別ごとの推定器と永続化用のシリアライズ
+class CommandTimeouts {
+public:
+  // 永続化データの形式（バージョンが変わったら破棄して初期値から学習し直す）
+  struct __attribute__((packed)) Persisted {
+    uint8_t version;
+    uint16_t srtt[CMD_TYPE_COUNT];
+    uint16_t rttvar[CMD_TYPE_COUNT];
+  };
+  // 2: 送信待ち（CMD_BUSY）に自分の待機時間を含めていた推定値を破棄する
+  static const uint8_t kPersistVersion = 2;
+
+  CommandTimeouts() {
+    // 学習前の初期値は従来の決め打ちの値。下限は種別ごと
+    est_[CMD_MODE].seed(2000, 200);
+    est_[CMD_VERSION].seed(2000, 200);
+    est_[CMD_CONFIG].seed(1000, 1000);
+    est_[CMD_SHOW].seed(2000, 500);
+    est_[CMD_SAVE].seed(1000, 1000);
+    est_[CMD_START].seed(2000, 1000);
+    est_[CMD_BUSY].seed(3000, 100);
+    est_[CMD_UPLINK].seed(5000, RttEstimator::kMinRtoMs);
+  }
+
+  RttEstimator &operator[](CommandType type) { return est_[type]; }
+  const RttEstimator &operator[](CommandType type) const { return est_[type]; }
+
+  // 学習済みの種別のみ保存する（未学習は 0）
+  void save(Persisted &out) const {
+    memset(&out, 0, sizeof(out));
+    out.version = kPersistVersion;
+    for (int i = 0; i < CMD_TYPE_COUNT; i++) {
+      if (est_[i].samples() > 0) {
+        out.srtt[i] = (uint16_t)(est_[i].srttMs() > UINT16_MAX ? UINT16_MAX : est_[i].srttMs());
+        out.rttvar[i] = (uint16_t)(est_[i].rttvarMs() > UINT16_MAX ? UINT16_MAX : est_[i].rttvarMs());
+      }
+    }
+  }
+
+  bool restore(const Persisted &in) {
+    if (in.version != kPersistVersion) {
+      return false;
+    }
+    for (int i = 0; i < CMD_TYPE_COUNT; i++) {
+      if (in.srtt[i] > 0) {
+        est_[i].restore(in.srtt[i], in.rttvar[i]);
+      }
+    }
+    return true;
+  }
+
+  uint32_t totalSamples() const {
+    uint32_t n = 0;
+    for (int i = 0; i < CMD_TYPE_COUNT; i++) {
+      n += est_[i].samples();
+    }
+    return n;
+  }
+
+private:
+  RttEstimator est_[CMD_TYPE_COUNT];
+};
@@ -0,0 +1,272 @@
+#pragma once
+
+#include "sensor_data.h"
+#include "timebase.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// 未送信サンプルの保持と、時刻付きバッチフレーム（FRAME_TYPE_BATCH）の組み立て・解釈
+//
+// サンプルは取得時刻（millis()）とともにリングバッファに積み、送信スロットごとに
+// 古いものからペイロード上限まで1フレームにまとめる。時刻は送信時に Timebase で
+// UNIX時刻へ換算するため、同期前に取得したサンプルも同期後の送信では正しい時刻になる。
+// モジュールが受け付けたフレームに含めたサンプルだけを取り除くため、
+// NG やタイムアウトで送れなかったサンプルは次のスロットで再送される。
+// 変化時のみ送信するモード（BATCH_FLAG_HELD）では、最後に送ったサンプルを次のフレームの
+// 先頭に補完の起点（アンカー）として付け、フレーム単体で省いた値を復元できるようにする。
+
+struct TimedSample {
+  uint32_t localMs; // 取得時の millis()
+  BatchSample data;
+};
+
+class SampleRing {
+public:
+  // モジュールが30分間 NG 102 を返し続けても捨てない大きさ（1Hzで約34分ぶん、24KB。
+  // tools/uplink_soak.cpp --storm-ms 1800000 で最大約1830件）。これを超える停止では古いものから捨てる
+  // （SD の記録には残る）
+  static const size_t kCapacity = 2048;
+
+  // 満杯なら最も古いサンプルを捨てて追加する
+  void push(uint32_t localMs, const BatchSample &s) {
+    if (count_ == kCapacity) {
+      head_ = (head_ + 1) % kCapacity;
+      count_--;
+      dropped_++;
+      hasAnchor_ = false; // アンカーから先頭までが連続しなくなる
+    }
+    TimedSample &t = buf_[(head_ + count_) % kCapacity];
+    t.localMs = localMs;
+    t.data = s;
+    count_++;
+    if (count_ > peak_) {
+      peak_ = count_;
+    }
+  }
+
+  // 取得時刻が localMs 以前のサンプルを取り除く（送信済みフレームの最後のサンプルまで）
+  // 送信後に古いサンプルが捨てられていても、件数ではなく時刻で判断するため取り違えない
+  // 最後に取り除いたサンプルは次のフレームのアンカーとして残す
+  void popThrough(uint32_t localMs) {
+    while (count_ > 0 && (int32_t)(buf_[head_].localMs - localMs) <= 0) {
+      anchor_ = buf_[head_];
+      hasAnchor_ = true;
+      head_ = (head_ + 1) % kCapacity;
+      count_--;
+    }
+  }
+
+  const TimedSample &at(size_t i) const { return buf_[(head_ + i) % kCapacity]; }
+  size_t size() const { return count_; }
+  uint32_t dropped() const { return dropped_; }
+  size_t peak() const { return peak_; } // 未送信サンプルの最大件数（容量の見直し用）
+  bool hasAnchor() const { return hasAnchor_; }
+  const TimedSample &anchor() const { return anchor_; }
+
+private:
+  TimedSample buf_[kCapacity];
+  size_t head_ = 0;
+  size_t count_ = 0;
+  uint32_t dropped_ = 0;
+  size_t peak_ = 0;
+  TimedSample anchor_ = {};
+  bool hasAnchor_ = false;
+};
+
+// 時刻オフセットの符号化後のバイト数（int8 / エスケープ + int16 / エスケープ2段 + int32）
+inline size_t batchOffsetSize(int64_t offset) {
+  if (offset > -128 && offset <= 127) {
+    return 1;
+  }
+  return offset > -32768 && offset <= 32767 ? 3 : 7;
+}
+
+// 時刻オフセットを符号化して out に書き込み、書き込んだバイト数を返す
+inline size_t putBatchOffset(uint8_t *out, int64_t offset) {
+  size_t n = batchOffsetSize(offset);
+  if (n == 1) {
+    out[0] = (uint8_t)(int8_t)offset;
+    return 1;
+  }
+  out[0] = (uint8_t)(int8_t)BATCH_OFFSET_ESCAPE;
+  int16_t o16 = n == 3 ? (int16_t)offset : (int16_t)BATCH_OFFSET_ESCAPE16;
+  memcpy(out + 1, &o16, sizeof(o16));
+  if (n == 7) {
+    int32_t o32 = (int32_t)offset;
+    memcpy(out + 3, &o32, sizeof(o32));
+  }
+  return n;
+}
+
+// ring の先頭から maxLen バイトに収まるだけのサンプルをバッチフレームにまとめる
+// 書き込んだバイト数を返し、含めたサンプル数を count に返す（1件も入らなければ 0）
+// flags に BATCH_FLAG_HELD があり ring にアンカーがあれば、アンカーを先頭サンプルとして付ける（count には含めない）
+inline size_t encodeSampleBatch(const SampleRing &ring, const Timebase &tb, uint8_t nodeId, uint8_t seq,
+                                uint8_t flags, uint16_t periodMs, uint8_t *out, size_t maxLen,
+                                size_t &count) {
+  count = 0;
+  if (ring.size() == 0 || maxLen < sizeof(BatchHeader) + 1 + sizeof(BatchSample)) {
+    return 0;
+  }
+  size_t anchors = (flags & BATCH_FLAG_HELD) && ring.hasAnchor() ? 1 : 0;
+  const TimedSample &first = anchors ? ring.anchor() : ring.at(0);
+  bool synced = tb.synced();
+  uint64_t base = synced ? tb.toUnixMs(first.localMs) : first.localMs;
+
+  BatchHeader h;
+  h.header = FRAME_TYPE_BATCH | (nodeId & FRAME_NODE_MASK);
+  h.seq = seq;
+  h.flags = flags | (synced ? BATCH_FLAG_SYNCED : 0) | (anchors ? BATCH_FLAG_ANCHOR : 0);
+  h.count = 0;
+  h.baseSec = (uint32_t)(base / 1000);
+  h.baseMs = (uint16_t)(base % 1000);
+  h.periodMs = periodMs;
+
+  size_t pos = sizeof(BatchHeader);
+  uint64_t prev = base;
+  size_t n = 0;
+  for (size_t i = 0; i < ring.size() + anchors && n < 255; i++) {
+    const TimedSample &s = i < anchors ? ring.anchor() : ring.at(i - anchors);
+    // 未同期では先頭のサンプルからの経過時間で表す（millis() が一周してもフレーム内の時刻は戻らない）
+    uint64_t t = synced ? tb.toUnixMs(s.localMs) : base + (int64_t)(int32_t)(s.localMs - first.localMs);
+    int64_t offset = (int64_t)(t - prev) - (i == 0 ? 0 : periodMs);
+    if (offset < INT32_MIN || offset > INT32_MAX) {
+      break;
+    }
+    if (pos + batchOffsetSize(offset) + sizeof(BatchSample) > maxLen) {
+      break;
+    }
+    pos += putBatchOffset(out + pos, offset);
+    memcpy(out + pos, &s.data, sizeof(BatchSample));
+    pos += sizeof(BatchSample);
+    prev = t;
+    n++;
+  }
+  count = n > anchors ? n - anchors : 0;
+  h.count = (uint8_t)n;
+  memcpy(out, &h, sizeof(h));
+  return count > 0 ? pos : 0;
+}
+
+// バッチフレームのサンプルを順に取り出す（ホスト側デコーダ用）
+// BATCH_FLAG_HELD のフレームでは、送信を省いた区間を前のサンプルの値で公称周期ごとに補完した行も返す
+// （held() が true）。アンカーのサンプル自体は返さない
+class BatchReader {
+public:
+  // ヘッダを検証する。バッチフレームでなければ false
+  bool begin(const uint8_t *payload, size_t len) {
+    p_ = payload;
+    end_ = payload + len;
+    index_ = 0;
+    truncated_ = false;
+    fillLeft_ = 0;
+    pendingValid_ = false;
+    held_ = false;
+    if (len < sizeof(BatchHeader) || (payload[0] & FRAME_TYPE_MASK) != FRAME_TYPE_BATCH) {
+      return false;
+    }
+    memcpy(&h_, payload, sizeof(h_));
+    p_ += sizeof(BatchHeader);
+    timeMs_ = (uint64_t)h_.baseSec * 1000 + h_.baseMs;
+    return true;
+  }
+
+  // 次の行とその時刻（ミリ秒）を取り出す。終わりまたは途中で切れていたら false
+  bool next(BatchSample &s, uint64_t &timeMs) {
+    for (;;) {
+      if (fillLeft_ > 0) {
+        fillLeft_--;
+        fillMs_ += h_.periodMs;
+        s = hold_;
+        timeMs = fillMs_;
+        held_ = true;
+        return true;
+      }
+      if (pendingValid_) {
+        pendingValid_ = false;
+        hold_ = pending_;
+        fillMs_ = pendingMs_;
+        if (index_ == 1 && (h_.flags & BATCH_FLAG_ANCHOR)) {
+          continue; // アンカーは前のフレームで出力済み
+        }
+        s = pending_;
+        timeMs = pendingMs_;
+        held_ = false;
+        return true;
+      }
+      if (!readSample(pending_, pendingMs_)) {
+        return false;
+      }
+      pendingValid_ = true;
+      bool heldBefore = (pending_.rssiAbs & BATCH_SAMPLE_HELD) != 0;
+      pending_.rssiAbs &= BATCH_RSSI_MASK;
+      if ((h_.flags & BATCH_FLAG_HELD) && heldBefore && index_ > 1 && h_.periodMs > 0) {
+        // 前のサンプルから、次のサンプルの半周期手前までの公称周期の時刻を補完する
+        int64_t gap = (int64_t)(pendingMs_ - fillMs_) - h_.periodMs / 2;
+        fillLeft_ = gap > 0 ? (uint32_t)((gap - 1) / h_.periodMs) : 0;
+      }
+    }
+  }
+
+  const BatchHeader &header() const { return h_; }
+  bool truncated() const { return truncated_; }
+  bool held() const { return held_; }
+
+private:
+  // フレーム上の次のサンプルを読む
+  bool readSample(BatchSample &s, uint64_t &timeMs) {
+    if (index_ >= h_.count) {
+      return false;
+    }
+    if (p_ >= end_) {
+      truncated_ = true;
+      return false;
+    }
+    int64_t offset = (int8_t)*p_++;
+    if (offset == BATCH_OFFSET_ESCAPE) {
+      int16_t o16;
+      if (end_ - p_ < (ptrdiff_t)sizeof(o16)) {
+        truncated_ = true;
+        return false;
+      }
+      memcpy(&o16, p_, sizeof(o16));
+      p_ += sizeof(o16);
+      offset = o16;
+      if (offset == BATCH_OFFSET_ESCAPE16) {
+        int32_t o32;
+        if (end_ - p_ < (ptrdiff_t)sizeof(o32)) {
+          truncated_ = true;
+          return false;
+        }
+        memcpy(&o32, p_, sizeof(o32));
+        p_ += sizeof(o32);
+        offset = o32;
+      }
+    }
+    if (end_ - p_ < (ptrdiff_t)sizeof(BatchSample)) {
+      truncated_ = true;
+      return false;
+    }
+    memcpy(&s, p_, sizeof(BatchSample));
+    p_ += sizeof(BatchSample);
+    timeMs_ += (index_ == 0 ? 0 : h_.periodMs) + offset;
+    timeMs = timeMs_;
+    index_++;
+    return true;
+  }
+
+  BatchHeader h_ = {};
+  const uint8_t *p_ = nullptr;
+  const uint8_t *end_ = nullptr;
+  size_t index_ = 0;
+  uint64_t timeMs_ = 0;
+  bool truncated_ = false;
+  BatchSample pending_ = {};  // 読んだがまだ返していないサンプル（補完の行を先に返す）
+  uint64_t pendingMs_ = 0;
+  bool pendingValid_ = false;
+  BatchSample hold_ = {};     // 補完に使う前のサンプル
+  uint64_t fillMs_ = 0;
+  uint32_t fillLeft_ = 0;
+  bool held_ = false;
+};
@@ -0,0 +1,715 @@
+#pragma once
+
+#include "sensor_data.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// 全サンプルのローカル記録（SD カード）
+//
+// LoRa の送信時間の制約で、アップリンクでは数秒に1件程度しか送れない（変化時のみ送信するモードでは
+// さらに間引く）。取得したすべてのサンプルを後の解析用に SD カードへ記録する。
+//
+// 書き込みは512バイト（1セクタ）のブロック単位で、複数ブロックをまとめたバッファを2面以上用意する:
+//   - loop() は SampleLogBuffer::append() で書き込み中でないバッファにサンプルを追加する（ロックなし）
+//   - バッファが一杯になるか一定時間が経ったら書き出し待ちにし、次のバッファに切り替える
+//   - 一定時間で書き出すときの書きかけのブロックは、そのまま書き出したうえで次のバッファの先頭に写して
+//     追加を続け、次の書き込みで同じセクタを上書きする（低いレートでもブロックを使い切ってから先へ進む）
+//   - 別タスクが書き出し待ちのバッファを SampleLogWriter で書き込み、空きに戻す
+// SD の書き込みが詰まって空きバッファがなくなった場合、append() は待たずにサンプルを捨てて数える
+// （次のブロックのヘッダに捨てた件数を残す）。センサーの取得と LoRa の処理は SD の待ちに関わらない。
+//
+// ファイルは一定サイズごとに切り替え（/log/SLnnnnn.BIN）、上限を超えたら最も古いファイルを消す。
+// ファイルごとの時刻範囲を小さな索引ファイル（/log/INDEX.BIN）に記録し、ファイル内はブロックの
+// 先頭時刻で二分探索できるため、時刻範囲を指定して必要な部分だけを読める。
+// 一定時間での書き出しのたびに、書き込んだ内容を確定（sync）して索引も書き直すため、電源断で失うのは
+// 最後の書き出し以降（SampleLogBuffer の flushMs）の範囲だけで、索引の時刻範囲も同じだけしか遅れない。
+// 索引は一時ファイル（/log/INDEX.TMP）に書いてから置き換える。索引が読めない場合は /log のファイル名から
+// 索引を作り直し、既存のファイルを上書きしない番号から続ける。
+//
+// ブロック（512バイト、リトルエンディアン）:
+//   SampleLogBlockHeader（24バイト）に続いて、サンプルごとに [前のサンプルからの経過ms u16][BatchSample 7バイト]
+//   先頭サンプルの経過msは0。残りは0で埋める。
+
+#define SAMPLE_LOG_BLOCK_SIZE 512
+#define SAMPLE_LOG_VERSION 1
+#define SAMPLE_LOG_RECORD_SIZE 9
+#define SAMPLE_LOG_MAX_BUFFERS 4
+#define SAMPLE_LOG_INDEX_FILES 64 // 索引に載せる（残す）ファイル数の上限
+
+struct __attribute__((packed)) SampleLogBlockHeader {
+  uint8_t magic[2];     // "SL"
+  uint8_t version;      // SAMPLE_LOG_VERSION
+  uint8_t count;        // サンプル数
+  uint32_t seq;         // 起動からの通し番号（欠落・古いブロックの検出用）
+  uint32_t firstLocalMs; // 先頭サンプルの millis()
+  uint64_t firstUnixMs; // 先頭サンプルの UNIX時刻（ミリ秒、未同期は0）
+  uint16_t dropped;     // このブロックの直前に捨てたサンプル数（65535 で頭打ち）
+  uint16_t crc;         // crc を0としたブロック全体の CRC-16/CCITT
+};
+
+static_assert(sizeof(SampleLogBlockHeader) == 24, "SampleLogBlockHeader layout changed: update readers");
+
+#define SAMPLE_LOG_SAMPLES_PER_BLOCK \
+  ((SAMPLE_LOG_BLOCK_SIZE - sizeof(SampleLogBlockHeader)) / SAMPLE_LOG_RECORD_SIZE)
+
+// CRC-16/CCITT（初期値 0xFFFF）
+inline uint16_t sampleLogCrc16(const uint8_t *p, size_t len, uint16_t crc = 0xFFFF) {
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)p[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (uint16_t)(crc << 1 ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+// ブロックの CRC を計算する（crc を0として計算）
+inline uint16_t sampleLogBlockCrc(const uint8_t *block) {
+  static const uint8_t zero[2] = {0, 0};
+  const size_t at = offsetof(SampleLogBlockHeader, crc);
+  uint16_t crc = sampleLogCrc16(block, at);
+  crc = sampleLogCrc16(zero, sizeof(zero), crc);
+  return sampleLogCrc16(block + at + 2, SAMPLE_LOG_BLOCK_SIZE - at - 2, crc);
+}
+
+// 記録先のストレージ（ファームウェアは SD カード、ホストは通常のファイル）
+// 書き込み中のファイルは1つだけで、索引のような小さなファイルは丸ごと読み書きする
+class LogStorage {
+public:
+  virtual ~LogStorage() {}
+
+  // 書き込み用にファイルを作る（既にあれば空にする）
+  virtual bool open(const char *path) = 0;
+  virtual bool write(const uint8_t *p, size_t len) = 0;
+  // 書き込み位置を len バイト戻す（次の write() で書き込み済みの内容を上書きする）
+  virtual bool seekBack(size_t len) = 0;
+  // 書き込んだ内容を確定する（電源断で失わないようにする）
+  virtual bool sync() = 0;
+  virtual void close() = 0;
+  virtual bool remove(const char *path) = 0;
+  // from を to に名前を変える。to が既にあれば置き換える
+  virtual bool rename(const char *from, const char *to) = 0;
+  // dir 内のファイル名（ディレクトリ部分を除く）を順不同で fn に渡す。ディレクトリを開けなければ false
+  virtual bool listDir(const char *dir, void (*fn)(const char *name, void *ctx), void *ctx) = 0;
+  virtual bool writeFile(const char *path, const uint8_t *p, size_t len) = 0;
+  // ファイル全体を読む。なければ false
+  virtual bool readFile(const char *path, uint8_t *p, size_t maxLen, size_t &len) = 0;
+};
+
+// 書き込み側のバッファ（書き込み側: loop()、読み出し側: 書き出しタスク）
+class SampleLogBuffer {
+public:
+  // mem: buffers（2-4）× blocksPerBuffer × 512 バイト
+  // flushMs: バッファが一杯にならなくても書き出し待ちにする時間（電源断で失う範囲）
+  SampleLogBuffer(uint8_t *mem, size_t buffers, size_t blocksPerBuffer, uint32_t flushMs)
+      : mem_(mem), buffers_(buffers < 2 ? 2 : buffers > SAMPLE_LOG_MAX_BUFFERS ? SAMPLE_LOG_MAX_BUFFERS : buffers),
+        blocksPerBuffer_(blocksPerBuffer), flushMs_(flushMs) {}
+
+  // サンプルを追加する。空きバッファがなければ待たずに捨てて false
+  bool append(uint32_t localMs, uint64_t unixMs, const BatchSample &s) {
+    if (count_ > 0 && (count_ == SAMPLE_LOG_SAMPLES_PER_BLOCK || localMs - lastMs_ > 0xFFFF ||
+                       (header()->firstUnixMs == 0) != (unixMs == 0))) {
+      closeBlock(); // 経過msが u16 に収まらない場合と、時刻が同期した場合も新しいブロックにする
+    }
+    if (count_ == 0) {
+      if (cur_ < 0 && !acquire(localMs)) {
+        dropped_++;
+        if (dropPending_ < 0xFFFF) {
+          dropPending_++;
+        }
+        return false;
+      }
+      uint8_t *block = blockPtr();
+      memset(block, 0, SAMPLE_LOG_BLOCK_SIZE);
+      SampleLogBlockHeader *h = header();
+      h->magic[0] = 'S';
+      h->magic[1] = 'L';
+      h->version = SAMPLE_LOG_VERSION;
+      h->seq = seq_++;
+      h->firstLocalMs = localMs;
+      h->firstUnixMs = unixMs;
+      h->dropped = (uint16_t)dropPending_;
+      dropPending_ = 0;
+      lastMs_ = localMs;
+    }
+    uint8_t *rec = blockPtr() + sizeof(SampleLogBlockHeader) + count_ * SAMPLE_LOG_RECORD_SIZE;
+    uint16_t dt = (uint16_t)(localMs - lastMs_);
+    memcpy(rec, &dt, 2);
+    memcpy(rec + 2, &s, sizeof(BatchSample));
+    count_++;
+    header()->count = (uint8_t)count_;
+    lastMs_ = localMs;
+    appended_++;
+    return true;
+  }
+
+  // 一定時間が経ったバッファを書き出し待ちにする（loop() から定期的に呼ぶ）
+  // 書きかけのブロックは次のバッファに引き継ぐ。次のバッファが空いていなければ閉じて書き出す
+  void poll(uint32_t nowMs) {
+    if (cur_ < 0 || nowMs - bufferStartMs_ < flushMs_) {
+      return;
+    }
+    if (count_ > flushedCount_ && __atomic_load_n(&state_[(next_ + 1) % buffers_], __ATOMIC_ACQUIRE) == FREE) {
+      submitOpen(nowMs);
+    } else if (block_ > 0 || count_ > flushedCount_) {
+      flush();
+    }
+  }
+
+  // 追加済みのサンプルをすべて書き出し待ちにする（書き込み側は確定まで行う）
+  void flush() {
+    if (count_ > 0) {
+      closeBlock(true);
+    }
+    if (cur_ >= 0 && block_ > 0) {
+      submit(true);
+    }
+  }
+
+  // 次の append() で捨てずに追加できるか（空きバッファを待ってよい呼び出し側が使う）
+  bool writable() const {
+    if (cur_ < 0) {
+      return __atomic_load_n(&state_[next_], __ATOMIC_ACQUIRE) == FREE;
+    }
+    return block_ + 1 < blocksPerBuffer_ ||
+           __atomic_load_n(&state_[(next_ + 1) % buffers_], __ATOMIC_ACQUIRE) == FREE;
+  }
+
+  // 書き出し待ちの先頭のバッファ（読み出し側から呼ぶ）。なければ nullptr
+  // openTail: 最後のブロックが書きかけ（次のバッファの先頭が同じブロックの続き）
+  // timed: 一杯になる前に時間または flush() で書き出し待ちにした（書き込んだら確定する）
+  uint8_t *peek(size_t &len, bool &openTail, bool &timed) {
+    if (__atomic_load_n(&state_[rd_], __ATOMIC_ACQUIRE) != FULL) {
+      return nullptr;
+    }
+    len = len_[rd_];
+    openTail = openTail_[rd_];
+    timed = timed_[rd_];
+    return mem_ + rd_ * bufferBytes();
+  }
+
+  // peek() したバッファを書き出し終えた
+  void release() {
+    __atomic_store_n(&state_[rd_], (uint8_t)FREE, __ATOMIC_RELEASE);
+    rd_ = (rd_ + 1) % buffers_;
+  }
+
+  // 書き出し待ちのバッファ数
+  size_t pendingBuffers() const {
+    size_t n = 0;
+    for (size_t i = 0; i < buffers_; i++) {
+      n += __atomic_load_n(&state_[i], __ATOMIC_ACQUIRE) == FULL ? 1 : 0;
+    }
+    return n;
+  }
+
+  uint32_t appended() const { return appended_; }
+  uint32_t dropped() const { return dropped_; }
+  uint32_t submitted() const { return submitted_; }
+
+private:
+  enum State : uint8_t { FREE = 0, FULL };
+
+  size_t bufferBytes() const { return blocksPerBuffer_ * SAMPLE_LOG_BLOCK_SIZE; }
+  uint8_t *blockPtr() const { return mem_ + cur_ * bufferBytes() + block_ * SAMPLE_LOG_BLOCK_SIZE; }
+  SampleLogBlockHeader *header() const { return (SampleLogBlockHeader *)blockPtr(); }
+
+  // 次の空きバッファを書き込み先にする（書き出しタスクと同じ順番で使う）
+  bool acquire(uint32_t localMs) {
+    if (__atomic_load_n(&state_[next_], __ATOMIC_ACQUIRE) != FREE) {
+      return false;
+    }
+    cur_ = (int)next_;
+    block_ = 0;
+    bufferStartMs_ = localMs;
+    return true;
+  }
+
+  void closeBlock(bool timed = false) {
+    count_ = 0;
+    flushedCount_ = 0;
+    block_++;
+    if (block_ == blocksPerBuffer_) {
+      submit(timed);
+    }
+  }
+
+  void submit(bool timed) {
+    len_[cur_] = block_ * SAMPLE_LOG_BLOCK_SIZE;
+    openTail_[cur_] = false;
+    timed_[cur_] = timed;
+    __atomic_store_n(&state_[cur_], (uint8_t)FULL, __ATOMIC_RELEASE);
+    next_ = (next_ + 1) % buffers_;
+    cur_ = -1;
+    block_ = 0;
+    submitted_++;
+  }
+
+  // 書きかけのブロックまでを書き出し待ちにし、そのブロックを次のバッファの先頭に写して追加を続ける
+  // （次のバッファが空いていることは呼び出し側で確認済み。書き出しタスクが CRC を書き込む前に写す）
+  void submitOpen(uint32_t nowMs) {
+    size_t nextBuf = (next_ + 1) % buffers_;
+    memcpy(mem_ + nextBuf * bufferBytes(), blockPtr(), SAMPLE_LOG_BLOCK_SIZE);
+    len_[cur_] = (block_ + 1) * SAMPLE_LOG_BLOCK_SIZE;
+    openTail_[cur_] = true;
+    timed_[cur_] = true;
+    __atomic_store_n(&state_[cur_], (uint8_t)FULL, __ATOMIC_RELEASE);
+    next_ = nextBuf;
+    cur_ = (int)nextBuf;
+    block_ = 0;
+    bufferStartMs_ = nowMs;
+    flushedCount_ = count_;
+    submitted_++;
+  }
+
+  uint8_t *mem_;
+  size_t buffers_;
+  size_t blocksPerBuffer_;
+  uint32_t flushMs_;
+  uint8_t state_[SAMPLE_LOG_MAX_BUFFERS] = {};
+  size_t len_[SAMPLE_LOG_MAX_BUFFERS] = {};
+  bool openTail_[SAMPLE_LOG_MAX_BUFFERS] = {};
+  bool timed_[SAMPLE_LOG_MAX_BUFFERS] = {};
+  // 書き込み側だけが使う
+  int cur_ = -1;
+  size_t next_ = 0;
+  size_t block_ = 0;
+  size_t count_ = 0;
+  size_t flushedCount_ = 0; // 書きかけのまま書き出し待ちにしたときのサンプル数
+  uint32_t lastMs_ = 0;
+  uint32_t bufferStartMs_ = 0;
+  uint32_t seq_ = 0;
+  uint32_t dropPending_ = 0;
+  uint32_t appended_ = 0;
+  uint32_t dropped_ = 0;
+  uint32_t submitted_ = 0;
+  // 読み出し側だけが使う
+  size_t rd_ = 0;
+};
+
+// ファイルごとの時刻範囲の索引
+// 索引ファイル: "SLIX" / バージョン(u8) / ファイル数(u8) / 予約(2) に続いて Entry を古い順に並べる
+class SampleLogIndex {
+public:
+  struct __attribute__((packed)) Entry {
+    uint32_t fileNo;
+    uint32_t blocks;
+    uint32_t firstLocalMs;
+    uint32_t lastLocalMs;
+    uint64_t firstUnixMs; // 最初の同期済みサンプルの UNIX時刻（ファイル内に同期済みのブロックがなければ0）
+    uint64_t lastUnixMs;  // 最後のサンプルの UNIX時刻（同上）
+  };
+
+  static const size_t kHeaderSize = 8;
+  static const size_t kMaxBytes = kHeaderSize + SAMPLE_LOG_INDEX_FILES * sizeof(Entry);
+
+  size_t size() const { return count_; }
+  const Entry &at(size_t i) const { return entries_[i]; }
+  void clear() { count_ = 0; }
+  Entry &back() { return entries_[count_ - 1]; }
+
+  // 新しいファイルを追加する。満杯なら false
+  bool add(uint32_t fileNo) {
+    if (count_ == SAMPLE_LOG_INDEX_FILES) {
+      return false;
+    }
+    Entry &e = entries_[count_++];
+    memset(&e, 0, sizeof(e));
+    e.fileNo = fileNo;
+    return true;
+  }
+
+  // 最後に書いたブロックを取り消す（書きかけのブロックを上書きする前）
+  void removeLastBlock() {
+    if (count_ > 0 && entries_[count_ - 1].blocks > 0) {
+      entries_[count_ - 1].blocks--;
+    }
+  }
+
+  // 最も古いファイルを索引から外す
+  void removeOldest() {
+    if (count_ > 0) {
+      memmove(entries_, entries_ + 1, (count_ - 1) * sizeof(Entry));
+      count_--;
+    }
+  }
+
+  // ブロックを書き込んだファイル（最後のエントリ）の範囲を広げる
+  void addBlock(const SampleLogBlockHeader &h, uint32_t lastLocalMs) {
+    Entry &e = back();
+    if (e.blocks == 0) {
+      e.firstLocalMs = h.firstLocalMs;
+    }
+    e.lastLocalMs = lastLocalMs;
+    if (h.firstUnixMs != 0) {
+      if (e.firstUnixMs == 0) {
+        e.firstUnixMs = h.firstUnixMs;
+      }
+      e.lastUnixMs = h.firstUnixMs + (lastLocalMs - h.firstLocalMs);
+    }
+    e.blocks++;
+  }
+
+  // UNIX時刻 [fromMs, toMs] のサンプルを含みうるファイル番号を古い順に fileNos に書き込み、件数を返す
+  size_t find(uint64_t fromMs, uint64_t toMs, uint32_t *fileNos, size_t maxFiles) const {
+    size_t n = 0;
+    for (size_t i = 0; i < count_ && n < maxFiles; i++) {
+      const Entry &e = entries_[i];
+      if (e.firstUnixMs != 0 && e.firstUnixMs <= toMs && e.lastUnixMs >= fromMs) {
+        fileNos[n++] = e.fileNo;
+      }
+    }
+    return n;
+  }
+
+  size_t encode(uint8_t *out) const {
+    memcpy(out, "SLIX", 4);
+    out[4] = SAMPLE_LOG_VERSION;
+    out[5] = (uint8_t)count_;
+    out[6] = 0;
+    out[7] = 0;
+    memcpy(out + kHeaderSize, entries_, count_ * sizeof(Entry));
+    return kHeaderSize + count_ * sizeof(Entry);
+  }
+
+  bool decode(const uint8_t *p, size_t len) {
+    count_ = 0;
+    if (len < kHeaderSize || memcmp(p, "SLIX", 4) != 0 || p[4] != SAMPLE_LOG_VERSION ||
+        p[5] > SAMPLE_LOG_INDEX_FILES || len < kHeaderSize + p[5] * sizeof(Entry)) {
+      return false;
+    }
+    count_ = p[5];
+    memcpy(entries_, p + kHeaderSize, count_ * sizeof(Entry));
+    return true;
+  }
+
+private:
+  Entry entries_[SAMPLE_LOG_INDEX_FILES];
+  size_t count_ = 0;
+};
+
+// ファイルの切り替えと索引の更新（書き出しタスクから呼ぶ）
+class SampleLogWriter {
+public:
+  struct Config {
+    const char *dir = "/log";
+    uint32_t maxFileBytes = 4UL << 20; // これを超えたら次のファイルに切り替える
+    uint32_t maxFiles = SAMPLE_LOG_INDEX_FILES; // これを超えたら最も古いファイルを消す
+    uint32_t indexEveryBlocks = 64;    // 書き込み中のファイルの索引を更新する間隔（ブロック数）
+  };
+
+  SampleLogWriter(LogStorage &storage, const Config &cfg) : storage_(storage), cfg_(cfg) {
+    if (cfg_.maxFiles < 2 || cfg_.maxFiles > SAMPLE_LOG_INDEX_FILES) {
+      cfg_.maxFiles = SAMPLE_LOG_INDEX_FILES;
+    }
+  }
+
+  // 以前の索引を読み込み、新しいファイルを開く
+  // 置き換えの途中で電源が切れた場合は一時ファイルの索引を使い、どちらも読めなければファイル名から作り直す
+  bool begin() {
+    static uint8_t buf[SampleLogIndex::kMaxBytes];
+    size_t len;
+    if (!(storage_.readFile(indexPath(), buf, sizeof(buf), len) && index_.decode(buf, len)) &&
+        !(storage_.readFile(indexTmpPath(), buf, sizeof(buf), len) && index_.decode(buf, len))) {
+      rebuildIndex();
+    }
+    nextFileNo_ = index_.size() > 0 ? index_.back().fileNo + 1 : 0;
+    return rotate();
+  }
+
+  // バッファ（ブロックの並び）を書き込む。各ブロックの CRC はここで計算する
+  // 前回のバッファの最後が書きかけのブロックだった場合、その続きから始まるこのバッファで上書きする
+  // openTail: このバッファの最後のブロックが書きかけ（次の書き込みで上書きされる）
+  // timed: 一定時間での書き出し（SampleLogBuffer::peek()。書きかけのブロックを含むものは必ず該当）。
+  //        書き込んだ内容を確定し、索引も書き直す
+  bool write(uint8_t *buf, size_t len, bool openTail, bool timed) {
+    if (!open_ && !rotate()) {
+      errors_++;
+      return false;
+    }
+    size_t head = len;
+    if (tailOpen_) {
+      // 書きかけのブロックが閉じるまで切り替えを待っていた場合、閉じたブロックまでを今のファイルに書いて切り替える
+      if (fileBytes_ >= cfg_.maxFileBytes && len > SAMPLE_LOG_BLOCK_SIZE) {
+        head = SAMPLE_LOG_BLOCK_SIZE;
+      }
+      tailOpen_ = false;
+      if (!storage_.seekBack(SAMPLE_LOG_BLOCK_SIZE)) {
+        fail();
+        return false;
+      }
+      fileBytes_ -= SAMPLE_LOG_BLOCK_SIZE;
+      index_.removeLastBlock();
+    }
+    if (!writeBlocks(buf, head)) {
+      return false;
+    }
+    if (head < len && (!rotate() || !writeBlocks(buf + head, len - head))) {
+      return false;
+    }
+    tailOpen_ = openTail;
+    if (fileBytes_ >= cfg_.maxFileBytes && !tailOpen_) {
+      return rotate(); // 書きかけのブロックがあれば閉じるまで切り替えない
+    }
+    if (timed || blocksSinceIndex_ >= cfg_.indexEveryBlocks) {
+      if (!storage_.sync()) {
+        fail();
+        return false;
+      }
+      saveIndex();
+    }
+    return true;
+  }
+
+  void end() {
+    if (open_) {
+      storage_.sync();
+      storage_.close();
+      open_ = false;
+    }
+    saveIndex();
+  }
+
+  const SampleLogIndex &index() const { return index_; }
+  uint32_t currentFileNo() const { return index_.size() > 0 ? index_.at(index_.size() - 1).fileNo : 0; }
+  uint64_t bytesWritten() const { return bytesWritten_; } // 上書きを含む書き込み量
+  uint32_t filesRemoved() const { return filesRemoved_; }
+  uint32_t errors() const { return errors_; }
+  bool indexRebuilt() const { return rebuilt_; } // begin() で索引をファイル名から作り直した
+
+  // ファイル番号からパスを作る
+  static void filePath(const char *dir, uint32_t fileNo, char *out, size_t len) {
+    snprintf(out, len, "%s/SL%05lu.BIN", dir, (unsigned long)fileNo);
+  }
+
+  static void indexPath(const char *dir, char *out, size_t len) { snprintf(out, len, "%s/INDEX.BIN", dir); }
+  static void indexTmpPath(const char *dir, char *out, size_t len) { snprintf(out, len, "%s/INDEX.TMP", dir); }
+
+  // ログファイル名（SLnnnnn.BIN）ならファイル番号を返す
+  static bool parseFileName(const char *name, uint32_t &fileNo) {
+    if (strlen(name) != 11 || name[0] != 'S' || name[1] != 'L' || strcmp(name + 7, ".BIN") != 0) {
+      return false;
+    }
+    fileNo = 0;
+    for (int i = 2; i < 7; i++) {
+      if (name[i] < '0' || name[i] > '9') {
+        return false;
+      }
+      fileNo = fileNo * 10 + (uint32_t)(name[i] - '0');
+    }
+    return true;
+  }
+
+private:
+  // ブロックの並びを書き込み中のファイルに追加する
+  bool writeBlocks(uint8_t *buf, size_t len) {
+    for (size_t off = 0; off < len; off += SAMPLE_LOG_BLOCK_SIZE) {
+      uint8_t *block = buf + off;
+      SampleLogBlockHeader *h = (SampleLogBlockHeader *)block;
+      h->crc = sampleLogBlockCrc(block);
+      index_.addBlock(*h, lastLocalMs(block));
+    }
+    if (!storage_.write(buf, len)) {
+      fail();
+      return false;
+    }
+    fileBytes_ += len;
+    bytesWritten_ += len;
+    blocksSinceIndex_ += len / SAMPLE_LOG_BLOCK_SIZE;
+    return true;
+  }
+
+  // 書き込みに失敗した。次の書き込みで新しいファイルを開き直す
+  void fail() {
+    errors_++;
+    storage_.close();
+    open_ = false;
+  }
+
+  // ブロックの最後のサンプルの millis()
+  static uint32_t lastLocalMs(const uint8_t *block) {
+    const SampleLogBlockHeader *h = (const SampleLogBlockHeader *)block;
+    uint32_t t = h->firstLocalMs;
+    const uint8_t *rec = block + sizeof(SampleLogBlockHeader);
+    for (uint8_t i = 0; i < h->count; i++, rec += SAMPLE_LOG_RECORD_SIZE) {
+      uint16_t dt;
+      memcpy(&dt, rec, 2);
+      t += dt;
+    }
+    return t;
+  }
+
+  const char *indexPath() {
+    indexPath(cfg_.dir, pathBuf_, sizeof(pathBuf_));
+    return pathBuf_;
+  }
+
+  const char *indexTmpPath() {
+    indexTmpPath(cfg_.dir, tmpPathBuf_, sizeof(tmpPathBuf_));
+    return tmpPathBuf_;
+  }
+
+  // 一時ファイルに書いてから置き換える（書き込み途中の電源断で索引を失わない）
+  void saveIndex() {
+    static uint8_t buf[SampleLogIndex::kMaxBytes];
+    size_t len = index_.encode(buf);
+    if (!storage_.writeFile(indexTmpPath(), buf, len) || !storage_.rename(indexTmpPath(), indexPath())) {
+      errors_++;
+    }
+    blocksSinceIndex_ = 0;
+  }
+
+  // 索引が読めない場合に、ディレクトリ内のログファイルの番号から索引を作り直す（新しい方から上限まで）
+  // ブロック数と時刻範囲は分からないため時刻範囲の検索には載らないが、古い順に消す対象には残る
+  void rebuildIndex() {
+    struct Found {
+      uint32_t fileNos[SAMPLE_LOG_INDEX_FILES]; // 昇順
+      size_t count;
+    };
+    static Found found;
+    found.count = 0;
+    storage_.listDir(cfg_.dir, [](const char *name, void *ctx) {
+      Found &f = *(Found *)ctx;
+      uint32_t fileNo;
+      if (!parseFileName(name, fileNo)) {
+        return;
+      }
+      // 昇順に挿入し、あふれたら最も古い番号を落とす
+      size_t i = f.count;
+      if (f.count == SAMPLE_LOG_INDEX_FILES) {
+        if (fileNo <= f.fileNos[0]) {
+          return;
+        }
+        memmove(f.fileNos, f.fileNos + 1, (f.count - 1) * sizeof(uint32_t));
+        i = --f.count;
+      }
+      while (i > 0 && f.fileNos[i - 1] > fileNo) {
+        f.fileNos[i] = f.fileNos[i - 1];
+        i--;
+      }
+      f.fileNos[i] = fileNo;
+      f.count++;
+    }, &found);
+    index_.clear();
+    for (size_t i = 0; i < found.count; i++) {
+      index_.add(found.fileNos[i]);
+    }
+    rebuilt_ = true;
+  }
+
+  // 書き込み中のファイルを閉じて次のファイルを開く。上限を超えるファイルは古いものから消す
+  bool rotate() {
+    if (open_) {
+      storage_.sync();
+      storage_.close();
+      open_ = false;
+    }
+    while (index_.size() >= cfg_.maxFiles) {
+      filePath(cfg_.dir, index_.at(0).fileNo, pathBuf_, sizeof(pathBuf_));
+      storage_.remove(pathBuf_);
+      index_.removeOldest();
+      filesRemoved_++;
+    }
+    uint32_t fileNo = nextFileNo_++;
+    filePath(cfg_.dir, fileNo, pathBuf_, sizeof(pathBuf_));
+    if (!storage_.open(pathBuf_)) {
+      errors_++;
+      return false;
+    }
+    open_ = true;
+    tailOpen_ = false;
+    fileBytes_ = 0;
+    index_.add(fileNo);
+    saveIndex();
+    return true;
+  }
+
+  LogStorage &storage_;
+  Config cfg_;
+  SampleLogIndex index_;
+  char pathBuf_[64];
+  char tmpPathBuf_[64];
+  bool open_ = false;
+  bool tailOpen_ = false; // 最後に書いたブロックが書きかけ
+  uint32_t nextFileNo_ = 0;
+  uint32_t fileBytes_ = 0;
+  uint32_t blocksSinceIndex_ = 0;
+  uint64_t bytesWritten_ = 0;
+  uint32_t filesRemoved_ = 0;
+  uint32_t errors_ = 0;
+  bool rebuilt_ = false;
+};
+
+// ブロックのサンプルを順に取り出す（ホスト側の解析用）
+class SampleLogBlockReader {
+public:
+  // ブロックを検証する。壊れている（CRC 不一致・未書き込み）なら false
+  bool begin(const uint8_t *block) {
+    h_ = (const SampleLogBlockHeader *)block;
+    i_ = 0;
+    if (h_->magic[0] != 'S' || h_->magic[1] != 'L' || h_->version != SAMPLE_LOG_VERSION ||
+        h_->count > SAMPLE_LOG_SAMPLES_PER_BLOCK || h_->crc != sampleLogBlockCrc(block)) {
+      return false;
+    }
+    rec_ = block + sizeof(SampleLogBlockHeader);
+    localMs_ = h_->firstLocalMs;
+    return true;
+  }
+
+  // unixMs は未同期のブロックでは0
+  bool next(uint32_t &localMs, uint64_t &unixMs, BatchSample &s) {
+    if (i_ >= h_->count) {
+      return false;
+    }
+    uint16_t dt;
+    memcpy(&dt, rec_, 2);
+    memcpy(&s, rec_ + 2, sizeof(BatchSample));
+    rec_ += SAMPLE_LOG_RECORD_SIZE;
+    localMs_ += dt;
+    i_++;
+    localMs = localMs_;
+    unixMs = h_->firstUnixMs != 0 ? h_->firstUnixMs + (localMs_ - h_->firstLocalMs) : 0;
+    return true;
+  }
+
+  const SampleLogBlockHeader &header() const { return *h_; }
+
+private:
+  const SampleLogBlockHeader *h_ = nullptr;
+  const uint8_t *rec_ = nullptr;
+  uint32_t localMs_ = 0;
+  uint8_t i_ = 0;
+};
+
+// ファイル（blocks 個のブロック）の中で、UNIX時刻 unixMs のサンプルを含みうる最初のブロックの番号
+// 同期済みのブロックは時刻順に並んでいるため二分探索する（未同期のブロックは先頭側にある）
+inline size_t sampleLogSeek(const uint8_t *file, size_t blocks, uint64_t unixMs) {
+  size_t lo = 0;
+  size_t hi = blocks;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    const SampleLogBlockHeader *h = (const SampleLogBlockHeader *)(file + mid * SAMPLE_LOG_BLOCK_SIZE);
+    if (h->firstUnixMs <= unixMs) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 ? lo - 1 : 0;
+}
+
+#ifdef ARDUINO
+// 記録中のバッファ（src/sample_log.cpp で定義）
+extern SampleLogBuffer sampleLog;
+
+// SD カードに書き出すタスクを起動する。SD カードがなければ false（記録しない）
+bool sampleLogBegin();
+
+// 書き出し待ちのバッファがあれば true（SD の書き込みがまもなく始まる。記録していなければ false）
+bool sampleLogWritePending();
+
+// 記録の状態をシリアルに出力する
+void sampleLogLogStats();
+#endif
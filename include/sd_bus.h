@@ -0,0 +1,19 @@
+#pragma once
+
+// LCD と SD カードが共用する SPI バスの調停
+//
+// Core2 の LCD と microSD は同じ SPI バスにつながっている。バス自体の排他は esp32-hal-spi のロックが
+// 取るが、SD の書き込みが詰まる（数百 ms）と、その間に描き始めた LCD はバスが空くまで待たされ、
+// loop()（センサーの取得・LoRa の応答処理）が止まる。
+// SD に書き込むタスク（uartTrace・sampleLog）は書き込みのあいだ sdBusLock() で待って確保し、
+// loop() の描画は sdBusTryLock() で待たずに試し、取れなければ描かずに次の loop() に回す。
+// setup() とモジュールの再初期化での描画は、もともと待つ処理なので調停しない。
+
+#ifdef ARDUINO
+// SD の書き込みの前後で呼ぶ（書き込みタスク用。描画中なら描き終わるまで待つ）
+void sdBusLock();
+void sdBusUnlock();
+
+// 待たずに確保する。SD の書き込み中なら false（loop() の描画用）
+bool sdBusTryLock();
+#endif
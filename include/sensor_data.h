@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+
+// ペイロード先頭バイトの上位3ビットはフレーム種別、下位5ビットはnodeId
+// SensorData は nodeId（0-10）がそのまま先頭バイトなので種別 0 になる
+#define FRAME_TYPE_MASK 0xE0
+#define FRAME_NODE_MASK 0x1F
+#define FRAME_TYPE_SENSOR 0x00
+#define FRAME_TYPE_EVENT 0x20
+#define FRAME_TYPE_BATCH 0x40
+#define FRAME_TYPE_DIAG 0x80
+
+// センサーデータ構造体（9バイト）
+// パディングを避けるため、packed属性を使用
+// ファームウェア（src/main.cpp）とホスト側デコーダ（tools/）で共通の定義
+// ※ESP32・x86ともにリトルエンディアン
+struct __attribute__((packed)) SensorData {
+  uint8_t nodeId;          // Byte 0: 0-10
+  uint16_t windDirection;  // Byte 1-2: 0-360 (度そのまま)
+  uint16_t airSpeed100;    // Byte 3-4: 0-5000 (値×100)
+  uint16_t virtualTemp100; // Byte 5-6: 0-5000 (値×100)
+  uint8_t rssiAbs;         // Byte 7: 0-99 (-rssiの絶対値)
+  uint8_t seq;             // Byte 8: 0-255 ローリングシーケンス番号（欠落検出用）
+  // uint32_t unixmilli;      // Byte 9-12: 0-864000000
+};
+
+static_assert(sizeof(SensorData) == 9, "SensorData layout changed: update decoders");
+
+// 診断フレーム（20バイト）
+// メモリ使用状況を定期的にアップリンクする。ヒープ量は8バイト単位
+struct __attribute__((packed)) DiagData {
+  uint8_t header;          // Byte 0: FRAME_TYPE_DIAG | nodeId
+  uint8_t seq;             // Byte 1: センサーデータと共通のシーケンス番号
+  uint16_t freeHeap8;      // Byte 2-3: 空きヒープ / 8
+  uint16_t minFreeHeap8;   // Byte 4-5: 起動以来の最小空きヒープ / 8
+  uint16_t largestBlock8;  // Byte 6-7: 最大確保可能ブロック / 8
+  uint16_t loopStackHwm;   // Byte 8-9: loopTask のスタック残量（バイト）
+  uint16_t allocs[4];      // Byte 10-17: 前回の診断フレームからの確保回数（command/session/uplink/display）
+  uint16_t uptimeMin;      // Byte 18-19: 起動からの経過時間（分）
+};
+
+static_assert(sizeof(DiagData) == 20, "DiagData layout changed: update decoders");
+
+// 時刻付きサンプルのバッチフレーム
+// BatchHeader（12バイト）に続いて、サンプルごとに [時刻オフセット 1バイト][BatchSample 7バイト]
+// サンプル i の時刻 = サンプル i-1 の時刻 + periodMs + オフセット（先頭サンプルは基準時刻 + オフセット）
+// オフセットは公称周期からのずれ（ミリ秒, int8）。-128 (0x80) の場合は続く2バイトが int16 のオフセット、
+// その int16 が -32768 (0x8000) の場合はさらに続く4バイトが int32 のオフセット
+// unixmilli（4バイト）を毎サンプル送る代わりに、サンプルあたり約1バイトでミリ秒精度の時刻を送る
+//
+// BATCH_FLAG_HELD（変化時のみ送信するモード、include/deadband_filter.h を参照）のフレームでは:
+//   - rssiAbs の最上位ビット BATCH_SAMPLE_HELD が立ったサンプルの直前には、不感帯内で送信を省いた
+//     サンプルがある。デコーダは前のサンプルの値を公称周期ごとに補完する
+//   - BATCH_FLAG_ANCHOR が立っていれば、先頭サンプルは前のフレームの最後のサンプルの再送（補完の起点）で、
+//     それ自体は行として出力しない
+#define BATCH_FLAG_SYNCED 0x01   // 基準時刻がUNIX時刻（未設定時は起動からの経過時間）
+#define BATCH_FLAG_TIME_REQ 0x02 // 時刻ダウンリンクの要求（include/timebase.h を参照）
+#define BATCH_FLAG_HELD 0x04     // 変化時のみ送信するモードのフレーム
+#define BATCH_FLAG_ANCHOR 0x08   // 先頭サンプルは前のフレームの最後のサンプル
+#define BATCH_OFFSET_ESCAPE (-128)
+#define BATCH_OFFSET_ESCAPE16 (-32768)
+#define BATCH_SAMPLE_HELD 0x80   // rssiAbs の最上位ビット: 直前に送信を省いたサンプルがある
+#define BATCH_RSSI_MASK 0x7F
+
+struct __attribute__((packed)) BatchHeader {
+  uint8_t header;          // Byte 0: FRAME_TYPE_BATCH | nodeId
+  uint8_t seq;             // Byte 1: センサーデータと共通のシーケンス番号
+  uint8_t flags;           // Byte 2: BATCH_FLAG_*
+  uint8_t count;           // Byte 3: サンプル数
+  uint32_t baseSec;        // Byte 4-7: 基準時刻（秒）
+  uint16_t baseMs;         // Byte 8-9: 基準時刻のミリ秒部分（0-999）
+  uint16_t periodMs;       // Byte 10-11: 公称サンプリング周期（ミリ秒）
+};
+
+static_assert(sizeof(BatchHeader) == 12, "BatchHeader layout changed: update decoders");
+
+struct __attribute__((packed)) BatchSample {
+  uint16_t windDirection;  // Byte 0-1: 0-360 (度そのまま)
+  uint16_t airSpeed100;    // Byte 2-3: 0-5000 (値×100)
+  uint16_t virtualTemp100; // Byte 4-5: 0-5000 (値×100)
+  uint8_t rssiAbs;         // Byte 6: 0-99 (-rssiの絶対値)、最上位ビットは BATCH_SAMPLE_HELD
+};
+
+static_assert(sizeof(BatchSample) == 7, "BatchSample layout changed: update decoders");
+
+// イベントフレーム（17バイト）
+// しきい値を超えた時点のサンプルを、定期送信のバッチより優先して送る
+#define EVENT_GUST 0x01           // 風速が突風のしきい値を超えた
+#define EVENT_TEMP_HIGH 0x02      // 温度が上限を超えた
+#define EVENT_TEMP_LOW 0x04       // 温度が下限を下回った
+#define EVENT_SENSOR_SILENT 0x08  // センサーからの応答が途絶えた
+#define EVENT_FLAG_SYNCED 0x01    // 時刻がUNIX時刻（未設定時は起動からの経過時間）
+#define EVENT_FLAG_ACK_REQ 0x02   // 確認応答ダウンリンクを要求（include/uplink_queue.h を参照）
+
+struct __attribute__((packed)) EventData {
+  uint8_t header;          // Byte 0: FRAME_TYPE_EVENT | nodeId
+  uint8_t seq;             // Byte 1: センサーデータと共通のシーケンス番号
+  uint8_t events;          // Byte 2: EVENT_*（同じサンプルで発生したもののOR）
+  uint8_t flags;           // Byte 3: EVENT_FLAG_*
+  uint32_t timeSec;        // Byte 4-7: 検出時刻（秒）
+  uint16_t timeMs;         // Byte 8-9: 検出時刻のミリ秒部分（0-999）
+  BatchSample sample;      // Byte 10-16: 検出時のサンプル
+};
+
+static_assert(sizeof(EventData) == 17, "EventData layout changed: update decoders");
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "uplink_session.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// ネットワーク時刻に同期したデバイス上の時刻基準
+//
+// サンプルの時刻は millis() で記録し、送信時に UNIX時刻（ミリ秒）へ換算する。
+// 同期はアップリンクに対する時刻ダウンリンクで行う（LoRaWAN の DeviceTimeReq/Ans と同じ考え方）:
+//   1. 未同期または前回の同期から一定時間が経ったら、アップリンクに時刻要求フラグを立てる
+//   2. サーバーはそのアップリンクを受信した時刻と seq をダウンリンクで返す
+//   3. デバイスは同じ seq をモジュールが受け付けた時刻（millis()）と対応付けて同期する
+// 同期点の誤差はモジュールの応答から電波送信完了までの時間（DR5 で数十ms）程度。
+//
+// millis() の水晶の周波数ずれ（数十ppm = 6時間で1秒前後）は、同期間隔ごとに
+// 観測したずれを指数平滑して推定し、同期間の換算時に補正する。
+// millis() は約49.7日で一周するため、同期が途絶えても換算は前後24日の範囲で有効。
+
+// 時刻ダウンリンク（8バイト）: [種別 0x01][応答する seq][UNIX時刻ミリ秒 48bit リトルエンディアン]
+#define TIME_DOWNLINK_TYPE 0x01
+#define TIME_DOWNLINK_SIZE 8
+
+// ダウンリンクのペイロード（nextDownlinkPayload()）が時刻ダウンリンクなら取り出す
+// 先頭バイトが種別で、長さがちょうど TIME_DOWNLINK_SIZE のものだけを受け付ける
+inline bool parseTimeDownlink(const uint8_t *payload, size_t len, uint8_t &seq, uint64_t &unixMs) {
+  if (len != TIME_DOWNLINK_SIZE || payload[0] != TIME_DOWNLINK_TYPE) {
+    return false;
+  }
+  seq = payload[1];
+  unixMs = 0;
+  for (int i = 0; i < 6; i++) {
+    unixMs |= (uint64_t)payload[2 + i] << (8 * i);
+  }
+  return true;
+}
+
+class Timebase {
+public:
+  static const int32_t kMaxDriftPpb = 500000;          // 推定する周波数ずれの上限（±500ppm）
+  static const uint32_t kMinDriftIntervalMs = 600000;  // これより短い同期間隔ではずれを推定しない
+  static const int kUplinkHistory = 8;
+  static const uint32_t kSyncSlackMs = 2000;           // 周波数ずれで説明できる範囲に加える余裕
+  static const int kMaxRejects = 3;                    // これだけ続けて外れたら時計が飛んだとみなして合わせ直す
+
+  // アップリンクがモジュールに受け付けられた時刻を記録する（時刻ダウンリンクとの対応付け用）
+  void noteUplink(uint8_t seq, uint32_t localMs) {
+    Uplink &u = uplinks_[next_];
+    u.seq = seq;
+    u.localMs = localMs;
+    u.valid = true;
+    next_ = (next_ + 1) % kUplinkHistory;
+  }
+
+  // 時刻ダウンリンクを適用する。対応するアップリンクが見つからなければ false
+  bool syncToUplink(uint8_t seq, uint64_t unixMs) {
+    // 新しい記録から探す（seq は256で一周するため）
+    for (int i = 1; i <= kUplinkHistory; i++) {
+      Uplink &u = uplinks_[(next_ + kUplinkHistory - i) % kUplinkHistory];
+      if (u.valid && u.seq == seq) {
+        u.valid = false;
+        return sync(unixMs, u.localMs);
+      }
+    }
+    return false;
+  }
+
+  // localMs の時点の UNIX時刻が unixMs だったとして同期する。同期済みで、前回からの経過時間と周波数ずれの
+  // 上限では説明できないほど外れた値は捨てて false を返す（UART で区切りがずれて別内容になったフレームの
+  // seq がたまたま一致した応答など）。kMaxRejects 回続いたらサーバー側の時計が変わったとみなして合わせ直す
+  bool sync(uint64_t unixMs, uint32_t localMs) {
+    if (synced_) {
+      int32_t errorMs = (int32_t)((int64_t)toUnixMs(localMs) - (int64_t)unixMs);
+      int32_t dl = (int32_t)(localMs - syncLocal_);
+      uint32_t limitMs = (uint32_t)((int64_t)(dl < 0 ? -dl : dl) * kMaxDriftPpb / 1000000000LL) + kSyncSlackMs;
+      if ((uint32_t)(errorMs < 0 ? -errorMs : errorMs) > limitMs && ++rejectsInRow_ < kMaxRejects) {
+        rejected_++;
+        return false;
+      }
+      if (rejectsInRow_ >= kMaxRejects) {
+        // 合わせ直し。ずれの推定もやり直す
+        synced_ = false;
+        driftPpb_ = 0;
+        driftSamples_ = 0;
+      }
+      rejectsInRow_ = 0;
+    }
+    if (synced_) {
+      lastErrorMs_ = (int32_t)((int64_t)toUnixMs(localMs) - (int64_t)unixMs);
+      int32_t dl = (int32_t)(localMs - syncLocal_);
+      if (dl >= (int32_t)kMinDriftIntervalMs) {
+        // 前回の同期からの実時間と millis() の進みの比（ppb）
+        int64_t du = (int64_t)(unixMs - syncUnix_);
+        int64_t measured = (du - dl) * 1000000000LL / dl;
+        if (measured > kMaxDriftPpb) {
+          measured = kMaxDriftPpb;
+        } else if (measured < -kMaxDriftPpb) {
+          measured = -kMaxDriftPpb;
+        }
+        driftPpb_ = driftSamples_ == 0 ? (int32_t)measured
+                                       : driftPpb_ + (int32_t)((measured - driftPpb_) / 4);
+        driftSamples_++;
+      }
+    }
+    syncUnix_ = unixMs;
+    syncLocal_ = localMs;
+    synced_ = true;
+    syncs_++;
+    return true;
+  }
+
+  // millis() の値を UNIX時刻（ミリ秒）に換算する。未同期なら 0
+  uint64_t toUnixMs(uint32_t localMs) const {
+    if (!synced_) {
+      return 0;
+    }
+    int64_t dl = (int32_t)(localMs - syncLocal_);
+    return syncUnix_ + dl + dl * driftPpb_ / 1000000000LL;
+  }
+
+  bool synced() const { return synced_; }
+  uint32_t lastSyncLocalMs() const { return syncLocal_; }
+  uint32_t syncs() const { return syncs_; }
+  int32_t driftPpb() const { return driftPpb_; }
+  int32_t lastErrorMs() const { return lastErrorMs_; }
+  uint32_t rejectedSyncs() const { return rejected_; }
+
+private:
+  struct Uplink {
+    uint8_t seq;
+    bool valid;
+    uint32_t localMs;
+  };
+
+  Uplink uplinks_[kUplinkHistory] = {};
+  int next_ = 0;
+  bool synced_ = false;
+  uint64_t syncUnix_ = 0;
+  uint32_t syncLocal_ = 0;
+  int32_t driftPpb_ = 0;
+  uint32_t driftSamples_ = 0;
+  int32_t lastErrorMs_ = 0;
+  uint32_t syncs_ = 0;
+  uint32_t rejected_ = 0;
+  int rejectsInRow_ = 0;
+};
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// UART 通信の記録（トレース）
+//
+// M-BUS 干渉や NG 102 の嵐（MBUS_INTERFERENCE_ANALYSIS.md / NG102_INVESTIGATION.md）は実機でしか起きず、
+// 再現できない。Serial1（ES920LR3）の送受信と Serial2（M-BUS）の受信をミリ秒単位の時刻付きで
+// SD カードに記録し、ホスト側の tools/uart_replay.cpp で仮想時刻に沿ってプロトコル処理へ
+// 流し直すことで、現場で起きた事象を何度でも同じ条件で測れるベンチマークにする。
+//
+// ファイル形式（リトルエンディアン）:
+//   ヘッダ16バイト: "UTRC" / バージョン(u8) / 予約(3) / 開始時の millis()(u32) / 開始時の UNIX時刻 秒(u32, 未同期は0)
+//   以降レコードの列:
+//     [種別 1バイト][前のレコードからの経過ms LEB128][本体]
+//     種別の上位2ビットがチャネル。データ（0-2）は下位6ビットが バイト数-1（1-64バイト）で、本体はそのバイト列
+//     マーク（3）は下位6ビットがマークの種類で、本体は種類ごとの引数（UTRACE_MARK_* を参照）
+// 同じチャネルで同じミリ秒に届いたバイトは1レコードにまとめるため、1バイトあたりの記録量は
+// 連続した応答で約1.05バイト、散発的なバイトでも3バイト程度。
+//
+// 記録は loop() から UartTraceRecorder に追加し（1つの書き込み側）、SD への書き出しは別タスクが
+// read() で取り出す（1つの読み出し側）。リングバッファはロックを使わないため、SD の書き込みが
+// 詰まっても UART の処理は止まらない。あふれたぶんは捨てて、失ったバイト数をマークで残す。
+
+#define UTRACE_MAGIC "UTRC"
+#define UTRACE_VERSION 1
+#define UTRACE_HEADER_SIZE 16
+
+// チャネル
+#define UTRACE_CH_LORA_TX 0 // Serial1 送信（ES920LR3 へのコマンド・アップリンク）
+#define UTRACE_CH_LORA_RX 1 // Serial1 受信（ES920LR3 の応答）
+#define UTRACE_CH_MBUS_RX 2 // Serial2 受信（M-BUS、ULSA M5B）
+#define UTRACE_CH_MARK 3
+
+#define UTRACE_MAX_DATA 64
+
+// マークの種類（本体）
+#define UTRACE_MARK_UPLINK 1  // アップリンクを送信した（seq u8）
+#define UTRACE_MARK_COMMAND 2 // コマンドを送信した（CommandType u8）
+#define UTRACE_MARK_LOST 3    // バッファあふれで記録できなかった（バイト数 LEB128、マークは1と数える）
+
+// LEB128 で書き込み、書き込んだバイト数を返す（最大5バイト）
+inline size_t utracePutVarint(uint8_t *out, uint32_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+class UartTraceRecorder {
+public:
+  // buf: リングバッファ（容量は2のべき乗）
+  UartTraceRecorder(uint8_t *buf, uint32_t capacity) : buf_(buf), mask_(capacity - 1) {}
+
+  // 記録を始める（ヘッダを書き込む）。以前の内容は捨てる
+  void begin(uint32_t nowMs, uint32_t unixSec) {
+    __atomic_store_n(&head_, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&tail_, 0, __ATOMIC_RELEASE);
+    openLen_ = 0;
+    lastMs_ = nowMs;
+    pendingLost_ = 0;
+    uint8_t h[UTRACE_HEADER_SIZE] = {};
+    memcpy(h, UTRACE_MAGIC, 4);
+    h[4] = UTRACE_VERSION;
+    memcpy(h + 8, &nowMs, 4);
+    memcpy(h + 12, &unixSec, 4);
+    put(h, sizeof(h));
+    active_ = true;
+  }
+
+  // 記録を止める（まとめ中のレコードは書き出す）
+  void end() {
+    close();
+    active_ = false;
+  }
+
+  bool active() const { return active_; }
+
+  // 1バイト記録する。同じチャネル・同じミリ秒のバイトは1レコードにまとめる
+  void byte(uint8_t ch, uint8_t b, uint32_t nowMs) {
+    if (!active_) {
+      return;
+    }
+    if (openLen_ > 0 && (ch != openCh_ || nowMs != openMs_ || openLen_ == UTRACE_MAX_DATA)) {
+      close();
+    }
+    if (openLen_ == 0) {
+      openCh_ = ch;
+      openMs_ = nowMs;
+    }
+    open_[openLen_++] = b;
+  }
+
+  void bytes(uint8_t ch, const uint8_t *p, size_t n, uint32_t nowMs) {
+    for (size_t i = 0; i < n; i++) {
+      byte(ch, p[i], nowMs);
+    }
+  }
+
+  // マークを記録する
+  void mark(uint8_t type, uint8_t arg, uint32_t nowMs) {
+    if (!active_) {
+      return;
+    }
+    close();
+    uint8_t rec[1 + 5 + 1];
+    size_t n = 0;
+    rec[n++] = (uint8_t)(UTRACE_CH_MARK << 6 | type);
+    n += utracePutVarint(rec + n, nowMs - lastMs_);
+    rec[n++] = arg;
+    if (commit(rec, n)) {
+      lastMs_ = nowMs;
+    } else {
+      pendingLost_++; // 捨てたマークは1バイトとして数える
+    }
+  }
+
+  // まとめ中のレコードが古くなっていれば書き出す（loop() から定期的に呼ぶ）
+  void poll(uint32_t nowMs) {
+    if (openLen_ > 0 && nowMs != openMs_) {
+      close();
+    }
+  }
+
+  // 書き出し用に取り出す（読み出し側のタスクから呼ぶ）。取り出したバイト数を返す
+  size_t read(uint8_t *out, size_t maxLen) {
+    uint32_t tail = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+    size_t n = head - tail;
+    if (n > maxLen) {
+      n = maxLen;
+    }
+    for (size_t i = 0; i < n; i++) {
+      out[i] = buf_[(tail + i) & mask_];
+    }
+    __atomic_store_n(&tail_, tail + (uint32_t)n, __ATOMIC_RELEASE);
+    return n;
+  }
+
+  // 取り出せるバイト数
+  size_t pending() const {
+    return __atomic_load_n(&head_, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+  }
+
+  uint32_t lostBytes() const { return lostBytes_; }
+  uint32_t recordedBytes() const { return recordedBytes_; }
+
+private:
+  // まとめ中のデータレコードを書き出す
+  void close() {
+    if (openLen_ == 0) {
+      return;
+    }
+    uint8_t rec[1 + 5 + UTRACE_MAX_DATA];
+    size_t n = 0;
+    rec[n++] = (uint8_t)(openCh_ << 6 | (openLen_ - 1));
+    n += utracePutVarint(rec + n, openMs_ - lastMs_);
+    memcpy(rec + n, open_, openLen_);
+    n += openLen_;
+    if (commit(rec, n)) {
+      lastMs_ = openMs_;
+      recordedBytes_ += openLen_;
+    } else {
+      lostBytes_ += openLen_;
+      pendingLost_ += openLen_;
+    }
+    openLen_ = 0;
+  }
+
+  // レコードをリングに追加する。入らなければ false（レコードごと捨てる）
+  // 直前に捨てたレコードがあれば、先に失ったバイト数のマークを入れる
+  bool commit(const uint8_t *rec, size_t n) {
+    if (pendingLost_ > 0) {
+      uint8_t lost[1 + 5 + 5];
+      size_t m = 0;
+      lost[m++] = (uint8_t)(UTRACE_CH_MARK << 6 | UTRACE_MARK_LOST);
+      lost[m++] = 0; // 経過時間 0（次のレコードと同じ時刻）
+      m += utracePutVarint(lost + m, pendingLost_);
+      if (space() < m + n) {
+        return false;
+      }
+      put(lost, m);
+      pendingLost_ = 0;
+    }
+    if (space() < n) {
+      return false;
+    }
+    put(rec, n);
+    return true;
+  }
+
+  size_t space() const {
+    return mask_ + 1 - (head_ - __atomic_load_n(&tail_, __ATOMIC_ACQUIRE));
+  }
+
+  void put(const uint8_t *p, size_t n) {
+    uint32_t head = head_;
+    for (size_t i = 0; i < n; i++) {
+      buf_[(head + i) & mask_] = p[i];
+    }
+    __atomic_store_n(&head_, head + (uint32_t)n, __ATOMIC_RELEASE);
+  }
+
+  uint8_t *buf_;
+  uint32_t mask_;
+  uint32_t head_ = 0; // 書き込み側だけが更新する
+  uint32_t tail_ = 0; // 読み出し側だけが更新する
+  bool active_ = false;
+  uint32_t lastMs_ = 0;
+  uint8_t open_[UTRACE_MAX_DATA];
+  uint8_t openLen_ = 0;
+  uint8_t openCh_ = 0;
+  uint32_t openMs_ = 0;
+  uint32_t pendingLost_ = 0;
+  uint32_t lostBytes_ = 0;
+  uint32_t recordedBytes_ = 0;
+};
+
+// トレースのレコードを順に取り出す（ホスト側の再生用）
+class UartTraceReader {
+public:
+  struct Record {
+    uint8_t channel;      // UTRACE_CH_*
+    uint8_t markType;     // マークの種類（channel == UTRACE_CH_MARK のとき）
+    uint32_t markArg;     // マークの引数
+    uint32_t timeMs;      // 記録時の millis()
+    const uint8_t *data;  // データ（channel が 0-2 のとき）
+    size_t len;
+  };
+
+  // ヘッダを検証する。トレースでなければ false
+  bool begin(const uint8_t *p, size_t len) {
+    p_ = p;
+    end_ = p + len;
+    truncated_ = false;
+    if (len < UTRACE_HEADER_SIZE || memcmp(p, UTRACE_MAGIC, 4) != 0 || p[4] != UTRACE_VERSION) {
+      return false;
+    }
+    memcpy(&startMs_, p + 8, 4);
+    memcpy(&startUnixSec_, p + 12, 4);
+    timeMs_ = startMs_;
+    p_ += UTRACE_HEADER_SIZE;
+    return true;
+  }
+
+  // 次のレコードを取り出す。終わりまたは途中で切れていたら false
+  bool next(Record &r) {
+    if (p_ >= end_) {
+      return false;
+    }
+    uint8_t type = *p_++;
+    uint32_t delta;
+    if (!varint(delta)) {
+      return false;
+    }
+    timeMs_ += delta;
+    r.channel = type >> 6;
+    r.timeMs = timeMs_;
+    r.data = nullptr;
+    r.len = 0;
+    r.markType = 0;
+    r.markArg = 0;
+    if (r.channel != UTRACE_CH_MARK) {
+      r.len = (type & 0x3F) + 1;
+      if ((size_t)(end_ - p_) < r.len) {
+        truncated_ = true;
+        return false;
+      }
+      r.data = p_;
+      p_ += r.len;
+      return true;
+    }
+    r.markType = type & 0x3F;
+    if (r.markType == UTRACE_MARK_LOST) {
+      return varint(r.markArg);
+    }
+    if (p_ >= end_) {
+      truncated_ = true;
+      return false;
+    }
+    r.markArg = *p_++;
+    return true;
+  }
+
+  uint32_t startMs() const { return startMs_; }
+  uint32_t startUnixSec() const { return startUnixSec_; }
+  bool truncated() const { return truncated_; }
+
+private:
+  bool varint(uint32_t &v) {
+    v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      if (p_ >= end_) {
+        truncated_ = true;
+        return false;
+      }
+      uint8_t b = *p_++;
+      v |= (uint32_t)(b & 0x7F) << shift;
+      if ((b & 0x80) == 0) {
+        return true;
+      }
+    }
+    truncated_ = true;
+    return false;
+  }
+
+  const uint8_t *p_ = nullptr;
+  const uint8_t *end_ = nullptr;
+  uint32_t startMs_ = 0;
+  uint32_t startUnixSec_ = 0;
+  uint32_t timeMs_ = 0;
+  bool truncated_ = false;
+};
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+// 記録中のトレース（src/uart_trace.cpp で定義）
+extern UartTraceRecorder uartTrace;
+
+// SD カードにトレースを書き出すタスクを起動する。SD カードがなければ false（記録しない）
+bool uartTraceBegin(uint32_t unixSec);
+
+// 記録の状態をシリアルに出力する
+void uartTraceLogStats();
+
+// 送受信したバイトを記録するシリアルポート
+// Serial1/Serial2 の代わりに読み書きに使う（begin() 等の設定は元のポートで行う）
+class TracedSerial : public Stream {
+public:
+  TracedSerial(Stream &port, uint8_t txChannel, uint8_t rxChannel)
+      : port_(port), tx_(txChannel), rx_(rxChannel) {}
+
+  int available() override { return port_.available(); }
+  int peek() override { return port_.peek(); }
+  void flush() override { port_.flush(); }
+
+  int read() override {
+    int c = port_.read();
+    if (c >= 0) {
+      uartTrace.byte(rx_, (uint8_t)c, millis());
+    }
+    return c;
+  }
+
+  size_t write(uint8_t b) override {
+    uartTrace.byte(tx_, b, millis());
+    return port_.write(b);
+  }
+
+  size_t write(const uint8_t *buf, size_t n) override {
+    uartTrace.bytes(tx_, buf, n, millis());
+    return port_.write(buf, n);
+  }
+
+  using Print::write;
+
+private:
+  Stream &port_;
+  uint8_t tx_;
+  uint8_t rx_;
+};
+#endif
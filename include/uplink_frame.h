@@ -0,0 +1,141 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ES920LR3 へのアップリンク送信フレームの組み立て
+//
+// ペイロードをそのまま書き込んで CR+LF で終端すると、windDirection = 10/13 などで
+// ペイロード中に 0x0D/0x0A が現れた時点でモジュールがコマンドの終わりと判断し、
+// 切り詰められたフレームの送信や NG になる。任意のバイト列を確実に送るため、
+// モジュールの送信フォーマットに合わせて以下のどちらかで送る。
+//
+// 参考: ES920LR3_LoRaWAN_コマンド仕様ソフトウェア説明書_1.01.pdf の format コマンド
+//   "format 1" = ASCII  : CR+LF までの文字列を1つの送信データとし、文字をそのまま送信する
+//   "format 2" = BINARY : 先頭1バイトが以降のデータ長。終端文字なし
+//   - バイナリ: [長さ 1バイト][ペイロード]      UART n+1 バイト、エアー上 n バイト
+//   - 16進文字列（ASCII）: [ペイロードの16進表記][CR LF]  UART 2n+2 バイト、エアー上 2n バイト
+// ASCII フォーマットではモジュールは16進表記をバイナリに戻さない。エアー上のペイロードは
+// 16進表記の文字列そのもので2倍の長さになるため、送れるペイロード長は半分になり
+// （maxPayloadForFormat）、送信時間もその長さで見積もる（airPayloadSize）。受信側
+// （tools/uplink_decoder.cpp）は16進表記のペイロードを判別してバイナリに戻す。
+// UART のバイト数も送信時間も少ないバイナリを優先し、モジュールがバイナリ設定を
+// 受け付けなかった場合のみ16進文字列を使う。
+//
+// バイナリには再同期の仕組みがない。UART でバイトが1つ欠けると、モジュールは残りの1バイトを
+// 待ち続け、次のフレームの先頭をその続きとして取り込んでしまい、以降の区切りがずれる。
+// モジュールは区切りのずれを自分では検出しない（仕様書に文字間タイムアウトの記載はない）。
+// 送信要求1つにはちょうど1つの "OK"/NG が返るが、ずれている間は応答が返らない（タイムアウト）か、
+// 1つのフレームから2つ以上の送信要求ができて照合先のない応答が返る。FrameSyncMonitor でこれを
+// 数え（include/uplink_loop.h の UplinkLoop::checkFrameSync()）、ずれたと判断したらファームウェアは
+// NRST でモジュールの受信状態を消して設定からやり直す。ESP32 は再起動しないため、未送信のサンプルや
+// イベント、時刻同期はそのまま引き継ぐ。短時間に繰り返す場合だけ ESP32 ごと再起動する（ModuleResetLimiter）。
+
+enum FrameFormat {
+  FRAME_FORMAT_BINARY = 0,
+  FRAME_FORMAT_HEX = 1
+};
+
+// データレートごとの最大アプリケーションペイロード長（AS923、ドウェルタイム400ms制限あり）
+// DR0/DR1 はドウェルタイム制限により送信不可
+inline size_t maxPayloadForDatarate(uint8_t dr) {
+  static const uint8_t kMaxPayload[8] = {0, 0, 11, 53, 125, 242, 242, 242};
+  return dr < 8 ? kMaxPayload[dr] : 0;
+}
+
+// フォーマットごとのエアー上のペイロード長（ASCII は16進表記の文字列がそのまま送られる）
+inline size_t airPayloadSize(FrameFormat fmt, size_t len) {
+  return fmt == FRAME_FORMAT_BINARY ? len : 2 * len;
+}
+
+// フォーマットとデータレートで送れる最大ペイロード長（16進文字列は半分）
+inline size_t maxPayloadForFormat(FrameFormat fmt, uint8_t dr) {
+  return maxPayloadForDatarate(dr) / (fmt == FRAME_FORMAT_BINARY ? 1 : 2);
+}
+
+// フォーマットごとの UART 上のバイト数
+inline size_t uplinkFrameSize(FrameFormat fmt, size_t len) {
+  return fmt == FRAME_FORMAT_BINARY ? len + 1 : 2 * len + 2;
+}
+
+// フレームを組み立てて out に書き込み、書き込んだバイト数を返す
+// ペイロードが空・255バイト超・出力バッファ不足の場合は 0
+inline size_t encodeUplinkFrame(FrameFormat fmt, const uint8_t *payload, size_t len,
+                                uint8_t *out, size_t outCap) {
+  static const char kHex[] = "0123456789ABCDEF";
+  if (len == 0 || len > 255 || uplinkFrameSize(fmt, len) > outCap) {
+    return 0;
+  }
+  if (fmt == FRAME_FORMAT_BINARY) {
+    out[0] = (uint8_t)len;
+    for (size_t i = 0; i < len; i++) {
+      out[1 + i] = payload[i];
+    }
+    return len + 1;
+  }
+  for (size_t i = 0; i < len; i++) {
+    out[2 * i] = (uint8_t)kHex[payload[i] >> 4];
+    out[2 * i + 1] = (uint8_t)kHex[payload[i] & 0x0F];
+  }
+  out[2 * len] = '\r';
+  out[2 * len + 1] = '\n';
+  return 2 * len + 2;
+}
+
+// バイナリのフレームの区切りのずれの検出
+// 照合できなかった応答（タイムアウト・照合先のない応答）ごとに点数を加え、照合できた応答ごとに減らす。
+// 正常時も応答の遅れ（タイムアウトの後に遅れて届く "OK"）で時々加点されるが、続けて起きなければ
+// しきい値に届かない。ずれている間はほぼ毎回加点されるため数フレームで検出できる。
+class FrameSyncMonitor {
+public:
+  static const uint8_t kAnomalyPoints = 2;
+  static const uint8_t kThreshold = 12;
+
+  // 送信要求と照合できた "OK"/NG
+  void onMatched() {
+    if (score_ > 0) {
+      score_--;
+    }
+  }
+
+  // モジュール応答なしのタイムアウト、または照合先のない "OK"/NG。ずれたと判断したら true
+  bool onAnomaly() {
+    score_ += kAnomalyPoints;
+    if (score_ >= kThreshold) {
+      score_ = 0;
+      return true;
+    }
+    return false;
+  }
+
+  void reset() { score_ = 0; }
+  uint8_t score() const { return score_; }
+
+private:
+  uint8_t score_ = 0;
+};
+
+// モジュールだけのリセット（NRST + 設定・Join のやり直し）の回数制限
+// kWindowMs の間に kMaxResets 回を超えたら、モジュール以外（UART ドライバなど）に原因があるとみなして
+// ESP32 ごと再起動する
+class ModuleResetLimiter {
+public:
+  static const uint8_t kMaxResets = 3;
+  static const uint32_t kWindowMs = 3600000;
+
+  // リセットを記録する。直前の kMaxResets 回がすべて窓の中なら false（ESP32 ごと再起動する）
+  bool allow(uint32_t nowMs) {
+    bool exceeded = count_ >= kMaxResets && nowMs - times_[next_] < kWindowMs;
+    times_[next_] = nowMs;
+    next_ = (uint8_t)((next_ + 1) % kMaxResets);
+    if (count_ < kMaxResets) {
+      count_++;
+    }
+    return !exceeded;
+  }
+
+private:
+  uint32_t times_[kMaxResets] = {0};
+  uint8_t next_ = 0;
+  uint8_t count_ = 0;
+};
@@ -0,0 +1,479 @@
+#pragma once
+
+#include "airtime_budget.h"
+#include "deadband_filter.h"
+#include "rtt_estimator.h"
+#include "sample_batch.h"
+#include "sensor_data.h"
+#include "timebase.h"
+#include "uplink_frame.h"
+#include "uplink_queue.h"
+#include "uplink_scheduler.h"
+#include "uplink_session.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// loop() のアップリンク処理（送信スロット・モジュール応答の照合・イベントの優先送信・時刻同期・診断フレーム）
+//
+// ファームウェア（src/main.cpp）とソークベンチマーク（tools/uplink_soak.cpp）の両方がこのクラスを使う。
+// UART への書き込み、診断フレームの中身、再起動、ログ出力など環境に依存する部分は UplinkPort で
+// 差し替えるため、ソークはファームウェアと同じ状態遷移をエミュレータにつないで検証できる。
+// 部品（scheduler / session / events ...）は公開メンバーで、ファームウェアは統計の表示に直接参照する。
+
+// 送信したフレームの種別
+enum UplinkKind {
+  UPLINK_EVENT = 0,
+  UPLINK_DIAG,
+  UPLINK_BATCH
+};
+
+// 環境に依存する処理。ログ出力用の通知は既定では何もしない
+class UplinkPort {
+public:
+  virtual ~UplinkPort() {}
+
+  // 組み立てたフレーム（include/uplink_frame.h）をモジュールへ書き込む
+  virtual void writeFrame(const uint8_t *frame, size_t len) = 0;
+  // モジュールの再起動（"Select Mode"）を検出した
+  virtual void onModuleReboot() = 0;
+  // バイナリのフレームの区切りがずれた（FrameSyncMonitor）
+  virtual void onFrameDesync() = 0;
+  // 診断フレームの header と seq 以外を埋める
+  virtual void fillDiag(DiagData &diag) { (void)diag; }
+
+  // 送信要求を書き込んだ（count はバッチに含めたサンプル数）
+  virtual void onSent(UplinkKind kind, uint8_t seq, const uint8_t *payload, size_t len, size_t count,
+                      uint32_t airtimeUs) {
+    (void)kind, (void)seq, (void)payload, (void)len, (void)count, (void)airtimeUs;
+  }
+  // 送信結果（EV_ACCEPTED / EV_REJECTED / EV_TIMEOUT / EV_CONFIRMED）を処理した
+  virtual void onResult(SessionEvent ev) { (void)ev; }
+  virtual void onEventDetected(uint8_t events) { (void)events; }
+  // イベントがモジュールに受け付けられた・確認応答が届いた（検出からの遅延）
+  virtual void onEventAccepted(uint8_t seq, uint32_t latencyMs) { (void)seq, (void)latencyMs; }
+  virtual void onEventAcked(uint8_t seq, uint32_t latencyMs) { (void)seq, (void)latencyMs; }
+  // 時刻ダウンリンクを受信した（applied: 対応するアップリンクがあり同期した）
+  virtual void onTimeDownlink(uint8_t seq, uint64_t unixMs, bool applied) { (void)seq, (void)unixMs, (void)applied; }
+  // 予算不足で定期送信のスロットを見送った
+  virtual void onSlotDeferred() {}
+  // データレートの上限を超えるペイロードを送らなかった
+  virtual void onOversize(size_t len) { (void)len; }
+};
+
+struct UplinkLoopConfig {
+  uint8_t nodeId = 0;
+  uint8_t nodeCount = 1;
+  uint32_t periodMs = 10000;           // 送信スロットの周期
+  uint32_t jitterMs = 0;               // スロットごとの揺らぎ
+  uint32_t moduleTimeoutMs = 5000;     // 送信から "OK"/NG までの待ち上限（初期値）
+  uint32_t moduleTimeoutMinMs = 1000;  // 同下限（期限切れ後の応答を次の送信と取り違えないため）
+  uint32_t confirmTimeoutMs = 30000;   // ネットワーク確認応答までの待ち上限
+  uint32_t samplePeriodMs = 1000;      // センサー値の取得周期
+  uint32_t timeSyncIntervalMs = 0;     // 時刻ダウンリンクを要求する間隔
+  uint32_t budgetPermille = 20;        // 送信時間の予算（‰）
+  uint32_t burstMs = 4000;             // 連続して使える送信時間
+  uint32_t eventReserveFrames = 3;     // 定期送信が残しておくイベントフレームの送信時間（フレーム数）
+  uint32_t minGapMs = 2500;            // 送信後、次の送信要求までの最小間隔（受信窓が閉じるまで）
+  bool eventAckRequired = false;       // イベントの確認応答ダウンリンクを要求する
+  uint32_t eventAckTimeoutMs = 60000;
+  uint8_t eventMaxRetries = 3;
+  bool reportByException = false;      // 変化時のみ送信するモード（include/deadband_filter.h）
+  uint32_t diagIntervalSlots = 0;      // 診断フレームを送るスロット間隔（0 で送らない）
+  uint8_t datarate = 5;
+  FrameFormat format = FRAME_FORMAT_BINARY;
+};
+
+class UplinkLoop {
+public:
+  // serviceSlot() の結果
+  enum SlotResult {
+    SLOT_IDLE = 0,  // スロットに達していない・イベントやモジュールの応答待ち
+    SLOT_SKIPPED,   // 送るサンプルがない・予算不足・送れなかったためスロットを進めた
+    SLOT_DIAG_SENT,
+    SLOT_BATCH_SENT
+  };
+
+  UplinkLoop(const UplinkLoopConfig &config, UplinkPort &port)
+      : cfg(config),
+        scheduler(config.periodMs, config.jitterMs, config.nodeCount),
+        session(config.moduleTimeoutMs, config.confirmTimeoutMs),
+        events(config.eventAckRequired, config.eventAckTimeoutMs, config.eventMaxRetries),
+        budget(config.budgetPermille, config.burstMs),
+        port_(port) {}
+
+  UplinkLoopConfig cfg;
+  UplinkScheduler scheduler;
+  UplinkSession session;
+  CommandTimeouts timeouts;
+  Timebase timebase;
+  SampleRing samples;
+  DeadbandFilter filter{Deadbands()};
+  EventDetector detector{EventThresholds()};
+  EventQueue events;
+  AirtimeBudget budget;
+  FrameSyncMonitor frameSync;
+
+  // 送信スロットを開始する（Join 完了時）
+  void begin(uint32_t nowMs) {
+    scheduler.begin(cfg.nodeId, nowMs);
+    session.setModuleTimeoutMs(moduleTimeoutMs());
+  }
+
+  // モジュールを初期化し直した後の状態に戻す。応答待ちの送信は破棄し、イベントは送信待ちに戻す
+  // （サンプル・時刻基準・応答時間の推定値・シーケンス番号は引き継ぐ）
+  void reset(uint32_t resumeMs) {
+    session.reset();
+    frameSync.reset();
+    events.reset();
+    samplesPending_ = false;
+    lastTxMs_ = resumeMs - cfg.minGapMs;
+    lastAirtimeUs_ = 0;
+    scheduler.begin(cfg.nodeId, resumeMs);
+    alignSlots();
+  }
+
+  // アップリンクの "OK"/NG 待ちタイムアウト（推定値。下限あり）
+  uint32_t moduleTimeoutMs() const {
+    uint32_t ms = timeouts[CMD_UPLINK].timeoutMs();
+    return ms < cfg.moduleTimeoutMinMs ? cfg.moduleTimeoutMinMs : ms;
+  }
+
+  size_t maxPayload() const { return maxPayloadForFormat(cfg.format, cfg.datarate); }
+
+  // ペイロード len バイトの送信時間（16進文字列ではエアー上の長さが2倍）
+  uint32_t airtimeUs(size_t len) const { return loraAirtimeUs(cfg.datarate, airPayloadSize(cfg.format, len)); }
+
+  // 取得したサンプル。イベントを検出し、送るサンプルをリングに積む。新たに発生したイベントを返す
+  uint8_t onSample(const BatchSample &sample, uint32_t nowMs) {
+    uint8_t raised = detector.onSample(sample, nowMs);
+    BatchSample reported = sample;
+    if (!cfg.reportByException || filter.offer(reported, nowMs)) {
+      samples.push(nowMs, reported);
+    }
+    queueEvent(raised, sample, nowMs);
+    return raised;
+  }
+
+  // サンプルが取れなかった周期。送信を省いていたサンプルがあれば最後の1件を送り、
+  // 取れなかった区間が補完されないようにする。センサーの沈黙を判定する
+  uint8_t onSampleMissed(uint32_t nowMs) {
+    BatchSample held;
+    uint32_t heldMs;
+    if (cfg.reportByException && filter.interrupt(held, heldMs)) {
+      samples.push(heldMs, held);
+    }
+    uint8_t raised = detector.poll(nowMs);
+    queueEvent(raised, detector.lastSample(), nowMs);
+    return raised;
+  }
+
+  // モジュールの受信バイトを1つ処理する。表示の更新が必要なら true
+  bool feed(char c, uint32_t nowMs) { return handle(session.feed(c, nowMs), nowMs); }
+
+  // タイムアウトを処理する。表示の更新が必要なら true
+  bool poll(uint32_t nowMs) {
+    bool changed = handle(session.poll(nowMs), nowMs);
+    events.poll(nowMs);
+    return changed;
+  }
+
+  // モジュールが次の送信要求を受け付けられるか（応答待ちがなく、前の送信の受信窓が閉じている）
+  bool moduleReady(uint32_t nowMs) const {
+    return session.awaitingModule() == 0 && nowMs - lastTxMs_ >= cfg.minGapMs;
+  }
+
+  // 送信待ちのイベントがあれば、送信スロットを待たずに送る
+  // モジュールが空いていて予算が許す最初の機会に送る（予算の予約はイベントのために残してある）
+  bool sendPendingEvent(uint32_t nowMs) {
+    int i = events.ready(nowMs);
+    if (i < 0 || !moduleReady(nowMs)) {
+      return false;
+    }
+    uint32_t airtime = airtimeUs(sizeof(EventData));
+    budget.update(nowMs);
+    if (!budget.canSend(airtime)) {
+      return false;
+    }
+    EventData ev;
+    uint8_t seq = session.peekSeq();
+    events.fill(i, cfg.nodeId, seq, ev);
+    uint32_t detectedMs = events.detectedMs(i);
+    uint64_t t = timebase.synced() ? timebase.toUnixMs(detectedMs) : detectedMs;
+    ev.flags |= timebase.synced() ? EVENT_FLAG_SYNCED : 0;
+    ev.timeSec = (uint32_t)(t / 1000);
+    ev.timeMs = (uint16_t)(t % 1000);
+    if (!sendFrame((const uint8_t *)&ev, sizeof(EventData), nowMs, airtime)) {
+      return false;
+    }
+    events.onSent(i, seq);
+    port_.onSent(UPLINK_EVENT, seq, (const uint8_t *)&ev, sizeof(EventData), 0, airtime);
+    return true;
+  }
+
+  // 送信スロットに達していれば、未送信のサンプル（一定スロットごとに診断フレーム）を送る
+  // イベントの送信待ちがある間と、モジュールが前の送信を処理中の間は定期送信を待たせる
+  // 待っている間にスロットの半周期を過ぎたら、そのスロットは isDue() 内で読み飛ばされる
+  SlotResult serviceSlot(uint32_t nowMs) {
+    if (!scheduler.isDue(nowMs) || events.blocking() || !moduleReady(nowMs)) {
+      return SLOT_IDLE;
+    }
+    budget.update(nowMs);
+    uint32_t reserveUs = cfg.eventReserveFrames * airtimeUs(sizeof(EventData));
+    elapsedMs_ = lastSlotSendMs_ != 0 ? nowMs - lastSlotSendMs_ : 0;
+
+    // 一定スロットごとにセンサーデータの代わりに診断フレームを送る
+    if (cfg.diagIntervalSlots > 0 && scheduler.slotIndex() % cfg.diagIntervalSlots == cfg.diagIntervalSlots - 1) {
+      uint32_t airtime = airtimeUs(sizeof(DiagData));
+      if (!budget.canSend(airtime, reserveUs)) {
+        scheduler.markSent(nowMs);
+        deferredSlots_++;
+        port_.onSlotDeferred();
+        return SLOT_SKIPPED;
+      }
+      DiagData diag;
+      memset(&diag, 0, sizeof(diag));
+      port_.fillDiag(diag);
+      diag.header = FRAME_TYPE_DIAG | (cfg.nodeId & FRAME_NODE_MASK);
+      diag.seq = session.peekSeq();
+      lastSlotSendMs_ = nowMs;
+      scheduler.markSent(nowMs);
+      if (!sendFrame((const uint8_t *)&diag, sizeof(DiagData), nowMs, airtime)) {
+        return SLOT_SKIPPED;
+      }
+      port_.onSent(UPLINK_DIAG, diag.seq, (const uint8_t *)&diag, sizeof(DiagData), 0, airtime);
+      return SLOT_DIAG_SENT;
+    }
+
+    // 送るサンプルがなければスロットを使わない（変化時のみ送信するモードで値が変わらない間も）
+    if (samples.size() == 0) {
+      scheduler.markSent(nowMs);
+      return SLOT_SKIPPED;
+    }
+
+    // 未送信のサンプルを時刻付きバッチフレームで送信
+    // 未同期または前回の同期から時間が経っていれば時刻ダウンリンクを要求する
+    // 前のフレームの応答待ちのまま次のスロットになった場合は同じサンプルを再送する（サーバー側で時刻により重複排除）
+    uint8_t flags = 0;
+    if (!timebase.synced() || nowMs - timebase.lastSyncLocalMs() >= cfg.timeSyncIntervalMs) {
+      flags |= BATCH_FLAG_TIME_REQ;
+    }
+    if (cfg.reportByException) {
+      flags |= BATCH_FLAG_HELD;
+    }
+    uint8_t seq = session.peekSeq();
+    size_t len = 0;
+    size_t count = buildSampleFrame(seq, flags, len);
+    uint32_t airtime = airtimeUs(len);
+
+    // 予算がイベントの予約ぶんしか残っていなければスロットを見送る（サンプルは次に送れたときにまとめて送る）
+    if (!budget.canSend(airtime, reserveUs)) {
+      scheduler.markSent(nowMs);
+      deferredSlots_++;
+      port_.onSlotDeferred();
+      return SLOT_SKIPPED;
+    }
+    lastSlotSendMs_ = nowMs;
+    scheduler.markSent(nowMs);
+    if (!sendFrame(payload_, len, nowMs, airtime)) {
+      return SLOT_SKIPPED;
+    }
+    samplesPending_ = true;
+    samplesPendingSeq_ = seq;
+    samplesPendingLastMs_ = samples.at(count - 1).localMs;
+    port_.onSent(UPLINK_BATCH, seq, payload_, len, count, airtime);
+    return SLOT_BATCH_SENT;
+  }
+
+  // ダウンリンク（イベントの確認応答・時刻）を処理する
+  // ペイロードは先頭バイトの種別で振り分け、種別ごとに決まった長さのものだけを解釈する
+  void handleDownlink(const char *line, uint32_t nowMs) {
+    uint8_t payload[TIME_DOWNLINK_SIZE];
+    uint8_t seq;
+    uint64_t unixMs;
+    size_t len;
+    while ((len = nextDownlinkPayload(line, payload, sizeof(payload))) != 0) {
+      switch (payload[0]) {
+      case EVENT_ACK_DOWNLINK_TYPE:
+        if (parseEventAckDownlink(payload, len, seq)) {
+          if (events.onAck(seq, nowMs)) {
+            port_.onEventAcked(seq, events.lastLatencyMs());
+          }
+          return;
+        }
+        break;
+      case TIME_DOWNLINK_TYPE:
+        if (parseTimeDownlink(payload, len, seq, unixMs)) {
+          bool applied = timebase.syncToUplink(seq, unixMs);
+          if (applied) {
+            alignSlots();
+          }
+          port_.onTimeDownlink(seq, unixMs, applied);
+          return;
+        }
+        break;
+      }
+    }
+  }
+
+  // 直近の送信結果が成功か（表示用）と、その前のスロットの送信からの経過時間
+  bool lastSuccess() const { return lastSuccess_; }
+  uint32_t elapsedMs() const { return elapsedMs_; }
+  uint32_t deferredSlots() const { return deferredSlots_; }
+  uint32_t oversize() const { return oversize_; }
+  uint32_t desyncs() const { return desyncs_; }
+
+private:
+  // セッションイベントを処理する。表示の更新が必要な場合は true
+  bool handle(SessionEvent ev, uint32_t nowMs) {
+    switch (ev) {
+    case EV_REBOOT:
+      port_.onModuleReboot();
+      return false;
+    case EV_ACCEPTED:
+      frameSync.onMatched();
+      timeouts[CMD_UPLINK].sample(session.lastLatencyMs());
+      session.setModuleTimeoutMs(moduleTimeoutMs());
+      if (samplesPending_ && session.lastSeq() == samplesPendingSeq_) {
+        // 時刻ダウンリンクはサンプルフレームにだけ要求するため、対応付けもサンプルフレームだけ
+        timebase.noteUplink(samplesPendingSeq_, nowMs);
+        samples.popThrough(samplesPendingLastMs_);
+        samplesPending_ = false;
+      }
+      if (events.onAccepted(session.lastSeq(), nowMs)) {
+        port_.onEventAccepted(session.lastSeq(), events.lastLatencyMs());
+      }
+      lastSuccess_ = true;
+      port_.onResult(ev);
+      return true;
+    case EV_CONFIRMED:
+      port_.onResult(ev);
+      return false;
+    case EV_REJECTED:
+      frameSync.onMatched();
+      timeouts[CMD_UPLINK].sample(session.lastLatencyMs());
+      session.setModuleTimeoutMs(moduleTimeoutMs());
+      if (session.lastSeq() == samplesPendingSeq_) {
+        samplesPending_ = false; // サンプルはリングに残り、次のスロットで再送する
+      }
+      // NG では電波を出していないため送信時間を予算に戻し、受信窓を待たずに次の送信要求を出せるようにする
+      // （モジュールの応答待ちは常に1件）
+      budget.refund(lastAirtimeUs_);
+      lastAirtimeUs_ = 0;
+      lastTxMs_ = nowMs - cfg.minGapMs;
+      // イベントは拒否された回数に応じて上限のある間隔を空けて再送する（EventQueue::retryDelayMs()）
+      events.onRejected(session.lastSeq(), nowMs);
+      lastSuccess_ = false;
+      port_.onResult(ev);
+      return true;
+    case EV_TIMEOUT:
+      timeouts[CMD_UPLINK].onTimeout();
+      session.setModuleTimeoutMs(moduleTimeoutMs());
+      if (session.lastSeq() == samplesPendingSeq_) {
+        samplesPending_ = false;
+      }
+      events.onTimeout(session.lastSeq(), nowMs);
+      lastSuccess_ = false;
+      port_.onResult(ev);
+      checkFrameSync();
+      return true;
+    case EV_STRAY:
+      checkFrameSync();
+      return false;
+    case EV_DOWNLINK:
+      handleDownlink(session.lastLine(), nowMs);
+      return false;
+    default:
+      return false;
+    }
+  }
+
+  // 時刻同期済みなら次のスロットを UNIX時刻に合わせる（未同期の間はローカルの epoch 基準のまま）
+  void alignSlots() {
+    if (timebase.synced()) {
+      scheduler.alignToUnix(timebase.toUnixMs(scheduler.slotBaseMs()));
+    }
+  }
+
+  // タイムアウト・照合先のない応答のたびに呼ぶ。バイナリのフレームの区切りがずれたとみなしたら通知する
+  void checkFrameSync() {
+    if (cfg.format != FRAME_FORMAT_BINARY || !frameSync.onAnomaly()) {
+      return;
+    }
+    desyncs_++;
+    port_.onFrameDesync();
+  }
+
+  // 新たに発生したイベントを送信待ちに積む
+  void queueEvent(uint8_t raised, const BatchSample &sample, uint32_t nowMs) {
+    if (raised == 0) {
+      return;
+    }
+    port_.onEventDetected(raised);
+    if (sizeof(EventData) > maxPayload()) {
+      port_.onOversize(sizeof(EventData));
+      return;
+    }
+    events.push(raised, sample, nowMs);
+  }
+
+  // 未送信のサンプルを1フレームにまとめ、フレームに含めたサンプル数を返す
+  // 時刻付きバッチフレームが入らない小さいデータレートでは、時刻なしの SensorData で1件ずつ送る
+  size_t buildSampleFrame(uint8_t seq, uint8_t flags, size_t &payloadLen) {
+    size_t count = 0;
+    size_t maxLen = maxPayload() < sizeof(payload_) ? maxPayload() : sizeof(payload_);
+    payloadLen = encodeSampleBatch(samples, timebase, cfg.nodeId, seq, flags, (uint16_t)cfg.samplePeriodMs,
+                                   payload_, maxLen, count);
+    if (payloadLen == 0) {
+      const TimedSample &s = samples.at(0);
+      SensorData sensorData;
+      sensorData.nodeId = cfg.nodeId;
+      sensorData.windDirection = s.data.windDirection;
+      sensorData.airSpeed100 = s.data.airSpeed100;
+      sensorData.virtualTemp100 = s.data.virtualTemp100;
+      sensorData.rssiAbs = s.data.rssiAbs & BATCH_RSSI_MASK;
+      sensorData.seq = seq;
+      memcpy(payload_, &sensorData, sizeof(SensorData));
+      payloadLen = sizeof(SensorData);
+      count = 1;
+    }
+    return count;
+  }
+
+  // ペイロードを送信フォーマットに合わせてフレーム化して書き込み、送信中として登録する
+  // シーケンス番号は書き込めた場合だけ払い出す（送らなかった番号が受信側で欠番にならないように）
+  bool sendFrame(const uint8_t *payload, size_t len, uint32_t nowMs, uint32_t airtime) {
+    if (len > maxPayload()) {
+      oversize_++;
+      port_.onOversize(len);
+      return false;
+    }
+    size_t n = encodeUplinkFrame(cfg.format, payload, len, frame_, sizeof(frame_));
+    if (n == 0) {
+      return false;
+    }
+    port_.writeFrame(frame_, n);
+    uint8_t seq = session.nextSeq();
+    lastTxMs_ = nowMs;
+    lastAirtimeUs_ = airtime;
+    budget.consume(airtime);
+    session.onSent(seq, nowMs);
+    return true;
+  }
+
+  UplinkPort &port_;
+  uint8_t payload_[255];
+  uint8_t frame_[2 * 255 + 2];
+  uint32_t lastTxMs_ = 0;     // 最後に送信要求を書き込んだ時刻
+  uint32_t lastAirtimeUs_ = 0; // その送信要求の送信時間（NG のとき予算に戻す）
+  uint32_t lastSlotSendMs_ = 0;
+  uint32_t elapsedMs_ = 0;
+  uint32_t deferredSlots_ = 0; // 予算不足で見送った定期送信のスロット数
+  uint32_t oversize_ = 0;      // データレートの上限を超えて送らなかったフレーム数
+  uint32_t desyncs_ = 0;
+  bool lastSuccess_ = false;
+  // モジュールの応答待ちのサンプルフレーム（受け付けられたらそこまでのサンプルをリングから取り除く）
+  bool samplesPending_ = false;
+  uint8_t samplesPendingSeq_ = 0;
+  uint32_t samplesPendingLastMs_ = 0;
+};
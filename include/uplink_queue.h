@@ -0,0 +1,328 @@
+#pragma once
+
+#include "sensor_data.h"
+#include "uplink_session.h"
+#include <stdint.h>
+#include <string.h>
+
+// 優先クラス付きのアップリンク送信
+//
+// 送信は2つのクラスに分ける:
+//   - イベント（優先）: 突風・温度の範囲外・センサーの沈黙を検出したら EventQueue に積み、
+//     固定の送信スロットを待たずに、モジュールが空いていて送信時間の予算が許す最初の機会に送る
+//   - 定期（バッチ）: 送信スロットごとに SampleRing のサンプルをまとめて送る。
+//     イベントの送信待ちがある間は送らず、予算はイベントのための予約を残して使う
+// イベントは確認応答ダウンリンク（[0x02][seq]）を要求でき、届かなければ一定時間後に再送する。
+// 検出から送信（モジュールが受け付けた時刻）までの遅延を記録する。
+
+#define EVENT_ACK_DOWNLINK_TYPE 0x02
+#define EVENT_ACK_DOWNLINK_SIZE 2
+
+// ダウンリンクのペイロード（nextDownlinkPayload()）がイベントの確認応答なら取り出す
+// 先頭バイトが種別で、長さがちょうど EVENT_ACK_DOWNLINK_SIZE のものだけを受け付ける
+inline bool parseEventAckDownlink(const uint8_t *payload, size_t len, uint8_t &seq) {
+  if (len != EVENT_ACK_DOWNLINK_SIZE || payload[0] != EVENT_ACK_DOWNLINK_TYPE) {
+    return false;
+  }
+  seq = payload[1];
+  return true;
+}
+
+// イベント検出のしきい値（airSpeed100 / virtualTemp100 と同じ ×100 の単位）
+struct EventThresholds {
+  uint16_t gust100 = 1500;      // 突風とみなす風速（15 m/s）
+  uint16_t gustClear100 = 1200; // 突風の解除（12 m/s 未満に戻ったら）
+  uint16_t tempHigh100 = 4000;  // 温度の上限（40°C）
+  uint16_t tempLow100 = 200;    // 温度の下限（2°C）
+  uint16_t tempHyst100 = 100;   // 温度イベントの解除に必要な戻り幅（1°C）
+  uint32_t silentMs = 5000;     // この時間サンプルが取れなければセンサーの沈黙
+};
+
+class EventDetector {
+public:
+  explicit EventDetector(const EventThresholds &th) : th_(th) {}
+
+  // サンプルを判定し、新たに発生したイベント（EVENT_* のOR、なければ 0）を返す
+  // 発生中のイベントは解除のしきい値まで戻るまで再び発生しない
+  uint8_t onSample(const BatchSample &s, uint32_t nowMs) {
+    lastSampleMs_ = nowMs;
+    started_ = true;
+    last_ = s;
+    active_ &= ~EVENT_SENSOR_SILENT;
+    uint8_t raised = 0;
+    raised |= update(EVENT_GUST, s.airSpeed100 >= th_.gust100, s.airSpeed100 < th_.gustClear100);
+    raised |= update(EVENT_TEMP_HIGH, s.virtualTemp100 > th_.tempHigh100,
+                     s.virtualTemp100 + th_.tempHyst100 <= th_.tempHigh100);
+    raised |= update(EVENT_TEMP_LOW, s.virtualTemp100 < th_.tempLow100,
+                     s.virtualTemp100 >= th_.tempLow100 + th_.tempHyst100);
+    return raised;
+  }
+
+  // センサーの沈黙を判定する（サンプルが取れなかった周期に呼ぶ）
+  uint8_t poll(uint32_t nowMs) {
+    if (!started_) {
+      started_ = true;
+      lastSampleMs_ = nowMs;
+      return 0;
+    }
+    return update(EVENT_SENSOR_SILENT, nowMs - lastSampleMs_ >= th_.silentMs, false);
+  }
+
+  uint8_t active() const { return active_; }
+  const BatchSample &lastSample() const { return last_; }
+
+private:
+  uint8_t update(uint8_t ev, bool raise, bool clear) {
+    if (active_ & ev) {
+      if (clear) {
+        active_ &= ~ev;
+      }
+      return 0;
+    }
+    if (raise) {
+      active_ |= ev;
+      return ev;
+    }
+    return 0;
+  }
+
+  EventThresholds th_;
+  BatchSample last_ = {};
+  uint32_t lastSampleMs_ = 0;
+  bool started_ = false;
+  uint8_t active_ = 0;
+};
+
+class EventQueue {
+public:
+  static const int kCapacity = 8;
+  // NG（送信待ち）で拒否されたイベントの再送間隔。kRetryBaseMs から倍々にし、kRetryMaxMs で頭打ち。
+  // モジュールが送信できる状態に戻ってから送り出すまでの遅れは kRetryMaxMs 以内に収まる
+  static const uint32_t kRetryBaseMs = 500;
+  static const uint32_t kRetryMaxMs = 4000;
+
+  // ackRequired: 確認応答ダウンリンクが届くまで再送する
+  // ackTimeoutMs: 受け付けられてから確認応答を待つ時間、maxRetries: 確認応答がない場合の再送回数
+  EventQueue(bool ackRequired, uint32_t ackTimeoutMs, uint8_t maxRetries)
+      : ackRequired_(ackRequired), ackTimeoutMs_(ackTimeoutMs), maxRetries_(maxRetries) {}
+
+  // イベントを追加する。満杯なら最も古いイベントを捨てる
+  void push(uint8_t events, const BatchSample &sample, uint32_t detectedMs) {
+    Entry *e = nullptr;
+    for (int i = 0; i < kCapacity; i++) {
+      if (table_[i].state == FREE) {
+        e = &table_[i];
+        break;
+      }
+      if (e == nullptr || (int32_t)(table_[i].detectedMs - e->detectedMs) < 0) {
+        e = &table_[i];
+      }
+    }
+    if (e->state != FREE) {
+      dropped_++;
+    }
+    e->events = events;
+    e->sample = sample;
+    e->detectedMs = detectedMs;
+    e->retryAtMs = detectedMs;
+    e->retries = 0;
+    e->rejects = 0;
+    e->state = PENDING;
+    queued_++;
+  }
+
+  // 今送れるイベント（送信待ちで再送時刻に達したもののうち最も早く検出したもの）の番号。なければ -1
+  int ready(uint32_t nowMs) const {
+    int best = -1;
+    for (int i = 0; i < kCapacity; i++) {
+      const Entry &e = table_[i];
+      if (e.state != PENDING || (int32_t)(nowMs - e.retryAtMs) < 0) {
+        continue;
+      }
+      if (best < 0 || (int32_t)(e.detectedMs - table_[best].detectedMs) < 0) {
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  // 定期送信を待たせるべきか（送信待ち・モジュール応答待ちのイベントがある）
+  // 確認応答待ちでは待たせない（Class A のダウンリンクは次のアップリンクの受信窓で届くため）
+  bool blocking() const {
+    for (int i = 0; i < kCapacity; i++) {
+      if (table_[i].state == PENDING || table_[i].state == WAIT_MODULE) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // 番号 i のイベントをフレームにする（時刻は呼び出し側で設定する）
+  void fill(int i, uint8_t nodeId, uint8_t seq, EventData &ev) const {
+    const Entry &e = table_[i];
+    ev.header = FRAME_TYPE_EVENT | (nodeId & FRAME_NODE_MASK);
+    ev.seq = seq;
+    ev.events = e.events;
+    ev.flags = ackRequired_ ? EVENT_FLAG_ACK_REQ : 0;
+    ev.timeSec = 0;
+    ev.timeMs = 0;
+    ev.sample = e.sample;
+  }
+
+  uint32_t detectedMs(int i) const { return table_[i].detectedMs; }
+
+  void onSent(int i, uint8_t seq) {
+    table_[i].seq = seq;
+    table_[i].state = WAIT_MODULE;
+  }
+
+  // モジュールが受け付けた。イベントの送信なら true
+  bool onAccepted(uint8_t seq, uint32_t nowMs) {
+    Entry *e = find(seq, WAIT_MODULE);
+    if (e == nullptr) {
+      return false;
+    }
+    lastLatencyMs_ = nowMs - e->detectedMs;
+    if (e->retries == 0) {
+      toAir_.add(lastLatencyMs_);
+    }
+    if (ackRequired_) {
+      e->state = WAIT_ACK;
+      e->retryAtMs = nowMs + ackTimeoutMs_;
+    } else {
+      e->state = FREE;
+      delivered_++;
+    }
+    return true;
+  }
+
+  // モジュールが拒否した。拒否された回数に応じた間隔（retryDelayMs()）をあけて再送する。イベントの送信なら true
+  bool onRejected(uint8_t seq, uint32_t nowMs) {
+    Entry *e = find(seq, WAIT_MODULE);
+    if (e == nullptr) {
+      return false;
+    }
+    e->state = PENDING;
+    e->retryAtMs = nowMs + retryDelayMs(e->rejects);
+    if (e->rejects < 255) {
+      e->rejects++;
+    }
+    return true;
+  }
+
+  // モジュールが応答しなかった。応答待ちですでに時間がたっているため、すぐに再送する。イベントの送信なら true
+  bool onTimeout(uint8_t seq, uint32_t nowMs) {
+    Entry *e = find(seq, WAIT_MODULE);
+    if (e == nullptr) {
+      return false;
+    }
+    e->state = PENDING;
+    e->retryAtMs = nowMs;
+    return true;
+  }
+
+  // rejects 回拒否された後の再送間隔
+  static uint32_t retryDelayMs(uint8_t rejects) {
+    uint32_t ms = kRetryBaseMs;
+    for (uint8_t i = 0; i < rejects && ms < kRetryMaxMs; i++) {
+      ms *= 2;
+    }
+    return ms < kRetryMaxMs ? ms : kRetryMaxMs;
+  }
+
+  // 確認応答ダウンリンクを受信した。対応するイベントがあれば true
+  bool onAck(uint8_t seq, uint32_t nowMs) {
+    Entry *e = find(seq, WAIT_ACK);
+    if (e == nullptr) {
+      return false;
+    }
+    lastLatencyMs_ = nowMs - e->detectedMs;
+    toAck_.add(lastLatencyMs_);
+    e->state = FREE;
+    delivered_++;
+    return true;
+  }
+
+  // 確認応答のタイムアウトを処理する（再送するか、再送回数を超えたら諦める）
+  void poll(uint32_t nowMs) {
+    for (int i = 0; i < kCapacity; i++) {
+      Entry &e = table_[i];
+      if (e.state != WAIT_ACK || (int32_t)(nowMs - e.retryAtMs) < 0) {
+        continue;
+      }
+      if (e.retries >= maxRetries_) {
+        e.state = FREE;
+        expired_++;
+      } else {
+        e.retries++;
+        e.state = PENDING;
+        e.retryAtMs = nowMs;
+        resent_++;
+      }
+    }
+  }
+
+  // モジュール再起動時など、応答待ちのイベントを送信待ちに戻す
+  void reset() {
+    for (int i = 0; i < kCapacity; i++) {
+      if (table_[i].state == WAIT_MODULE) {
+        table_[i].state = PENDING;
+      }
+    }
+  }
+
+  int size() const {
+    int n = 0;
+    for (int i = 0; i < kCapacity; i++) {
+      if (table_[i].state != FREE) {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  uint32_t lastLatencyMs() const { return lastLatencyMs_; }
+  uint32_t queued() const { return queued_; }
+  uint32_t delivered() const { return delivered_; }
+  uint32_t dropped() const { return dropped_; }
+  uint32_t resent() const { return resent_; }
+  uint32_t expired() const { return expired_; }
+  const LatencyHistogram &toAir() const { return toAir_; }
+  const LatencyHistogram &toAck() const { return toAck_; }
+
+private:
+  enum State : uint8_t { FREE = 0, PENDING, WAIT_MODULE, WAIT_ACK };
+
+  struct Entry {
+    uint8_t state;
+    uint8_t events;
+    uint8_t seq;
+    uint8_t retries; // 確認応答がなく再送した回数
+    uint8_t rejects; // NG で拒否された回数（再送間隔の決定用）
+    uint32_t detectedMs;
+    uint32_t retryAtMs; // PENDING: 送信してよい時刻、WAIT_ACK: 確認応答の期限
+    BatchSample sample;
+  };
+
+  Entry *find(uint8_t seq, uint8_t state) {
+    for (int i = 0; i < kCapacity; i++) {
+      if (table_[i].state == state && table_[i].seq == seq) {
+        return &table_[i];
+      }
+    }
+    return nullptr;
+  }
+
+  bool ackRequired_;
+  uint32_t ackTimeoutMs_;
+  uint8_t maxRetries_;
+  Entry table_[kCapacity] = {};
+  uint32_t lastLatencyMs_ = 0;
+  uint32_t queued_ = 0;
+  uint32_t delivered_ = 0;
+  uint32_t dropped_ = 0;
+  uint32_t resent_ = 0;
+  uint32_t expired_ = 0;
+  LatencyHistogram toAir_;
+  LatencyHistogram toAck_;
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+
+// アップリンク送信スロットのスケジューラ
+//
+// 送信時刻を「前回送信時刻 + 周期」で決めると、送信・応答待ちにかかった時間だけ
+// 毎回スロットがずれていき、同時に起動したノード同士は永久に同じ瞬間に送信してしまう。
+// そこで起動時刻(epoch)を基準に固定周期のスロットを切り、
+//   スロットk の送信時刻 = epoch + phase(nodeId) + k * period + jitter(nodeId, k)
+// とする。
+//   - phase  : nodeId * period / nodeCount。ノードを周期内に等間隔に並べる
+//              （ハッシュで散らすと、ノードによっては位相差がジッター幅より小さくなる）
+//   - jitter : nodeId とスロット番号から決定的に求める ±jitterMax の揺らぎ。
+//              揺らぎの幅（2 * jitterMax）はスロット間隔の半分未満に抑えるので、
+//              隣り合うノードの送信時刻は常にスロット間隔の半分以上離れる
+// 送信処理にどれだけ時間がかかってもスロットはずれない。
+//
+// epoch はノードごとに違う（起動・Join の時刻）ため、epoch 基準のままでは位相を等間隔にしても
+// ノード同士の送信時刻は起動のタイミング次第で重なりうる。時刻同期（include/timebase.h）が済んだら
+// alignToUnix() でスロットを UNIX時刻に合わせ、
+//   スロットの送信時刻 ≡ phase(nodeId) + jitter  (mod period, UNIX時刻)
+// とする。全ノードが同じ時計で並ぶので、位相の間隔がそのままノード間の間隔になる。
+// 最初の同期まではローカルの epoch 基準で送る（起動直後は時刻が分からないため。
+// 同期後の最初の合わせ込みで次のスロットが最大 period/2 前後に動く）。
+//
+// スロットを逃した場合（送信処理が長引いた・ブロックしていた等）は、
+// 遅れが period/2 未満ならそのまま送信し、それ以上ならまとめて送らずに
+// 次の未来のスロットまで読み飛ばす（バースト送信による衝突を防ぐ）。
+//
+// millis() のラップアラウンド（約49.7日）を考慮し、時刻比較は全て差分で行う。
+class UplinkScheduler {
+public:
+  UplinkScheduler(uint32_t periodMs, uint32_t jitterMaxMs, uint8_t nodeCount)
+      : periodMs_(periodMs), jitterMaxMs_(jitterMaxMs), nodeCount_(nodeCount > 0 ? nodeCount : 1) {
+    // 揺らぎの幅がスロット間隔の半分未満になるよう ±(間隔/4) 未満に制限
+    uint32_t limit = slotSpacingMs() / 4;
+    if (limit > 0) {
+      limit--;
+    }
+    if (jitterMaxMs_ > limit) {
+      jitterMaxMs_ = limit;
+    }
+  }
+
+  // スケジューラを開始する。最初のスロットは epoch + phase(nodeId) 付近。
+  void begin(uint8_t nodeId, uint32_t epochMs) {
+    nodeId_ = nodeId;
+    phaseMs_ = (uint32_t)((uint64_t)(nodeId % nodeCount_) * periodMs_ / nodeCount_);
+    slotIndex_ = 0;
+    slotBaseMs_ = epochMs + phaseMs_;
+    missedSlots_ = 0;
+    lateSends_ = 0;
+    started_ = true;
+    unixAligned_ = false;
+  }
+
+  // 次のスロットの基準時刻が UNIX時刻で phase (mod period) になるよう、前後 period/2 以内で動かす。
+  // unixAtBaseMs は slotBaseMs() を UNIX時刻に換算した値。同期のたびに呼ぶと時計のずれも吸収する
+  void alignToUnix(uint64_t unixAtBaseMs) {
+    uint32_t off = (uint32_t)((unixAtBaseMs % periodMs_ + periodMs_ - phaseMs_) % periodMs_);
+    slotBaseMs_ += off <= periodMs_ / 2 ? (uint32_t)-(int32_t)off : periodMs_ - off;
+    unixAligned_ = true;
+  }
+
+  // 現在のスロットの送信予定時刻
+  uint32_t dueMs() const {
+    return slotBaseMs_ + (uint32_t)jitterMs(slotIndex_);
+  }
+
+  // 送信時刻に達しているか
+  // 大きく遅れている場合はここで次の未来のスロットまで読み飛ばす
+  bool isDue(uint32_t nowMs) {
+    if (!started_) {
+      return false;
+    }
+    int32_t late = (int32_t)(nowMs - dueMs());
+    if (late < 0) {
+      return false;
+    }
+    if ((uint32_t)late < periodMs_ / 2) {
+      return true;
+    }
+
+    // キャッチアップ: 逃したスロットはまとめて送らずに読み飛ばす
+    uint32_t behind = nowMs - slotBaseMs_;
+    uint32_t skip = behind / periodMs_ + 1;
+    slotIndex_ += skip;
+    slotBaseMs_ += skip * periodMs_;
+    missedSlots_ += skip;
+    return false;
+  }
+
+  // 現在のスロットで送信したことを通知し、次のスロットへ進める
+  void markSent(uint32_t nowMs) {
+    if ((int32_t)(nowMs - dueMs()) > 0) {
+      lastLatenessMs_ = nowMs - dueMs();
+      if (lastLatenessMs_ > 1000) {
+        lateSends_++;
+      }
+    } else {
+      lastLatenessMs_ = 0;
+    }
+    slotIndex_++;
+    slotBaseMs_ += periodMs_;
+  }
+
+  uint32_t periodMs() const { return periodMs_; }
+  uint32_t phaseMs() const { return phaseMs_; }
+  uint32_t jitterMaxMs() const { return jitterMaxMs_; }
+  uint32_t slotSpacingMs() const { return periodMs_ / nodeCount_; }
+  uint32_t slotIndex() const { return slotIndex_; }
+  uint32_t slotBaseMs() const { return slotBaseMs_; }
+  bool unixAligned() const { return unixAligned_; }
+  uint32_t missedSlots() const { return missedSlots_; }
+  uint32_t lateSends() const { return lateSends_; }
+  uint32_t lastLatenessMs() const { return lastLatenessMs_; }
+
+private:
+  // スロットごとの揺らぎ（-jitterMax 〜 +jitterMax）
+  int32_t jitterMs(uint32_t slot) const {
+    if (jitterMaxMs_ == 0) {
+      return 0;
+    }
+    uint32_t h = mix32(((uint32_t)nodeId_ << 24) ^ slot);
+    return (int32_t)(h % (2 * jitterMaxMs_ + 1)) - (int32_t)jitterMaxMs_;
+  }
+
+  // 32bit整数ハッシュ（murmur3 finalizer）
+  static uint32_t mix32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85EBCA6Bu;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35u;
+    x ^= x >> 16;
+    return x;
+  }
+
+  uint32_t periodMs_;
+  uint32_t jitterMaxMs_;
+  uint8_t nodeCount_;
+  uint8_t nodeId_ = 0;
+  uint32_t phaseMs_ = 0;
+  uint32_t slotIndex_ = 0;
+  uint32_t slotBaseMs_ = 0;
+  uint32_t missedSlots_ = 0;
+  uint32_t lateSends_ = 0;
+  uint32_t lastLatenessMs_ = 0;
+  bool started_ = false;
+  bool unixAligned_ = false;
+};
@@ -0,0 +1,443 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// アップリンクの送信中テーブルとモジュール応答の非同期照合
+//
+// 送信後に固定時間だけ待って Serial1 を読む方式では、待ち時間を過ぎて届いた
+// "OK" や NG、ネットワークからの確認応答が次のアップリンクの結果として扱われてしまう。
+// ここでは送信ごとにローリングシーケンス番号を付けて送信中テーブルに登録し、
+// Serial1 の受信行を loop() のたびに少しずつ解析して、到着順に照合する。
+//
+// ES920LR3 の応答にはシーケンス番号が含まれないため、照合は送信順（FIFO）で行う:
+//   - "OK" / NG          → モジュール応答待ちの最も古いエントリ
+//   - ネットワーク確認応答 → 確認待ちの最も古いエントリ
+// 応答パターンはモジュールの仕様に合わせて classifyModuleLine() を調整してください。
+
+// 受信行の種別
+enum ModuleLine {
+  LINE_NONE = 0,   // 行が未完成
+  LINE_OK,         // モジュールが送信要求を受け付けた
+  LINE_NG_BUSY,    // NG 102（送信待ち状態）
+  LINE_NG,         // その他のNG / エラー
+  LINE_CONFIRMED,  // ネットワークからの確認応答
+  LINE_SELECT_MODE,// モジュール再起動（"Select Mode [" を出力）
+  LINE_OTHER       // ダウンリンク等、送信結果以外の行
+};
+
+// 行頭（空白を除く）が tok と一致し（大文字小文字は区別しない）、その直後が英字でなければ
+// tok の直後を指すポインタを返す。一致しなければ nullptr
+// 部分一致だと "Sending" や "Joining" の "ng"、"back" の "ack" を応答と取り違えるため、行頭の語だけを見る
+inline const char *matchLeadingToken(const char *s, const char *tok) {
+  while (*s == ' ' || *s == '\t') {
+    s++;
+  }
+  for (; *tok; s++, tok++) {
+    if ((*s | 0x20) != (*tok | 0x20) || *s == '\0') {
+      return nullptr;
+    }
+  }
+  char c = (char)(*s | 0x20);
+  return (c >= 'a' && c <= 'z') ? nullptr : s;
+}
+
+// "OK"、"NG 102"（"NG102"）、"NG <code>" を行頭の語で判定する
+inline ModuleLine classifyModuleLine(const char *line) {
+  if (strstr(line, "Select Mode [") != nullptr) {
+    return LINE_SELECT_MODE;
+  }
+  const char *rest = matchLeadingToken(line, "NG");
+  if (rest != nullptr) {
+    while (*rest == ' ') {
+      rest++;
+    }
+    return strncmp(rest, "102", 3) == 0 && !(rest[3] >= '0' && rest[3] <= '9') ? LINE_NG_BUSY : LINE_NG;
+  }
+  if (matchLeadingToken(line, "FAIL") || matchLeadingToken(line, "ERROR") || matchLeadingToken(line, "DENY")) {
+    return LINE_NG;
+  }
+  rest = matchLeadingToken(line, "SEND");
+  if ((rest != nullptr && matchLeadingToken(rest, "OK")) || matchLeadingToken(line, "SUCCESS") ||
+      matchLeadingToken(line, "ACK")) {
+    return LINE_CONFIRMED;
+  }
+  if (matchLeadingToken(line, "OK")) {
+    return LINE_OK;
+  }
+  return LINE_OTHER;
+}
+
+// 16進数1文字の値（16進数でなければ -1）
+inline int hexDigitValue(char c) {
+  return (c >= '0' && c <= '9')   ? c - '0'
+         : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+         : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                                  : -1;
+}
+
+// 英数字か（ダウンリンクの行を語に区切るため）
+inline bool isAsciiAlnum(char c) {
+  char l = (char)(c | 0x20);
+  return (c >= '0' && c <= '9') || (l >= 'a' && l <= 'z');
+}
+
+// モジュールが出力したダウンリンクの行から、次のアプリケーションペイロードを取り出す
+// ペイロードは16進文字列の語（英数字の並びのうち、すべて16進数で偶数桁のもの）として出力される想定。
+// 語の先頭からバイト境界で読み、語の途中や半バイトずれた位置からは読まない
+// （時刻ダウンリンクの中の "02xx" を確認応答と取り違えないように）。
+// cursor を語の後ろへ進めてバイト数を返す。cap を超える語は読み飛ばし、語がなければ 0
+inline size_t nextDownlinkPayload(const char *&cursor, uint8_t *out, size_t cap) {
+  const char *p = cursor;
+  for (;;) {
+    while (*p && !isAsciiAlnum(*p)) {
+      p++;
+    }
+    if (*p == '\0') {
+      cursor = p;
+      return 0;
+    }
+    const char *word = p;
+    bool hex = true;
+    while (isAsciiAlnum(*p)) {
+      hex = hex && hexDigitValue(*p) >= 0;
+      p++;
+    }
+    size_t digits = (size_t)(p - word);
+    if (hex && digits % 2 == 0 && digits / 2 <= cap) {
+      for (size_t i = 0; i < digits / 2; i++) {
+        out[i] = (uint8_t)(hexDigitValue(word[2 * i]) << 4 | hexDigitValue(word[2 * i + 1]));
+      }
+      cursor = p;
+      return digits / 2;
+    }
+  }
+}
+
+// Serial1 の受信バイトを1行ずつ組み立てる（String を使わない固定長バッファ）
+class LineAssembler {
+public:
+  // 1バイト追加する。行が完成したら true を返し、line() で取り出せる
+  bool feed(char c) {
+    if (done_) {
+      len_ = 0;
+      done_ = false;
+    }
+    if (c == '\n') {
+      if (len_ == 0) {
+        return false;
+      }
+      done_ = true;
+      buf_[len_] = '\0';
+      return true;
+    }
+    if (c == '\r') {
+      return false;
+    }
+    if (len_ < sizeof(buf_) - 1) {
+      buf_[len_++] = c;
+    }
+    buf_[len_] = '\0';
+    // 再起動時のプロンプトは改行で終わらないため、ここで行として確定させる
+    if (c == '[' && strstr(buf_, "Select Mode [") != nullptr) {
+      done_ = true;
+      return true;
+    }
+    return false;
+  }
+
+  const char *line() const { return buf_; }
+
+private:
+  char buf_[128] = {0};
+  size_t len_ = 0;
+  bool done_ = false;
+};
+
+// 遅延分布（ms）。バケット境界は固定で、ヒープを使わない
+class LatencyHistogram {
+public:
+  static const int kBuckets = 9;
+
+  void add(uint32_t ms) {
+    int b = 0;
+    while (b < kBuckets - 1 && ms >= bound(b)) {
+      b++;
+    }
+    counts_[b]++;
+    count_++;
+    sum_ += ms;
+    if (count_ == 1 || ms < min_) {
+      min_ = ms;
+    }
+    if (ms > max_) {
+      max_ = ms;
+    }
+  }
+
+  // バケットの上限（最後のバケットは上限なし）
+  static uint32_t bound(int b) {
+    static const uint32_t kBounds[kBuckets - 1] = {50, 100, 200, 500, 1000, 2000, 5000, 10000};
+    return kBounds[b];
+  }
+
+  // p パーセンタイルが含まれるバケットの上限値（最後のバケットなら最大値）
+  uint32_t percentile(uint32_t p) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    uint32_t target = (count_ * p + 99) / 100;
+    uint32_t acc = 0;
+    for (int b = 0; b < kBuckets - 1; b++) {
+      acc += counts_[b];
+      if (acc >= target) {
+        return bound(b) < max_ ? bound(b) : max_;
+      }
+    }
+    return max_;
+  }
+
+  uint32_t count() const { return count_; }
+  uint32_t bucket(int b) const { return counts_[b]; }
+  uint32_t min() const { return min_; }
+  uint32_t max() const { return max_; }
+  uint32_t mean() const { return count_ ? (uint32_t)(sum_ / count_) : 0; }
+
+private:
+  uint32_t counts_[kBuckets] = {0};
+  uint32_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint32_t min_ = 0;
+  uint32_t max_ = 0;
+};
+
+// セッションから loop() へ通知するイベント
+enum SessionEvent {
+  EV_NONE = 0,
+  EV_ACCEPTED,  // モジュールが受け付けた（"OK"）
+  EV_REJECTED,  // モジュールが拒否した（NG）
+  EV_CONFIRMED, // ネットワーク確認応答を受信
+  EV_TIMEOUT,   // モジュール応答なしでタイムアウト
+  EV_REBOOT,    // モジュールが再起動した
+  EV_STRAY,     // モジュール応答待ちの送信がないのに "OK"/NG を受信した
+  EV_DOWNLINK   // 送信結果以外の行（ダウンリンク等）。lastLine() で取り出す
+};
+
+class UplinkSession {
+public:
+  static const int kMaxInflight = 8;
+
+  // moduleTimeoutMs : 送信から "OK"/NG までの待ち上限
+  // confirmTimeoutMs: "OK" からネットワーク確認応答までの待ち上限
+  UplinkSession(uint32_t moduleTimeoutMs, uint32_t confirmTimeoutMs)
+      : moduleTimeoutMs_(moduleTimeoutMs), confirmTimeoutMs_(confirmTimeoutMs) {}
+
+  // 次に送信するシーケンス番号を払い出す（0-255 でローリング）
+  uint8_t nextSeq() { return seq_++; }
+
+  // 次に払い出すシーケンス番号（払い出さずに参照する）
+  uint8_t peekSeq() const { return seq_; }
+
+  // 送信完了（UART flush 後）を登録
+  void onSent(uint8_t seq, uint32_t nowMs) {
+    Entry *e = freeEntry();
+    if (e == nullptr) {
+      // テーブルが満杯なら最も古いものを失敗として破棄
+      e = oldest(WAIT_MODULE | WAIT_CONFIRM);
+      if (e->state == WAIT_MODULE) {
+        timeouts_++;
+      } else {
+        unconfirmed_++;
+      }
+    }
+    e->seq = seq;
+    e->sentMs = nowMs;
+    e->state = WAIT_MODULE;
+    sent_++;
+  }
+
+  // Serial1 の受信バイトを1つ処理する
+  SessionEvent feed(char c, uint32_t nowMs) {
+    if (!lines_.feed(c)) {
+      return EV_NONE;
+    }
+    lastLine_ = classifyModuleLine(lines_.line());
+    Entry *e = nullptr;
+    switch (lastLine_) {
+    case LINE_SELECT_MODE:
+      return EV_REBOOT;
+    case LINE_OK:
+      e = oldest(WAIT_MODULE);
+      if (e == nullptr) {
+        strayLines_++;
+        return EV_STRAY;
+      }
+      lastLatencyMs_ = nowMs - e->sentMs;
+      moduleLatency_.add(lastLatencyMs_);
+      e->state = WAIT_CONFIRM;
+      e->ackMs = nowMs;
+      lastSeq_ = e->seq;
+      accepted_++;
+      return EV_ACCEPTED;
+    case LINE_NG_BUSY:
+    case LINE_NG:
+      e = oldest(WAIT_MODULE);
+      if (e == nullptr) {
+        strayLines_++;
+        return EV_STRAY;
+      }
+      lastSeq_ = e->seq;
+      lastLatencyMs_ = nowMs - e->sentMs;
+      e->state = FREE;
+      // NG のフレームは送信されていないので、直後に払い出す番号として再利用する
+      // （受信側で欠番＝欠落として数えられないように）
+      if (seq_ == (uint8_t)(e->seq + 1)) {
+        seq_ = e->seq;
+      }
+      rejected_++;
+      return EV_REJECTED;
+    case LINE_CONFIRMED:
+      e = oldest(WAIT_CONFIRM);
+      if (e == nullptr) {
+        // "OK" を経ずに確認応答だけが届いた場合はモジュール応答待ちと照合
+        e = oldest(WAIT_MODULE);
+        if (e == nullptr) {
+          strayLines_++;
+          return EV_NONE;
+        }
+        accepted_++;
+        lastLatencyMs_ = nowMs - e->sentMs;
+        moduleLatency_.add(lastLatencyMs_);
+      }
+      confirmLatency_.add(nowMs - e->sentMs);
+      lastSeq_ = e->seq;
+      e->state = FREE;
+      confirmed_++;
+      return EV_CONFIRMED;
+    case LINE_OTHER:
+      return EV_DOWNLINK;
+    default:
+      return EV_NONE;
+    }
+  }
+
+  // タイムアウトしたエントリを1件処理する。モジュール応答待ちのタイムアウトは EV_TIMEOUT
+  SessionEvent poll(uint32_t nowMs) {
+    for (int i = 0; i < kMaxInflight; i++) {
+      Entry &e = table_[i];
+      if (e.state == WAIT_MODULE && nowMs - e.sentMs >= moduleTimeoutMs_) {
+        e.state = FREE;
+        lastSeq_ = e.seq;
+        timeouts_++;
+        return EV_TIMEOUT;
+      }
+      if (e.state == WAIT_CONFIRM && nowMs - e.ackMs >= confirmTimeoutMs_) {
+        // モジュールは受け付けているので送信成功として扱い、未確認数のみ数える
+        e.state = FREE;
+        unconfirmed_++;
+      }
+    }
+    return EV_NONE;
+  }
+
+  // 状態を初期化する（モジュール再起動時など）。シーケンス番号は継続する
+  void reset() {
+    for (int i = 0; i < kMaxInflight; i++) {
+      table_[i].state = FREE;
+    }
+    lines_ = LineAssembler();
+  }
+
+  int inflight() const {
+    int n = 0;
+    for (int i = 0; i < kMaxInflight; i++) {
+      if (table_[i].state != FREE) {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  // モジュールの "OK"/NG を待っている送信の数（0 ならモジュールは次の送信要求を受け付けられる）
+  int awaitingModule() const {
+    int n = 0;
+    for (int i = 0; i < kMaxInflight; i++) {
+      if (table_[i].state == WAIT_MODULE) {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  // モジュール応答待ちのタイムアウトを変更する（応答時間の推定値に追従させる）
+  void setModuleTimeoutMs(uint32_t ms) { moduleTimeoutMs_ = ms; }
+  uint32_t moduleTimeoutMs() const { return moduleTimeoutMs_; }
+
+  // 直近の EV_ACCEPTED / EV_REJECTED の送信から応答までの時間
+  uint32_t lastLatencyMs() const { return lastLatencyMs_; }
+
+  const char *lastLine() const { return lines_.line(); }
+  ModuleLine lastLineKind() const { return lastLine_; }
+  uint8_t lastSeq() const { return lastSeq_; }
+  uint32_t sent() const { return sent_; }
+  uint32_t accepted() const { return accepted_; }
+  uint32_t rejected() const { return rejected_; }
+  uint32_t confirmed() const { return confirmed_; }
+  uint32_t unconfirmed() const { return unconfirmed_; }
+  uint32_t timeouts() const { return timeouts_; }
+  uint32_t strayLines() const { return strayLines_; }
+  const LatencyHistogram &moduleLatency() const { return moduleLatency_; }
+  const LatencyHistogram &confirmLatency() const { return confirmLatency_; }
+
+private:
+  enum State : uint8_t { FREE = 0, WAIT_MODULE = 1, WAIT_CONFIRM = 2 };
+
+  struct Entry {
+    uint8_t seq;
+    uint8_t state;
+    uint32_t sentMs;
+    uint32_t ackMs;
+  };
+
+  Entry *freeEntry() {
+    for (int i = 0; i < kMaxInflight; i++) {
+      if (table_[i].state == FREE) {
+        return &table_[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // 指定状態（ビットOR）のうち最も古く送信したエントリ
+  Entry *oldest(uint8_t states) {
+    Entry *best = nullptr;
+    for (int i = 0; i < kMaxInflight; i++) {
+      Entry &e = table_[i];
+      if ((e.state & states) == 0) {
+        continue;
+      }
+      if (best == nullptr || (int32_t)(e.sentMs - best->sentMs) < 0) {
+        best = &e;
+      }
+    }
+    return best;
+  }
+
+  uint32_t moduleTimeoutMs_;
+  uint32_t confirmTimeoutMs_;
+  Entry table_[kMaxInflight] = {};
+  LineAssembler lines_;
+  ModuleLine lastLine_ = LINE_NONE;
+  uint8_t seq_ = 0;
+  uint8_t lastSeq_ = 0;
+  uint32_t lastLatencyMs_ = 0;
+  uint32_t sent_ = 0;
+  uint32_t accepted_ = 0;
+  uint32_t rejected_ = 0;
+  uint32_t confirmed_ = 0;
+  uint32_t unconfirmed_ = 0;
+  uint32_t timeouts_ = 0;
+  uint32_t strayLines_ = 0;
+  LatencyHistogram moduleLatency_;
+  LatencyHistogram confirmLatency_;
+};
@@ -1,5 +1,21 @@
+#include "airtime_budget.h"
+#include "deadband_filter.h"
+#include "mem_telemetry.h"
+#include "rtt_estimator.h"
+#include "sample_batch.h"
+#include "sample_log.h"
+#include "sd_bus.h"
 #include "secrets.h"
+#include "sensor_data.h"
+#include "timebase.h"
+#include "uart_trace.h"
+#include "uplink_frame.h"
+#include "uplink_loop.h"
+#include "uplink_queue.h"
+#include "uplink_scheduler.h"
+#include "uplink_session.h"
 #include <M5Unified.h>
+#include <Preferences.h>
 
 // @see https://ikkei.akiba.co.jp/ikkei_Electronics/M5LR3.html
 // #define RX_pin 13 // ES920LR3 TX 接続ピン
@@ -13,19 +29,150 @@
 int boot_pin = 22;
 int reset_pin = 19;
 
-// センサーデータ構造体（12バイト）
-// パディングを避けるため、packed属性を使用
-struct __attribute__((packed)) SensorData {
-  uint8_t nodeId;          // Byte 0: 0-10
-  uint16_t windDirection;  // Byte 1-2: 0-360 (度そのまま)
-  uint16_t airSpeed100;    // Byte 3-4: 0-5000 (値×100)
-  uint16_t virtualTemp100; // Byte 5-6: 0-5000 (値×100)
-  uint8_t rssiAbs;         // Byte 7: 0-99 (-rssiの絶対値)
-  // uint32_t unixmilli;      // Byte 8-11: 0-864000000
+// ノードID（0 〜 NODE_COUNT-1）。送信スロットの位相オフセットもここから決まる
+#define NODE_ID 1
+#define NODE_COUNT 11
+#if NODE_ID >= NODE_COUNT
+#error "NODE_ID must be less than NODE_COUNT"
+#endif
+
+// アップリンク送信周期とスロットごとの揺らぎ幅
+// 揺らぎはスロット間隔（周期 / NODE_COUNT = 909ms）の 1/4 未満に制限される
+#define UPLINK_PERIOD_MS 10000
+#define UPLINK_JITTER_MS 200
+
+// 送信から "OK"/NG までの待ち上限（初期値と下限。以降は応答時間から学習）と、
+// ネットワーク確認応答までの待ち上限
+#define UPLINK_MODULE_TIMEOUT_MS 5000
+#define UPLINK_MODULE_TIMEOUT_MIN_MS 1000
+#define UPLINK_CONFIRM_TIMEOUT_MS 30000
+
+// datarate コマンドの設定値（DR = 設定値 - 1。6 = DR5 帯域幅 125kHz 拡散率 7）
+#define LORA_DATARATE_SETTING 6
+
+// 送信フォーマットの設定コマンド
+// 参考: ES920LR3_LoRaWAN_コマンド仕様ソフトウェア説明書_1.01.pdf format コマンド（1: ASCII、2: BINARY）
+// ASCII では文字列がそのまま送信されるため、16進表記のペイロードはエアー上で2倍の長さになる
+// （include/uplink_frame.h）
+#define FORMAT_BINARY_COMMAND "format 2"
+#define FORMAT_HEX_COMMAND "format 1"
+
+// センサー値の取得周期と、時刻同期の間隔（過ぎたらアップリンクで時刻ダウンリンクを要求する）
+#define SAMPLE_PERIOD_MS 1000
+#define TIME_SYNC_INTERVAL_MS (6UL * 60 * 60 * 1000)
+
+// 送信時間の予算（許容する送信時間の割合‰と、連続して使える送信時間）
+// 電波法上の上限（ARIB STD-T108: 1時間あたり360秒）より小さく、ゲートウェイを共有するノード数を確保するための値
+// 1秒周期のサンプルを DR5 の最大長のバッチ（約28件で約0.4秒）で送ると約1.4%になるため、イベントのぶんを足して2%
+#define AIRTIME_BUDGET_PERMILLE 20
+#define AIRTIME_BURST_MS 4000
+
+// 定期送信が残しておくイベントフレームの送信時間（フレーム数）
+#define EVENT_RESERVE_FRAMES 3
+
+// 送信後、次の送信要求までの最小間隔（受信窓 RX1/RX2 が閉じるまで）
+#define UPLINK_MIN_GAP_MS 2500
+
+// イベントの確認応答ダウンリンクを要求するか（1: 要求して届くまで再送）と、その待ち時間・再送回数
+// 確認応答 [0x02][seq] を返すサーバー側の処理がまだないため 0（1 にすると全イベントが再送回数ぶん再送される）。
+// サーバー側が確認応答を返すようになったら 1 にする
+#define EVENT_ACK_REQUIRED 0
+#define EVENT_ACK_TIMEOUT_MS 60000
+#define EVENT_MAX_RETRIES 3
+
+// 変化時のみ送信するモード（1: 不感帯を超えたサンプルとハートビートだけを送る）
+// 不感帯とハートビートの間隔は include/deadband_filter.h の Deadbands を参照
+#define REPORT_BY_EXCEPTION 1
+
+// 遅延統計をログに出す間隔（送信回数）
+#define LATENCY_REPORT_INTERVAL 30
+
+// コマンドのリトライ上限と、応答の終わりとみなす無受信時間
+#define COMMAND_MAX_RETRIES 10
+#define COMMAND_IDLE_GAP_MS 50
+
+// 応答時間の推定値を保存するNVSの名前空間と、保存間隔（新規サンプル数）
+#define RTT_PREFS_NAMESPACE "es920rtt"
+#define RTT_SAVE_INTERVAL 100
+
+// メモリテレメトリをログに出す間隔と、診断フレームを送るスロット間隔（360スロット = 1時間）
+#define MEM_LOG_INTERVAL_MS 60000
+#define DIAG_INTERVAL_SLOTS 360
+
+// UART 通信を SD カードに記録する（1: SD カードがあれば /trace/UTnnnn.BIN に記録、tools/uart_replay.cpp で再生）
+#define UART_TRACE_ENABLED 1
+
+// 取得したすべてのサンプルを SD カードに記録する（1: SD カードがあれば /log/SLnnnnn.BIN に記録）
+// 形式と索引は include/sample_log.h を参照
+#define SAMPLE_LOG_ENABLED 1
+
+// アップリンク処理の設定（include/uplink_loop.h）
+UplinkLoopConfig uplinkLoopConfig() {
+  UplinkLoopConfig cfg;
+  cfg.nodeId = NODE_ID;
+  cfg.nodeCount = NODE_COUNT;
+  cfg.periodMs = UPLINK_PERIOD_MS;
+  cfg.jitterMs = UPLINK_JITTER_MS;
+  cfg.moduleTimeoutMs = UPLINK_MODULE_TIMEOUT_MS;
+  cfg.moduleTimeoutMinMs = UPLINK_MODULE_TIMEOUT_MIN_MS;
+  cfg.confirmTimeoutMs = UPLINK_CONFIRM_TIMEOUT_MS;
+  cfg.samplePeriodMs = SAMPLE_PERIOD_MS;
+  cfg.timeSyncIntervalMs = TIME_SYNC_INTERVAL_MS;
+  cfg.budgetPermille = AIRTIME_BUDGET_PERMILLE;
+  cfg.burstMs = AIRTIME_BURST_MS;
+  cfg.eventReserveFrames = EVENT_RESERVE_FRAMES;
+  cfg.minGapMs = UPLINK_MIN_GAP_MS;
+  cfg.eventAckRequired = EVENT_ACK_REQUIRED;
+  cfg.eventAckTimeoutMs = EVENT_ACK_TIMEOUT_MS;
+  cfg.eventMaxRetries = EVENT_MAX_RETRIES;
+  cfg.reportByException = REPORT_BY_EXCEPTION;
+  cfg.diagIntervalSlots = DIAG_INTERVAL_SLOTS;
+  cfg.datarate = LORA_DATARATE_SETTING - 1; // DR = 設定値 - 1
+  cfg.format = FRAME_FORMAT_HEX;            // setup() でモジュールがバイナリを受け付けたらバイナリ
+  return cfg;
+}
+
+// UART への書き込み・モジュールのやり直しの要求・ログ出力（定義は loop() の前）
+class FirmwareUplinkPort : public UplinkPort {
+public:
+  void writeFrame(const uint8_t *frame, size_t len) override;
+  void onModuleReboot() override;
+  void onFrameDesync() override;
+  void fillDiag(DiagData &diag) override;
+  void onSent(UplinkKind kind, uint8_t seq, const uint8_t *payload, size_t len, size_t count,
+              uint32_t airtimeUs) override;
+  void onResult(SessionEvent ev) override;
+  void onEventDetected(uint8_t events) override;
+  void onEventAccepted(uint8_t seq, uint32_t latencyMs) override;
+  void onEventAcked(uint8_t seq, uint32_t latencyMs) override;
+  void onTimeDownlink(uint8_t seq, uint64_t unixMs, bool applied) override;
+  void onSlotDeferred() override;
+  void onOversize(size_t len) override;
+
+  // モジュールだけをやり直す理由。UplinkLoop の処理中にはやり直さず、loop() で recoverModule() を呼ぶ
+  const char *resetReason = nullptr;
 };
 
+// 送信スロット・モジュール応答の照合・イベントの優先送信・時刻同期（ソークベンチマークと共通）
+FirmwareUplinkPort uplinkPort;
+UplinkLoop uplink(uplinkLoopConfig(), uplinkPort);
+
+// 部品への参照（コマンドの応答時間の学習と統計の表示で直接使う）
+UplinkScheduler &uplinkScheduler = uplink.scheduler;
+UplinkSession &uplinkSession = uplink.session;
+CommandTimeouts &commandTimeouts = uplink.timeouts; // コマンド種別ごとの応答時間の推定値
+Timebase &timebase = uplink.timebase;
+SampleRing &sampleRing = uplink.samples;
+EventQueue &eventQueue = uplink.events;
+AirtimeBudget &airtimeBudget = uplink.budget;
+DeadbandFilter &reportFilter = uplink.filter;
+uint32_t rttSavedSamples = 0;
+
 // Serial1をGROVE PORT.A（GPIO32/33）に割り当ててES920LR3と通信
 // Serial2はM-BUSで使用されているため、Serial1を使用
+// 読み書きは記録付きのポートを通す（begin() 等の設定は Serial1/Serial2 で行う）
+TracedSerial loraSerial(Serial1, UTRACE_CH_LORA_TX, UTRACE_CH_LORA_RX);
+TracedSerial mbusSerial(Serial2, UTRACE_CH_MBUS_RX, UTRACE_CH_MBUS_RX);
 
 void LoRa_Reset() {
   pinMode(reset_pin, OUTPUT);
@@ -35,13 +182,71 @@ void LoRa_Reset() {
   delay(1);                  // firmware_updaterと同様に1msに変更
 }
 
+// コマンド応答時間の推定値を保存する（NVSの書き込み回数を抑えるため間隔を空ける）
+void saveCommandTimeouts() {
+  CommandTimeouts::Persisted data;
+  commandTimeouts.save(data);
+  Preferences prefs;
+  if (prefs.begin(RTT_PREFS_NAMESPACE, false)) {
+    prefs.putBytes("est", &data, sizeof(data));
+    prefs.end();
+  }
+  rttSavedSamples = commandTimeouts.totalSamples();
+}
+
+// 前回の起動時に学習した推定値を読み込む
+void loadCommandTimeouts() {
+  CommandTimeouts::Persisted data;
+  Preferences prefs;
+  bool restored = false;
+  if (prefs.begin(RTT_PREFS_NAMESPACE, true)) {
+    if (prefs.getBytesLength("est") == sizeof(data) &&
+        prefs.getBytes("est", &data, sizeof(data)) == sizeof(data)) {
+      restored = commandTimeouts.restore(data);
+    }
+    prefs.end();
+  }
+  rttSavedSamples = commandTimeouts.totalSamples();
+  Serial.println(restored ? "[RTT] Restored persisted estimates" : "[RTT] Using default timeouts");
+}
+
+// 現在の推定値をログに出力
+void printCommandTimeouts() {
+  for (int i = 0; i < CMD_TYPE_COUNT; i++) {
+    const RttEstimator &est = commandTimeouts[(CommandType)i];
+    Serial.print("[RTT] ");
+    Serial.print(commandTypeName((CommandType)i));
+    Serial.print(": srtt=");
+    Serial.print(est.srttMs());
+    Serial.print(", rttvar=");
+    Serial.print(est.rttvarMs());
+    Serial.print(", rto=");
+    Serial.print(est.timeoutMs());
+    Serial.print(" (min ");
+    Serial.print(est.minRtoMs());
+    Serial.print(") ms, samples=");
+    Serial.print(est.samples());
+    Serial.print(", timeouts=");
+    Serial.println(est.timeouts());
+  }
+}
+
 // ES920LR3コマンド送信関数（M-BUS接続時の干渉対策）
 // 参考: ES920LR3_LoRaWAN_コマンド仕様ソフトウェア説明書_1.01.pdf
 // M-BUS接続時はSerial2が動作しているため、Serial2の受信バッファもクリア
 // NG 102エラー時は自動的にリトライする
-String sendCommand(const String &cmd, uint32_t wait_ms = 1000, int maxRetries = 10) {
+// 応答待ちのタイムアウトとリトライ間隔はコマンド種別ごとの応答時間の推定値から決める
+String sendCommand(const String &cmd, int maxRetries = COMMAND_MAX_RETRIES) {
+  MemScope memScope(MEM_COMMAND);
+  CommandType type = commandTypeOf(cmd.c_str());
+  RttEstimator &est = commandTimeouts[type];
+  RttEstimator &busyEst = commandTimeouts[CMD_BUSY];
   String resp = "";
   int retryCount = 0;
+  int busyCount = 0;        // 連続した NG 102 の回数
+  uint32_t busySince = 0;   // 最初に NG 102 を受信した時刻
+  uint32_t busyLastMs = 0;  // 最後に NG 102 を受信した時刻
+  bool lastTimedOut = false; // 前回の試行が応答なしだったか（Karn）
 
   while (retryCount <= maxRetries) {
     if (retryCount > 0) {
@@ -52,71 +257,73 @@ String sendCommand(const String &cmd, uint32_t wait_ms = 1000, int maxRetries =
     }
 
     // Serial1の受信バッファをクリア
-    while (Serial1.available()) {
-      Serial1.read();
+    while (loraSerial.available()) {
+      loraSerial.read();
     }
 
     // M-BUS接続時の干渉を避けるため、Serial2の受信バッファもクリア
-    while (Serial2.available()) {
-      Serial2.read(); // Serial2の受信バッファをクリア（ULSA M5Bからのデータを破棄）
+    while (mbusSerial.available()) {
+      mbusSerial.read(); // Serial2の受信バッファをクリア（ULSA M5Bからのデータを破棄）
     }
 
     // コマンド送信（CR+LF付き）
-    Serial1.print(cmd);
-    Serial1.print("\r\n");
-    Serial1.flush(); // 送信完了を待つ
+    uartTrace.mark(UTRACE_MARK_COMMAND, type, millis());
+    loraSerial.print(cmd);
+    loraSerial.print("\r\n");
+    loraSerial.flush(); // 送信完了を待つ
 
     if (retryCount == 0) {
       Serial.print("[TX] ");
       Serial.println(cmd);
     }
 
-    // レスポンスを待つ
-    delay(200); // コマンド送信後の待機時間
-
     resp = "";
+    uint32_t timeout = est.timeoutMs();
     uint32_t start = millis();
+    uint32_t firstByteMs = 0;
+    uint32_t lastByteMs = 0;
 
-    // タイムアウトまでデータを待つ
-    while (millis() - start < wait_ms) {
-      // Serial1からの応答を確認
-      if (Serial1.available()) {
+    // 最初の1バイトまでは推定タイムアウトまで待ち、受信後は無受信が続いたら応答終了とみなす
+    while (true) {
+      uint32_t now = millis();
+      if (loraSerial.available()) {
         // 1文字ずつ読み取ってリアルタイムで表示
-        while (Serial1.available()) {
-          char c = Serial1.read();
+        while (loraSerial.available()) {
+          char c = loraSerial.read();
           if (retryCount == 0) {
             Serial.write(c); // リアルタイムで表示（初回のみ）
           }
           resp += c;
         }
-        // データを受信したら少し待って追加データを確認
-        delay(100);
+        if (firstByteMs == 0) {
+          firstByteMs = now - start + 1;
+        }
+        lastByteMs = now;
       } else {
         // M-BUS接続時はSerial2の受信バッファも定期的にクリア
         // Serial2からのデータがSerial1の応答と混在するのを防ぐ
-        if (Serial2.available()) {
-          // Serial2の受信バッファをクリア（ULSA M5Bからのデータを破棄）
-          while (Serial2.available()) {
-            Serial2.read();
-          }
+        while (mbusSerial.available()) {
+          mbusSerial.read(); // Serial2の受信バッファをクリア（ULSA M5Bからのデータを破棄）
+        }
+        if (resp.length() > 0 && now - lastByteMs >= COMMAND_IDLE_GAP_MS) {
+          break; // 応答の終わり
+        }
+        if (resp.length() == 0 && now - start >= timeout) {
+          break; // タイムアウト
         }
-        delay(50);
+        delay(5);
       }
     }
 
-    // 最後に残っているデータを読み取る
-    delay(100);
-    while (Serial1.available()) {
-      char c = Serial1.read();
-      if (retryCount == 0) {
-        Serial.write(c);
+    // 応答時間を学習（応答なしの直後の試行は、どの送信への応答か曖昧なため除外）
+    if (resp.length() > 0) {
+      if (!lastTimedOut) {
+        est.sample(firstByteMs);
       }
-      resp += c;
-    }
-
-    // M-BUS接続時はSerial2の受信バッファも最終的にクリア
-    while (Serial2.available()) {
-      Serial2.read();
+      lastTimedOut = false;
+    } else {
+      est.onTimeout();
+      lastTimedOut = true;
     }
 
     // NG 102エラーのチェック
@@ -125,21 +332,27 @@ String sendCommand(const String &cmd, uint32_t wait_ms = 1000, int maxRetries =
       upperResp.toUpperCase();
 
       if (upperResp.indexOf("NG 102") >= 0 || upperResp.indexOf("NG102") >= 0) {
+        if (busyCount == 0) {
+          busySince = millis();
+        }
+        busyLastMs = millis();
+        busyCount++;
         // NG 102エラーの場合、モジュールが準備できるまで待機してリトライ
         if (retryCount < maxRetries) {
+          // 過去に観測した「送信待ち」の継続時間を基準に、連続するほど長く待つ
+          uint32_t wait = busyEst.backoffMs() << (busyCount - 1 < 3 ? busyCount - 1 : 3);
+          if (wait > RttEstimator::kMaxRtoMs) {
+            wait = RttEstimator::kMaxRtoMs;
+          }
           Serial.print("[NG 102] Module busy, waiting ");
           uint32_t waitStart = millis();
-          const uint32_t maxWaitTime = 3000; // 最大3秒待機
-          bool moduleReady = false;
-
-          while (millis() - waitStart < maxWaitTime && !moduleReady) {
-            delay(300); // ポーリング間隔
-            if (!Serial1.available()) {
-              delay(200); // 短い時間バッファが空であることを確認
-              if (!Serial1.available()) {
-                moduleReady = true; // 準備完了と判断
-              }
+
+          while (millis() - waitStart < wait) {
+            // 待機中もSerial2の受信バッファをクリア（ULSA M5Bからのデータを破棄）
+            while (mbusSerial.available()) {
+              mbusSerial.read();
             }
+            delay(10);
           }
 
           Serial.print((millis() - waitStart));
@@ -149,17 +362,27 @@ String sendCommand(const String &cmd, uint32_t wait_ms = 1000, int maxRetries =
         } else {
           // 最大リトライ回数に達した場合
           Serial.println("[ERROR] NG 102 after max retries");
+          busyEst.sample(busyLastMs - busySince);
           break;
         }
       } else {
         // NG 102以外の応答の場合、成功または他のエラー
+        // 送信待ちの継続時間は、最初の NG 102 から最後に NG 102 が返った再送までとする。
+        // 最後の待機（自分で決めた待ち時間）を含めると、推定値が大きいほど待ちが長くなり
+        // その待ちがまた推定値を押し上げて上限まで張り付くため、モジュールが実際に
+        // 送信待ちだったと確認できた時間（下限）だけを学習する。
+        if (busyCount > 0) {
+          busyEst.sample(busyLastMs - busySince);
+        }
         break; // ループを抜ける
       }
     } else {
       // 応答がない場合
       if (retryCount < maxRetries) {
-        Serial.println("[WARNING] No response, retrying...");
-        delay(500);
+        Serial.print("[WARNING] No response in ");
+        Serial.print(timeout);
+        Serial.println("ms, retrying...");
+        delay(est.backoffMs());
         retryCount++;
         continue;
       } else {
@@ -200,45 +423,6 @@ bool checkCommandOK(const String &response) {
   return false;
 }
 
-// 送信結果の状態を表すenum
-enum SendResult {
-  SEND_SUCCESS = 0,    // 送信成功
-  SEND_FAILURE = 1,    // 送信失敗
-  SEND_WAIT = 2,       // 送信待ち（NG 102など）
-  SEND_SELECT_MODE = 3 // 再起動時の応答
-};
-
-SendResult checkSendSuccess(const String &response) {
-  if (response.indexOf("Select Mode [") >= 0) {
-    return SEND_SELECT_MODE;
-  }
-
-  // モジュールの仕様に合わせて成功パターンを調整してください
-  String upperResp = response;
-  upperResp.toUpperCase();
-
-  // "NG 102" を検出（送信待ち状態）
-  if (upperResp.indexOf("NG 102") >= 0 || upperResp.indexOf("NG102") >= 0) {
-    return SEND_WAIT;
-  }
-
-  if (upperResp.indexOf("OK") >= 0 ||
-      upperResp.indexOf("SUCCESS") >= 0 ||
-      upperResp.indexOf("SEND OK") >= 0) {
-    return SEND_SUCCESS;
-  }
-
-  if (upperResp.indexOf("FAIL") >= 0 ||
-      upperResp.indexOf("ERROR") >= 0 ||
-      upperResp.indexOf("DENY") >= 0 ||
-      upperResp.indexOf("NG") >= 0) {
-    return SEND_FAILURE;
-  }
-
-  // レスポンスがない場合は失敗とみなす
-  return SEND_FAILURE;
-}
-
 bool waitForJoinOK(uint32_t timeout_ms = 30000) {
   // 参考: ES920LR3仕様書 - startコマンド後のJoin応答
   Serial.println("Waiting for JOIN response...");
@@ -260,8 +444,8 @@ bool waitForJoinOK(uint32_t timeout_ms = 30000) {
     }
 
     // Serial1からのJOIN応答を確認
-    while (Serial1.available()) {
-      char c = Serial1.read();
+    while (loraSerial.available()) {
+      char c = loraSerial.read();
       Serial.write(c); // リアルタイムで表示（デバッグ出力）
       buf += c;
 
@@ -273,10 +457,10 @@ bool waitForJoinOK(uint32_t timeout_ms = 30000) {
 
     // M-BUS接続時の干渉を避けるため、Serial2の受信バッファも定期的にクリア
     // Serial2からのデータがSerial1のJOIN応答と混在するのを防ぐ
-    if (Serial2.available()) {
+    if (mbusSerial.available()) {
       // Serial2の受信バッファをクリア（ULSA M5Bからのデータを破棄）
-      while (Serial2.available()) {
-        Serial2.read();
+      while (mbusSerial.available()) {
+        mbusSerial.read();
       }
     }
 
@@ -317,48 +501,9 @@ bool waitForJoinOK(uint32_t timeout_ms = 30000) {
   return false;
 }
 
-void setup() {
-  auto cfg = M5.config();
-  // PORT.AのI2C機能を無効化（GPIO32/33をUARTとして使用するため）
-  cfg.external_rtc = false; // RTC機能を無効化（必要に応じて）
-  M5.begin(cfg);
-  Serial.begin(115200);
-  delay(2000);
-
-  // M-BUS接続時の干渉対策
-  // ULSA M5BがSerial2を使用している場合、Serial2の受信バッファをクリア
-  // Serial2を無効化するとULSA M5Bが動作しなくなるため、バッファクリアのみ実施
-  Serial.println("Checking Serial2 status for M-BUS interference...");
-
-  // Serial2が既に初期化されているか確認（ULSA M5Bが初期化している可能性）
-  // ESP32では、Serial2がbegin()されていない場合、available()を呼び出すと未定義動作になる可能性がある
-  // そのため、Serial2を明示的に初期化するか、初期化状態を追跡する必要がある
-
-  // M-BUS接続時はULSA M5BがSerial2を使用しているため、Serial2を初期化
-  // GPIO13/14を使用（ULSA M5Bと同じ設定）
-  Serial.println("Initializing Serial2 for M-BUS (ULSA M5B)...");
-  Serial2.begin(115200, SERIAL_8N1, 13, 14);
-
-  // Serial2の受信バッファをクリア（ULSA M5Bからのデータを破棄）
-  delay(50); // Serial2初期化後の待機時間
-  while (Serial2.available()) {
-    Serial2.read();
-  }
-  Serial.println("Serial2 initialized and buffer cleared");
-
-  Serial.println("M5Stack Core2 + ES920LR3 LoRaWAN test");
-
-  // LCD初期化とタイトル表示（最初に実行）
-  M5.Display.fillScreen(BLACK);
-  M5.Display.setTextColor(WHITE, BLACK);
-  M5.Display.setTextSize(2);
-  M5.Display.setCursor(10, 10);
-  M5.Display.println("LoRaWAN Stats");
-  M5.Display.drawLine(0, 35, 320, 35, WHITE);
-  M5.Display.setTextSize(1);
-  M5.Display.setCursor(10, 50);
-  M5.Display.println("Initializing...");
-
+// ES920LR3 をリセットして設定モードに入り、設定・Join まで行う。失敗したら false
+// setup() と、loop() でモジュールだけをやり直すとき（recoverModule()）に使う
+bool initLoRaModule() {
   Serial.print("Initializing LoRa serial: RX=");
   Serial.print(RX_pin);
   Serial.print(", TX=");
@@ -420,8 +565,8 @@ void setup() {
   const uint32_t promptTimeout = 3000; // 3秒でタイムアウト
 
   while (millis() - promptStart < promptTimeout) {
-    if (Serial1.available()) {
-      char c = Serial1.read();
+    if (loraSerial.available()) {
+      char c = loraSerial.read();
       Serial.write(c); // リアルタイムで表示
       startupPrompt += c;
 
@@ -446,8 +591,8 @@ void setup() {
 
   // 残りのバッファをクリア
   delay(100);
-  while (Serial1.available()) {
-    int data = Serial1.read();
+  while (loraSerial.available()) {
+    int data = loraSerial.read();
     if (data != -1) {
       Serial.write(data);
     }
@@ -479,7 +624,7 @@ void setup() {
       delay(100);
     }
 
-    modeResp = sendCommand("2", 2000);
+    modeResp = sendCommand("2");
 
     if (modeResp.length() == 0) {
       Serial.println("[WARNING] No response, retrying...");
@@ -515,7 +660,7 @@ void setup() {
     Serial.println("/3");
 
     // firmware_updaterと同様に "v" コマンドを使用
-    verResp = sendCommand("v", 2000);
+    verResp = sendCommand("v");
     if (verResp.length() > 0) {
       // NGが含まれていないことを確認
       String upperResp = verResp;
@@ -548,15 +693,12 @@ void setup() {
     M5.Display.println("Check wiring/power");
     M5.Display.setTextColor(WHITE, BLACK);
 
-    while (true) {
-      M5.update();
-      delay(1000);
-    }
+    return false;
   }
 
   // // 設定確認（loadコマンド）
   // Serial.println("\n=== Step 2.1: Load Configuration ===");
-  // String loadResp = sendCommand("load", 1000);
+  // String loadResp = sendCommand("load");
   // if (!checkCommandOK(loadResp)) {
   //   Serial.println("[WARNING] Load configuration failed");
   // }
@@ -565,17 +707,14 @@ void setup() {
   // 3) LoRaWAN Class設定
   // 参考: ES920LR3仕様書 8.1. class コマンド
   Serial.println("\n=== Step 3: LoRaWAN Class Setup ===");
-  String classResp = sendCommand("class 1", 1000);
+  String classResp = sendCommand("class 1");
   if (!checkCommandOK(classResp)) {
     Serial.println("[ERROR] Class A setting failed!");
     M5.Display.setCursor(10, 90);
     M5.Display.setTextColor(RED, BLACK);
     M5.Display.println("Class A FAILED!");
     M5.Display.setTextColor(WHITE, BLACK);
-    while (true) {
-      M5.update();
-      delay(1000);
-    }
+    return false;
   }
   delay(500);
 
@@ -589,7 +728,7 @@ void setup() {
   cmd = "deveui " + String(DEV_EUI);
   Serial.print("Setting DevEUI: ");
   Serial.println(DEV_EUI);
-  String deveuiResp = sendCommand(cmd, 1000);
+  String deveuiResp = sendCommand(cmd);
   if (!checkCommandOK(deveuiResp)) {
     Serial.println("[ERROR] DevEUI setting failed!");
     configOK = false;
@@ -600,7 +739,7 @@ void setup() {
   cmd = "appeui " + String(APP_EUI);
   Serial.print("Setting AppEUI: ");
   Serial.println(APP_EUI);
-  String appeuiResp = sendCommand(cmd, 1000);
+  String appeuiResp = sendCommand(cmd);
   if (!checkCommandOK(appeuiResp)) {
     Serial.println("[ERROR] AppEUI setting failed!");
     configOK = false;
@@ -611,39 +750,64 @@ void setup() {
   cmd = "appkey " + String(APP_KEY);
   Serial.print("Setting AppKey: ");
   Serial.println(APP_KEY);
-  String appkeyResp = sendCommand(cmd, 1000);
+  String appkeyResp = sendCommand(cmd);
   if (!checkCommandOK(appkeyResp)) {
     Serial.println("[ERROR] AppKey setting failed!");
     configOK = false;
   }
   delay(500);
 
-  // datarate設定（16進数32文字）
-  // cmd = "datarate 3"; // DR2 帯域幅 125kHz 拡散率 10
-  cmd = "datarate 6"; // DR5 帯域幅 125kHz 拡散率 7
-  Serial.print("Setting datarate: 6");
-  String datarateResp = sendCommand(cmd, 1000);
+  // datarate設定
+  // "datarate 3" = DR2 帯域幅 125kHz 拡散率 10 / "datarate 6" = DR5 帯域幅 125kHz 拡散率 7
+  cmd = "datarate " + String(LORA_DATARATE_SETTING);
+  Serial.print("Setting datarate: ");
+  Serial.println(LORA_DATARATE_SETTING);
+  String datarateResp = sendCommand(cmd);
   if (!checkCommandOK(datarateResp)) {
     Serial.println("[ERROR] Datarate setting failed!");
     configOK = false;
   }
   delay(500);
 
+  // 送信フォーマット設定
+  // バイナリ（長さ1バイト + ペイロード）は終端文字を使わないため、ペイロード中の 0x0D/0x0A で
+  // 送信要求が途切れない。受け付けられない場合は ASCII で16進文字列を送る
+  // （UART のバイト数もエアー上のペイロード長も約2倍になり、送れるペイロードは半分）
+  String formatResp = sendCommand(FORMAT_BINARY_COMMAND);
+  if (checkCommandOK(formatResp)) {
+    uplink.cfg.format = FRAME_FORMAT_BINARY;
+  } else {
+    Serial.println("[WARNING] Binary format rejected, falling back to hex");
+    String hexResp = sendCommand(FORMAT_HEX_COMMAND);
+    if (!checkCommandOK(hexResp)) {
+      Serial.println("[ERROR] Format setting failed!");
+      configOK = false;
+    }
+    uplink.cfg.format = FRAME_FORMAT_HEX;
+    if (!REPORT_BY_EXCEPTION) {
+      // 1Hz の全サンプルを送ると DR5 で約3.2%の送信時間が必要になり、予算（2%）に収まらない
+      Serial.println("[WARNING] Hex doubles airtime: all-sample batches exceed the airtime budget, backlog will drop");
+    }
+  }
+  Serial.print("[FRAME] format: ");
+  Serial.print(uplink.cfg.format == FRAME_FORMAT_BINARY ? "binary" : "hex");
+  Serial.print(", max payload: ");
+  Serial.print(uplink.maxPayload());
+  Serial.println(" bytes");
+  delay(500);
+
   if (!configOK) {
     Serial.println("[ERROR] Configuration failed. Check parameters.");
     M5.Display.setCursor(10, 90);
     M5.Display.setTextColor(RED, BLACK);
     M5.Display.println("Config FAILED!");
     M5.Display.setTextColor(WHITE, BLACK);
-    while (true) {
-      M5.update();
-      delay(1000);
-    }
+    return false;
   }
 
   // 設定確認（showコマンド）
   Serial.println("\n=== Configuration Verification ===");
-  String showResp = sendCommand("show", 2000);
+  String showResp = sendCommand("show");
   Serial.println("Current configuration:");
   Serial.println(showResp);
   delay(500);
@@ -651,7 +815,7 @@ void setup() {
   // 設定を保存
   // 参考: ES920LR3仕様書 8.22. save コマンド
   Serial.println("\n=== Saving Configuration ===");
-  String saveResp = sendCommand("save", 1000);
+  String saveResp = sendCommand("save");
   if (!checkCommandOK(saveResp)) {
     Serial.println("[WARNING] Save command response unclear");
   }
@@ -664,7 +828,7 @@ void setup() {
   M5.Display.setCursor(10, 70);
   M5.Display.println("Joining...");
   Serial.println("Sending start command (entering operation mode)...");
-  String startResp = sendCommand("start", 2000);
+  String startResp = sendCommand("start");
 
   // startコマンドのOKレスポンスを確認
   if (!checkCommandOK(startResp)) {
@@ -675,10 +839,7 @@ void setup() {
     M5.Display.setTextColor(RED, BLACK);
     M5.Display.println("Start FAILED!");
     M5.Display.setTextColor(WHITE, BLACK);
-    while (true) {
-      M5.update();
-      delay(1000);
-    }
+    return false;
   }
 
   Serial.println("Start command OK. Waiting for Join response...");
@@ -691,10 +852,7 @@ void setup() {
     M5.Display.setTextColor(RED, BLACK);
     M5.Display.println("Join FAILED!");
     M5.Display.setTextColor(WHITE, BLACK);
-    while (true) {
-      M5.update();
-      delay(1000);
-    }
+    return false;
   }
 
   Serial.println("Start uplink loop...");
@@ -703,9 +861,88 @@ void setup() {
   M5.Display.setTextColor(GREEN, BLACK);
   M5.Display.println("Joined! Ready to send.");
   M5.Display.setTextColor(WHITE, BLACK);
+  return true;
+}
+
+void setup() {
+  memBegin();
+  auto cfg = M5.config();
+  // PORT.AのI2C機能を無効化（GPIO32/33をUARTとして使用するため）
+  cfg.external_rtc = false; // RTC機能を無効化（必要に応じて）
+  M5.begin(cfg);
+  Serial.begin(115200);
+  delay(2000);
+
+  // M-BUS接続時の干渉対策
+  // ULSA M5BがSerial2を使用している場合、Serial2の受信バッファをクリア
+  // Serial2を無効化するとULSA M5Bが動作しなくなるため、バッファクリアのみ実施
+  Serial.println("Checking Serial2 status for M-BUS interference...");
+
+  // Serial2が既に初期化されているか確認（ULSA M5Bが初期化している可能性）
+  // ESP32では、Serial2がbegin()されていない場合、available()を呼び出すと未定義動作になる可能性がある
+  // そのため、Serial2を明示的に初期化するか、初期化状態を追跡する必要がある
+
+  // M-BUS接続時はULSA M5BがSerial2を使用しているため、Serial2を初期化
+  // GPIO13/14を使用（ULSA M5Bと同じ設定）
+  Serial.println("Initializing Serial2 for M-BUS (ULSA M5B)...");
+  Serial2.begin(115200, SERIAL_8N1, 13, 14);
+
+  // Serial2の受信バッファをクリア（ULSA M5Bからのデータを破棄）
+  delay(50); // Serial2初期化後の待機時間
+  while (Serial2.available()) {
+    Serial2.read();
+  }
+  Serial.println("Serial2 initialized and buffer cleared");
+
+  Serial.println("M5Stack Core2 + ES920LR3 LoRaWAN test");
+
+  // 前回までに学習したコマンド応答時間を読み込む
+  loadCommandTimeouts();
+  printCommandTimeouts();
+
+  // LCD初期化とタイトル表示（最初に実行）
+  M5.Display.fillScreen(BLACK);
+  M5.Display.setTextColor(WHITE, BLACK);
+  M5.Display.setTextSize(2);
+  M5.Display.setCursor(10, 10);
+  M5.Display.println("LoRaWAN Stats");
+  M5.Display.drawLine(0, 35, 320, 35, WHITE);
+  M5.Display.setTextSize(1);
+  M5.Display.setCursor(10, 50);
+  M5.Display.println("Initializing...");
+
+  // UART 通信の記録を始める（SD カードがなければ記録しない）
+  if (UART_TRACE_ENABLED) {
+    uartTraceBegin(0);
+  }
+  if (SAMPLE_LOG_ENABLED) {
+    sampleLogBegin();
+  }
+
+  if (!initLoRaModule()) {
+    while (true) {
+      M5.update();
+      delay(1000);
+    }
+  }
+
+  // 設定・Joinで学習した応答時間を保存
+  saveCommandTimeouts();
+  printCommandTimeouts();
+
+  // Join完了時刻を基準に送信スロットを開始（最初の時刻同期で UNIX時刻に合わせ直す）
+  uplink.begin(millis());
+  Serial.print("[SCHED] period: ");
+  Serial.print(uplinkScheduler.periodMs());
+  Serial.print(" ms, phase: ");
+  Serial.print(uplinkScheduler.phaseMs());
+  Serial.print(" ms, jitter: +/-");
+  Serial.print(uplinkScheduler.jitterMaxMs());
+  Serial.println(" ms");
 }
 
 void updateDisplay(uint32_t sendCount, uint32_t successCount, uint32_t failCount, bool lastSuccess, uint32_t elapsedMs) {
+  MemScope memScope(MEM_DISPLAY);
   // 統計情報表示エリアをクリア（タイトルと線の下）
   M5.Display.fillRect(0, 40, 320, 200, BLACK);
 
@@ -777,75 +1014,414 @@ void updateDisplay(uint32_t sendCount, uint32_t successCount, uint32_t failCount
   M5.Display.setTextColor(WHITE, BLACK);
 }
 
-void loop() {
-  M5.update(); // M5Unifiedの更新処理
+// 再描画待ちの LCD 表示と loop() の最長周期（MEM_LOG_INTERVAL_MS ごとに出力してリセット）
+static bool displayDirty = false;
+static uint32_t displayDeferredLoops = 0;
+static uint32_t loopMaxPeriodMs = 0;
 
-  static uint32_t lastSendTime = 0;
-  static uint32_t sendCount = 0;
-  static uint32_t successCount = 0;
-  static uint32_t failCount = 0;
-  static bool lastSuccess = false;
+// 再描画待ちなら LCD を描く。SD の書き込み中・書き込み待ちは描かずに次の loop() に回す
+// （LCD と SD は同じ SPI バスのため、書き込みが詰まると描画の間 loop() が止まる。include/sd_bus.h を参照）
+void serviceDisplay() {
+  if (!displayDirty) {
+    return;
+  }
+  if (sampleLogWritePending() || !sdBusTryLock()) {
+    displayDeferredLoops++;
+    return;
+  }
+  updateDisplay(uplinkSession.sent(), uplinkSession.accepted(),
+                uplinkSession.rejected() + uplinkSession.timeouts(), uplink.lastSuccess(), uplink.elapsedMs());
+  sdBusUnlock();
+  displayDirty = false;
+}
 
-  // 前回送信からの経過時間を計算
-  uint32_t elapsedMs = (lastSendTime > 0) ? (millis() - lastSendTime) : 0;
+void printLoopStats() {
+  Serial.print("[LOOP] max period: ");
+  Serial.print(loopMaxPeriodMs);
+  Serial.print(" ms, display deferred: ");
+  Serial.print(displayDeferredLoops);
+  Serial.println(" loops");
+  loopMaxPeriodMs = 0;
+}
 
-  // lastSendTimeから10秒経過している場合に送信可能
-  bool canSend = (lastSendTime == 0) || (millis() - lastSendTime >= 10000);
+// 遅延分布をログに出力
+void printLatency(const char *label, const LatencyHistogram &h) {
+  Serial.print("[LATENCY] ");
+  Serial.print(label);
+  Serial.print(": n=");
+  Serial.print(h.count());
+  if (h.count() > 0) {
+    Serial.print(", min=");
+    Serial.print(h.min());
+    Serial.print(", mean=");
+    Serial.print(h.mean());
+    Serial.print(", p50<=");
+    Serial.print(h.percentile(50));
+    Serial.print(", p95<=");
+    Serial.print(h.percentile(95));
+    Serial.print(", max=");
+    Serial.print(h.max());
+    Serial.print(" ms");
+  }
+  Serial.println();
+}
 
-  // 送信可能な場合のみ送信を試みる
-  if (!canSend) {
-    return;
+void printStats() {
+  uint32_t sendCount = uplinkSession.sent();
+  uint32_t successCount = uplinkSession.accepted();
+  uint32_t failCount = uplinkSession.rejected() + uplinkSession.timeouts();
+
+  Serial.print("[STATS] Total: ");
+  Serial.print(successCount);
+  Serial.print(" success, ");
+  Serial.print(failCount);
+  Serial.print(" failed, ");
+  Serial.print(uplinkSession.confirmed());
+  Serial.print(" confirmed, ");
+  Serial.print(uplinkSession.inflight());
+  Serial.print(" in-flight");
+  if (sendCount > 0) {
+    Serial.print(", success rate: ");
+    Serial.print((successCount * 100) / sendCount);
+    Serial.print("%");
   }
+  Serial.println("");
+}
+
+// 組み立てたフレームをモジュールへ書き込む
+void FirmwareUplinkPort::writeFrame(const uint8_t *frame, size_t len) {
+  loraSerial.write(frame, len);
+  loraSerial.flush();
+}
 
-  // センサーデータをバイナリ形式で送信（12バイト）
-  SensorData sensorData;
+void FirmwareUplinkPort::onModuleReboot() {
+  Serial.println("[REBOOT] Select Mode detected");
+  resetReason = "module reboot";
+}
 
-  // データの設定（例：実際のセンサー値に置き換えてください）
-  sensorData.nodeId = 1;            // 0-10
-  sensorData.windDirection = 180;   // 0-360 (度)
-  sensorData.airSpeed100 = 123;     // 0-5000 (値×100、例: 12.3 m/s)
-  sensorData.virtualTemp100 = 2025; // 0-5000 (値×100、例: 20.25°C)
-  sensorData.rssiAbs = 45;          // 0-99 (-rssiの絶対値)
-  // sensorData.unixmilli = millis() % 864000000UL; // 0-864000000 (ミリ秒、約10日間)
-
-  // バイナリデータを送信（12バイト）
-  Serial1.write((uint8_t *)&sensorData, sizeof(SensorData));
-  Serial1.print("\r\n");
-  Serial1.flush();
-  lastSendTime = millis(); // 送信時刻を更新
-  sendCount++;
+// バイナリのフレームの区切りがずれたら、NRST でモジュールの受信状態を消して設定からやり直す
+void FirmwareUplinkPort::onFrameDesync() {
+  Serial.println("[FRAME] Frame boundary lost");
+  resetReason = "frame desync";
+}
 
-  // デバッグ用：送信データを16進数で表示
+// モジュールだけをリセットして設定・Join をやり直す。ESP32 は再起動しないため、未送信のサンプル・
+// イベント・時刻同期・応答時間の推定値は引き継ぐ。短時間に繰り返す場合や設定に失敗した場合は再起動する
+void recoverModule() {
+  static ModuleResetLimiter limiter;
+  const char *reason = uplinkPort.resetReason;
+  uplinkPort.resetReason = nullptr;
+  if (!limiter.allow(millis())) {
+    Serial.print("[RESET] ");
+    Serial.print(reason);
+    Serial.print(": more than ");
+    Serial.print(ModuleResetLimiter::kMaxResets);
+    Serial.print(" module resets within ");
+    Serial.print(ModuleResetLimiter::kWindowMs / 60000);
+    Serial.println(" min. Rebooting M5Stack...");
+    delay(100); // シリアル出力を確実に送信
+    ESP.restart();
+  }
+  Serial.print("[RESET] ");
+  Serial.print(reason);
+  Serial.println(": resetting the LoRa module");
+  if (!initLoRaModule()) {
+    Serial.println("[RESET] Module setup failed. Rebooting M5Stack...");
+    delay(100); // シリアル出力を確実に送信
+    ESP.restart();
+  }
+  uplink.reset(millis());
+  Serial.print("[RESET] module ready, kept ");
+  Serial.print(sampleRing.size());
+  Serial.print(" samples and ");
+  Serial.print(eventQueue.size());
+  Serial.println(" events");
+}
+
+// 診断フレーム（メモリ使用状況）。seq はセンサーデータ・イベントと共通（UplinkLoop が設定する）
+void FirmwareUplinkPort::fillDiag(DiagData &diag) {
+  static uint32_t lastAllocs[MEM_SUBSYSTEM_COUNT] = {0};
+
+  MemSnapshot snap;
+  memTakeSnapshot(snap);
+
+  diag.freeHeap8 = (uint16_t)min(snap.freeHeap / 8, (uint32_t)UINT16_MAX);
+  diag.minFreeHeap8 = (uint16_t)min(snap.minFreeHeap / 8, (uint32_t)UINT16_MAX);
+  diag.largestBlock8 = (uint16_t)min(snap.largestBlock / 8, (uint32_t)UINT16_MAX);
+  diag.loopStackHwm = (uint16_t)min(snap.loopStackHwm, (uint32_t)UINT16_MAX);
+  for (int i = 0; i < 4; i++) {
+    uint32_t delta = snap.allocs[MEM_COMMAND + i] - lastAllocs[MEM_COMMAND + i];
+    diag.allocs[i] = (uint16_t)min(delta, (uint32_t)UINT16_MAX);
+  }
+  for (int i = 0; i < MEM_SUBSYSTEM_COUNT; i++) {
+    lastAllocs[i] = snap.allocs[i];
+  }
+  diag.uptimeMin = (uint16_t)min(millis() / 60000, (unsigned long)UINT16_MAX);
+}
+
+void FirmwareUplinkPort::onSent(UplinkKind kind, uint8_t seq, const uint8_t *payload, size_t len, size_t count,
+                                uint32_t airtimeUs) {
+  uartTrace.mark(UTRACE_MARK_UPLINK, seq, millis());
   Serial.println("----------------------------------------");
+  if (kind == UPLINK_EVENT) {
+    const EventData &ev = *(const EventData *)payload;
+    Serial.print("[EVENT] seq ");
+    Serial.print(seq);
+    Serial.print(" sent, events: 0x");
+    Serial.print(ev.events, HEX);
+    Serial.print(", airtime: ");
+    Serial.print(airtimeUs / 1000);
+    Serial.println(" ms");
+    return;
+  }
+  if (kind == UPLINK_DIAG) {
+    const DiagData &diag = *(const DiagData *)payload;
+    Serial.print("[DIAG] seq ");
+    Serial.print(seq);
+    Serial.print(", free heap: ");
+    Serial.print(diag.freeHeap8 * 8);
+    Serial.print(", min free: ");
+    Serial.print(diag.minFreeHeap8 * 8);
+    Serial.print(", largest block: ");
+    Serial.print(diag.largestBlock8 * 8);
+    Serial.print(", loop stack hwm: ");
+    Serial.println(diag.loopStackHwm);
+    return;
+  }
+
   Serial.print("[SEND #");
-  Serial.print(sendCount);
-  Serial.print("] Payload (");
-  Serial.print(sizeof(SensorData));
-  Serial.println(" bytes):");
-  Serial.print("  nodeId: ");
-  Serial.println(sensorData.nodeId);
-  Serial.print("  windDirection: ");
-  Serial.println(sensorData.windDirection);
-  Serial.print("  airSpeed100: ");
-  Serial.println(sensorData.airSpeed100);
-  Serial.print("  virtualTemp100: ");
-  Serial.println(sensorData.virtualTemp100);
-  Serial.print("  rssiAbs: ");
-  Serial.println(sensorData.rssiAbs);
-  // Serial.print("  unixmilli: ");
-  // Serial.println(sensorData.unixmilli);
+  Serial.print(uplinkSession.sent());
+  Serial.print("] seq ");
+  Serial.print(seq);
+  Serial.print(", ");
+  Serial.print(count);
+  Serial.print(" samples, payload ");
+  Serial.print(len);
+  Serial.print(" bytes, UART ");
+  Serial.print(uplinkFrameSize(uplink.cfg.format, len));
+  Serial.print(" bytes, backlog: ");
+  Serial.print(sampleRing.size());
+  Serial.print(" (peak ");
+  Serial.print(sampleRing.peak());
+  Serial.print("/");
+  Serial.print(SampleRing::kCapacity);
+  Serial.print("), dropped: ");
+  Serial.print(sampleRing.dropped());
+  if (REPORT_BY_EXCEPTION) {
+    Serial.print(", held: ");
+    Serial.print(reportFilter.suppressed());
+    Serial.print("/");
+    Serial.print(reportFilter.suppressed() + reportFilter.reported());
+  }
+  Serial.println(timebase.synced() ? "" : ", time unsynced");
+
+  // デバッグ用：送信データを16進数で表示
   Serial.print("  Hex: ");
-  uint8_t *dataPtr = (uint8_t *)&sensorData;
-  for (size_t i = 0; i < sizeof(SensorData); i++) {
-    if (dataPtr[i] < 0x10)
+  for (size_t i = 0; i < len; i++) {
+    if (payload[i] < 0x10)
       Serial.print("0");
-    Serial.print(dataPtr[i], HEX);
+    Serial.print(payload[i], HEX);
     Serial.print(" ");
   }
   Serial.println();
+}
+
+void FirmwareUplinkPort::onResult(SessionEvent ev) {
+  switch (ev) {
+  case EV_ACCEPTED:
+    Serial.print("[ACK] seq ");
+    Serial.print(uplinkSession.lastSeq());
+    Serial.println(" accepted by module");
+    break;
+  case EV_CONFIRMED:
+    Serial.print("[ACK] seq ");
+    Serial.print(uplinkSession.lastSeq());
+    Serial.println(" confirmed by network");
+    return;
+  case EV_REJECTED:
+    Serial.print("[NG] seq ");
+    Serial.print(uplinkSession.lastSeq());
+    Serial.print(" rejected: ");
+    Serial.println(uplinkSession.lastLine());
+    break;
+  case EV_TIMEOUT:
+    Serial.print("[TIMEOUT] seq ");
+    Serial.print(uplinkSession.lastSeq());
+    Serial.println(" no module response");
+    break;
+  default:
+    return;
+  }
+  printStats();
+}
+
+void FirmwareUplinkPort::onEventDetected(uint8_t events) {
+  Serial.print("[EVENT] detected:");
+  if (events & EVENT_GUST) {
+    Serial.print(" gust");
+  }
+  if (events & EVENT_TEMP_HIGH) {
+    Serial.print(" temp-high");
+  }
+  if (events & EVENT_TEMP_LOW) {
+    Serial.print(" temp-low");
+  }
+  if (events & EVENT_SENSOR_SILENT) {
+    Serial.print(" sensor-silent");
+  }
+  Serial.println();
+}
+
+void FirmwareUplinkPort::onEventAccepted(uint8_t seq, uint32_t latencyMs) {
+  Serial.print("[EVENT] seq ");
+  Serial.print(seq);
+  Serial.print(" on air ");
+  Serial.print(latencyMs);
+  Serial.println(" ms after detection");
+}
+
+void FirmwareUplinkPort::onEventAcked(uint8_t seq, uint32_t latencyMs) {
+  Serial.print("[EVENT] seq ");
+  Serial.print(seq);
+  Serial.print(" acknowledged ");
+  Serial.print(latencyMs);
+  Serial.println(" ms after detection");
+}
+
+void FirmwareUplinkPort::onTimeDownlink(uint8_t seq, uint64_t unixMs, bool applied) {
+  if (!applied) {
+    // 対応するアップリンクがないか、周波数ずれでは説明できないほど外れていた（Timebase::sync()）
+    Serial.print("[TIME] Ignored time downlink for seq ");
+    Serial.print(seq);
+    Serial.print(", rejected so far: ");
+    Serial.println(timebase.rejectedSyncs());
+    return;
+  }
+  Serial.print("[TIME] synced to seq ");
+  Serial.print(seq);
+  Serial.print(", unix: ");
+  Serial.print((uint32_t)(unixMs / 1000));
+  Serial.print(".");
+  Serial.print((uint32_t)(unixMs % 1000));
+  Serial.print(", error: ");
+  Serial.print(timebase.lastErrorMs());
+  Serial.print(" ms, drift: ");
+  Serial.print(timebase.driftPpb() / 1000);
+  Serial.println(" ppm");
+}
+
+void FirmwareUplinkPort::onSlotDeferred() {
+  Serial.print("[BUDGET] slot deferred, available airtime: ");
+  Serial.print(airtimeBudget.availableUs() / 1000);
+  Serial.print(" ms, backlog: ");
+  Serial.println(sampleRing.size());
+}
+
+void FirmwareUplinkPort::onOversize(size_t len) {
+  Serial.print("[ERROR] Payload ");
+  Serial.print(len);
+  Serial.print(" bytes exceeds ");
+  Serial.print(uplink.maxPayload());
+  Serial.println(" bytes at current datarate, not sent");
+}
+
+// センサー値を読み取る。値が得られなかった場合は false
+bool readSensorSample(BatchSample &sample) {
+  // データの設定（例：実際のセンサー値に置き換えてください）
+  sample.windDirection = 180;   // 0-360 (度)
+  sample.airSpeed100 = 123;     // 0-5000 (値×100、例: 12.3 m/s)
+  sample.virtualTemp100 = 2025; // 0-5000 (値×100、例: 20.25°C)
+  sample.rssiAbs = 45;          // 0-99 (-rssiの絶対値)
+  return true;
+}
+
+void loop() {
+  // loop() の周期を測る（SD の書き込みが詰まっても、ここが伸びるとモジュールの応答処理が遅れる）
+  static uint32_t lastLoopMs = millis();
+  uint32_t loopStartMs = millis();
+  loopMaxPeriodMs = max(loopMaxPeriodMs, loopStartMs - lastLoopMs);
+  lastLoopMs = loopStartMs;
+
+  M5.update(); // M5Unifiedの更新処理
+
+  static uint32_t lastMemLog = 0;
+  static uint32_t nextSampleMs = millis();
+
+  // 一定周期でセンサー値を取得し、取得時刻とともにリングに積む（送信はスロットごとにまとめる）
+  if ((int32_t)(millis() - nextSampleMs) >= 0) {
+    BatchSample sample;
+    if (readSensorSample(sample)) {
+      if (SAMPLE_LOG_ENABLED) {
+        // 送信の間引き（不感帯）の前に記録する。SD の書き込みを待たない
+        sampleLog.append(millis(), timebase.toUnixMs(millis()), sample);
+      }
+      uplink.onSample(sample, millis());
+    } else {
+      uplink.onSampleMissed(millis());
+    }
+    nextSampleMs += SAMPLE_PERIOD_MS;
+    if ((int32_t)(millis() - nextSampleMs) >= 0) {
+      nextSampleMs = millis() + SAMPLE_PERIOD_MS; // 長く止まっていた場合は追いつこうとしない
+    }
+  }
+  sampleLog.poll(millis());
+
+  // メモリ使用状況を定期的にログ出力
+  if (millis() - lastMemLog >= MEM_LOG_INTERVAL_MS) {
+    lastMemLog = millis();
+    memLogTelemetry();
+    uartTraceLogStats();
+    sampleLogLogStats();
+    printLoopStats();
+  }
+
+  // モジュールの応答（OK/NG/確認応答/ダウンリンク）を到着したぶんだけ処理する
+  // 送信結果は送信中テーブルと照合するため、応答が遅れても取り違えない
+  bool displayChanged = false;
+  {
+    MemScope memScope(MEM_SESSION);
+    while (loraSerial.available()) {
+      char c = loraSerial.read();
+      Serial.write(c); // デバッグ出力用
+      displayChanged |= uplink.feed(c, millis());
+    }
+    displayChanged |= uplink.poll(millis());
+  }
+  if (uplinkPort.resetReason != nullptr) {
+    recoverModule();
+    return;
+  }
+
+  // 記録中は M-BUS の受信も記録する（干渉の時刻を応答と突き合わせるため。データ自体は使わない）
+  if (uartTrace.active()) {
+    while (mbusSerial.available()) {
+      mbusSerial.read();
+    }
+    uartTrace.poll(millis());
+  }
+
+  if (displayChanged) {
+    displayDirty = true;
+  }
+  serviceDisplay();
+
+  MemScope memScope(MEM_UPLINK);
+
+  // 優先クラス：イベントは送信スロットを待たずに送る
+  if (uplink.sendPendingEvent(millis())) {
+    delay(10);
+    return;
+  }
+
+  // 送信スロットに達した場合のみ送信を試みる（逃したスロットは isDue() 内で読み飛ばされる）
+  if (uplink.serviceSlot(millis()) != UplinkLoop::SLOT_BATCH_SENT) {
+    delay(10);
+    return;
+  }
 
   // 前回送信からの経過時間を表示
-  if (lastSendTime > 0) {
+  uint32_t elapsedMs = uplink.elapsedMs();
+  if (elapsedMs > 0) {
     Serial.print("[ELAPSED] ");
     if (elapsedMs < 10000) { // 10s
       Serial.print(elapsedMs);
@@ -858,51 +1434,44 @@ void loop() {
     }
   }
 
-  delay(200);
-  String response = "";
-  while (Serial1.available()) {
-    char c = Serial1.read();
-    response += c;
-    Serial.write(c); // デバッグ出力用
-  }
-
-  SendResult result = checkSendSuccess(response);
-
-  if (result == SEND_SUCCESS) {
-    lastSuccess = true;
-    successCount++;
-  } else if (result == SEND_SELECT_MODE) {
-    // reboot
-    Serial.println("[REBOOT] Select Mode detected. Rebooting M5Stack...");
-    delay(100); // シリアル出力を確実に送信
-    ESP.restart();
-  } else {
-    // 送信失敗
-    lastSuccess = false;
-    failCount++;
-    lastSendTime = millis(); // 送信時刻を更新
+  Serial.print("[SCHED] slot: ");
+  Serial.print(uplinkScheduler.slotIndex());
+  Serial.print(", lateness: ");
+  Serial.print(uplinkScheduler.lastLatenessMs());
+  Serial.print(" ms, missed: ");
+  Serial.print(uplinkScheduler.missedSlots());
+  Serial.println(uplinkScheduler.unixAligned() ? ", aligned to unix time" : ", local epoch");
+
+  if (uplinkSession.sent() % LATENCY_REPORT_INTERVAL == 0) {
+    printLatency("send->ok", uplinkSession.moduleLatency());
+    printLatency("send->confirm", uplinkSession.confirmLatency());
+    printLatency("event->air", eventQueue.toAir());
+    printLatency("event->ack", eventQueue.toAck());
+    Serial.print("[BUDGET] used airtime: ");
+    Serial.print((uint32_t)(airtimeBudget.usedUs() / 1000));
+    Serial.print(" ms, available: ");
+    Serial.print(airtimeBudget.availableUs() / 1000);
+    Serial.print(" ms, deferred slots: ");
+    Serial.print(uplink.deferredSlots());
+    Serial.print(", events queued/delivered/dropped/expired: ");
+    Serial.print(eventQueue.queued());
+    Serial.print("/");
+    Serial.print(eventQueue.delivered());
+    Serial.print("/");
+    Serial.print(eventQueue.dropped());
+    Serial.print("/");
+    Serial.println(eventQueue.expired());
+    printCommandTimeouts();
   }
 
-  Serial.print("[STATS] Total: ");
-  Serial.print(successCount);
-  Serial.print(" success, ");
-  Serial.print(failCount);
-  Serial.print(" failed");
-  if (sendCount > 0) {
-    Serial.print(", success rate: ");
-    Serial.print((successCount * 100) / sendCount);
-    Serial.print("%");
+  // 学習した応答時間を一定サンプルごとに保存
+  if (commandTimeouts.totalSamples() - rttSavedSamples >= RTT_SAVE_INTERVAL) {
+    saveCommandTimeouts();
   }
-  Serial.println("");
 
   // ディスプレイ更新
-  updateDisplay(sendCount, successCount, failCount, lastSuccess, elapsedMs);
-
-  // Downlinkが来る場合に備えて、常に受信を少し捌く
-  while (Serial1.available()) {
-    char c = Serial1.read();
-    Serial.write(c); // デバッグ出力用
-  }
+  displayDirty = true;
+  serviceDisplay();
 
   delay(10);
 }
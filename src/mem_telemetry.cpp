@@ -0,0 +1,110 @@
+#include "mem_telemetry.h"
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+volatile uint8_t memCurrentSubsystem = MEM_OTHER;
+volatile uint32_t memAllocCounts[MEM_SUBSYSTEM_COUNT] = {0};
+
+static TaskHandle_t memLoopTask = nullptr;
+
+// memCurrentSubsystem は loopTask の MemScope の状態なので、他のタスクの確保には使わない
+static inline uint8_t memTaskSubsystem() {
+  return xTaskGetCurrentTaskHandle() == memLoopTask ? memCurrentSubsystem : (uint8_t)MEM_OTHER;
+}
+
+// malloc/calloc/realloc のラッパー（-Wl,--wrap=malloc 等でリンク時に差し替え）
+// String や new の確保もここを通るため、サブシステムごとの確保回数を数えられる
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  memCountAlloc(memTaskSubsystem());
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  memCountAlloc(memTaskSubsystem());
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  memCountAlloc(memTaskSubsystem());
+  return __real_realloc(ptr, size);
+}
+}
+
+// スタック残量を監視するタスク
+#define MEM_MAX_TASKS 4
+
+struct MemTask {
+  const char *name;
+  TaskHandle_t handle;
+};
+
+static MemTask memTasks[MEM_MAX_TASKS];
+static int memTaskCount = 0;
+static uint32_t memLastAllocs[MEM_SUBSYSTEM_COUNT] = {0};
+
+void memBegin() {
+  // setup() と loop() は同じ loopTask 上で実行される
+  memLoopTask = xTaskGetCurrentTaskHandle();
+}
+
+void memRegisterTask(const char *name, void *taskHandle) {
+  if (memTaskCount < MEM_MAX_TASKS) {
+    memTasks[memTaskCount].name = name;
+    memTasks[memTaskCount].handle = (TaskHandle_t)taskHandle;
+    memTaskCount++;
+  }
+}
+
+void memTakeSnapshot(MemSnapshot &snap) {
+  snap.freeHeap = ESP.getFreeHeap();
+  snap.minFreeHeap = ESP.getMinFreeHeap();
+  snap.largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  // ESP32のスタック残量はバイト単位
+  snap.loopStackHwm = memLoopTask ? uxTaskGetStackHighWaterMark(memLoopTask) : 0;
+  for (int i = 0; i < MEM_SUBSYSTEM_COUNT; i++) {
+    snap.allocs[i] = memAllocCounts[i];
+  }
+}
+
+void memLogTelemetry() {
+  MemSnapshot snap;
+  memTakeSnapshot(snap);
+
+  Serial.print("[MEM] free: ");
+  Serial.print(snap.freeHeap);
+  Serial.print(", min free: ");
+  Serial.print(snap.minFreeHeap);
+  Serial.print(", largest block: ");
+  Serial.print(snap.largestBlock);
+  Serial.print(", frag: ");
+  Serial.print(snap.freeHeap > 0 ? 100 - (snap.largestBlock * 100) / snap.freeHeap : 0);
+  Serial.println("%");
+
+  Serial.print("[MEM] stack hwm: loopTask=");
+  Serial.print(snap.loopStackHwm);
+  for (int i = 0; i < memTaskCount; i++) {
+    Serial.print(", ");
+    Serial.print(memTasks[i].name);
+    Serial.print("=");
+    Serial.print(uxTaskGetStackHighWaterMark(memTasks[i].handle));
+  }
+  Serial.println();
+
+  // 前回出力からの確保回数（一定周期で増え続けるサブシステムは String 等の再確保を疑う）
+  Serial.print("[MEM] allocs:");
+  for (int i = 0; i < MEM_SUBSYSTEM_COUNT; i++) {
+    Serial.print(" ");
+    Serial.print(memSubsystemName((MemSubsystem)i));
+    Serial.print("=");
+    Serial.print(snap.allocs[i] - memLastAllocs[i]);
+    memLastAllocs[i] = snap.allocs[i];
+  }
+  Serial.println();
+}
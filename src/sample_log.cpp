@@ -0,0 +1,182 @@
+#include "sample_log.h"
+#include "mem_telemetry.h"
+#include "sd_bus.h"
+#include <Arduino.h>
+#include <SD.h>
+#include <SPI.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Core2 の microSD スロット（UART トレースと共用。先に初期化されていれば SD.begin() はそのまま成功する）
+#define SD_CS_PIN 4
+#define SD_SPI_FREQ 25000000
+
+#define SAMPLE_LOG_BUFFERS 2           // ダブルバッファ
+#define SAMPLE_LOG_BLOCKS_PER_BUFFER 16 // 1回の書き込み（8KB、約860サンプル）
+#define SAMPLE_LOG_FLUSH_MS 10000      // バッファが一杯にならなくても書き出す間隔（電源断で失う範囲）
+#define SAMPLE_LOG_DIR "/log"
+
+// SD カードのファイル
+class SdLogStorage : public LogStorage {
+public:
+  bool open(const char *path) override {
+    file_ = SD.open(path, FILE_WRITE);
+    return (bool)file_;
+  }
+
+  bool write(const uint8_t *p, size_t len) override { return file_.write(p, len) == len; }
+
+  bool seekBack(size_t len) override {
+    size_t pos = file_.position();
+    return pos >= len && file_.seek(pos - len);
+  }
+
+  bool sync() override {
+    file_.flush();
+    return true;
+  }
+
+  void close() override { file_.close(); }
+
+  bool remove(const char *path) override { return SD.remove(path); }
+
+  // FAT の rename は置き換えできないため、先に消す（その間に電源が切れても begin() は一時ファイルを読む）
+  bool rename(const char *from, const char *to) override {
+    if (SD.exists(to) && !SD.remove(to)) {
+      return false;
+    }
+    return SD.rename(from, to);
+  }
+
+  bool listDir(const char *dir, void (*fn)(const char *name, void *ctx), void *ctx) override {
+    File d = SD.open(dir);
+    if (!d || !d.isDirectory()) {
+      return false;
+    }
+    for (File f = d.openNextFile(); f; f = d.openNextFile()) {
+      // コアのバージョンによって name() がパスを含むため、最後の '/' より後を渡す
+      const char *name = f.name();
+      const char *slash = strrchr(name, '/');
+      fn(slash != nullptr ? slash + 1 : name, ctx);
+      f.close();
+    }
+    d.close();
+    return true;
+  }
+
+  bool writeFile(const char *path, const uint8_t *p, size_t len) override {
+    File f = SD.open(path, FILE_WRITE);
+    if (!f) {
+      return false;
+    }
+    bool ok = f.write(p, len) == len;
+    f.close();
+    return ok;
+  }
+
+  bool readFile(const char *path, uint8_t *p, size_t maxLen, size_t &len) override {
+    if (!SD.exists(path)) {
+      return false;
+    }
+    File f = SD.open(path, FILE_READ);
+    if (!f) {
+      return false;
+    }
+    len = f.read(p, maxLen);
+    f.close();
+    return true;
+  }
+
+private:
+  File file_;
+};
+
+static uint8_t sampleLogMemory[SAMPLE_LOG_BUFFERS * SAMPLE_LOG_BLOCKS_PER_BUFFER * SAMPLE_LOG_BLOCK_SIZE];
+SampleLogBuffer sampleLog(sampleLogMemory, SAMPLE_LOG_BUFFERS, SAMPLE_LOG_BLOCKS_PER_BUFFER, SAMPLE_LOG_FLUSH_MS);
+
+static SdLogStorage sampleLogStorage;
+static SampleLogWriter *sampleLogWriter = nullptr;
+static bool sampleLogActive = false;
+static volatile uint32_t sampleLogMaxWriteMs = 0;
+
+// 書き出し待ちのバッファを SD に書き込むタスク
+// 書き込みが詰まっている間、loop() 側は空きバッファがなければサンプルを捨てて先に進む
+static void sampleLogTask(void *) {
+  for (;;) {
+    size_t len;
+    bool openTail;
+    bool timed;
+    uint8_t *buf = sampleLog.peek(len, openTail, timed);
+    if (buf == nullptr) {
+      vTaskDelay(pdMS_TO_TICKS(20));
+      continue;
+    }
+    sdBusLock();
+    uint32_t start = millis();
+    sampleLogWriter->write(buf, len, openTail, timed);
+    uint32_t took = millis() - start;
+    sdBusUnlock();
+    if (took > sampleLogMaxWriteMs) {
+      sampleLogMaxWriteMs = took;
+    }
+    sampleLog.release();
+  }
+}
+
+bool sampleLogBegin() {
+  if (!SD.begin(SD_CS_PIN, SPI, SD_SPI_FREQ)) {
+    Serial.println("[LOG] SD card not found, sample log disabled");
+    return false;
+  }
+  if (!SD.exists(SAMPLE_LOG_DIR)) {
+    SD.mkdir(SAMPLE_LOG_DIR);
+  }
+  static SampleLogWriter::Config cfg;
+  cfg.dir = SAMPLE_LOG_DIR;
+  static SampleLogWriter writer(sampleLogStorage, cfg);
+  if (!writer.begin()) {
+    Serial.println("[LOG] Cannot create log file, sample log disabled");
+    return false;
+  }
+  sampleLogWriter = &writer;
+  sampleLogActive = true;
+
+  TaskHandle_t task = nullptr;
+  // loop() は core 1 で動くため、書き込みは core 0 の低い優先度で行う
+  xTaskCreatePinnedToCore(sampleLogTask, "sampleLog", 4096, nullptr, 1, &task, 0);
+  memRegisterTask("sampleLog", task);
+
+  char path[32];
+  SampleLogWriter::filePath(SAMPLE_LOG_DIR, writer.currentFileNo(), path, sizeof(path));
+  Serial.print("[LOG] Recording samples to ");
+  Serial.print(path);
+  Serial.print(", ");
+  Serial.print(writer.index().size());
+  Serial.println(writer.indexRebuilt() ? " files in index (rebuilt from file names)" : " files in index");
+  return true;
+}
+
+bool sampleLogWritePending() { return sampleLogActive && sampleLog.pendingBuffers() > 0; }
+
+void sampleLogLogStats() {
+  if (!sampleLogActive) {
+    return;
+  }
+  Serial.print("[LOG] file ");
+  Serial.print(sampleLogWriter->currentFileNo());
+  Serial.print(": appended ");
+  Serial.print(sampleLog.appended());
+  Serial.print(" samples, dropped ");
+  Serial.print(sampleLog.dropped());
+  Serial.print(", written ");
+  Serial.print((uint32_t)(sampleLogWriter->bytesWritten() / 1024));
+  Serial.print(" KB, pending buffers ");
+  Serial.print(sampleLog.pendingBuffers());
+  Serial.print(", files removed ");
+  Serial.print(sampleLogWriter->filesRemoved());
+  Serial.print(", errors ");
+  Serial.print(sampleLogWriter->errors());
+  Serial.print(", max write ");
+  Serial.print(sampleLogMaxWriteMs);
+  Serial.println(" ms");
+}
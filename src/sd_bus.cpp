@@ -0,0 +1,14 @@
+#include "sd_bus.h"
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// 静的に確保する（書き込みタスクの起動前、setup() より先に使える状態にしておく）
+static StaticSemaphore_t sdBusMutexBuffer;
+static SemaphoreHandle_t sdBusMutex = xSemaphoreCreateMutexStatic(&sdBusMutexBuffer);
+
+void sdBusLock() { xSemaphoreTake(sdBusMutex, portMAX_DELAY); }
+
+void sdBusUnlock() { xSemaphoreGive(sdBusMutex); }
+
+bool sdBusTryLock() { return xSemaphoreTake(sdBusMutex, 0) == pdTRUE; }
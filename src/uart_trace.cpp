@@ -0,0 +1,117 @@
+#include "uart_trace.h"
+#include "mem_telemetry.h"
+#include "sd_bus.h"
+#include <Arduino.h>
+#include <SD.h>
+#include <SPI.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Core2 の microSD スロット（LCD と同じ SPI バス。書き込み中の描画は include/sd_bus.h で避ける）
+#define SD_CS_PIN 4
+#define SD_SPI_FREQ 25000000
+
+#define UART_TRACE_BUFFER_SIZE 32768           // SD の書き込みが詰まっている間に溜められる量
+#define UART_TRACE_BLOCK_SIZE 512              // 書き込み単位（セクタ）
+#define UART_TRACE_FLUSH_MS 1000               // 1セクタに満たなくても書き出す間隔
+#define UART_TRACE_SYNC_MS 10000               // ファイルを同期する（電源断で失う範囲）間隔
+#define UART_TRACE_MAX_FILE_BYTES (64UL << 20) // これを超えたら記録をやめる
+#define UART_TRACE_DIR "/trace"
+
+static uint8_t uartTraceBuffer[UART_TRACE_BUFFER_SIZE];
+UartTraceRecorder uartTrace(uartTraceBuffer, sizeof(uartTraceBuffer));
+
+static File uartTraceFile;
+static char uartTracePath[24];
+static volatile uint32_t uartTraceWritten = 0;  // ファイルに書き込んだバイト数
+static volatile uint32_t uartTraceDiscarded = 0; // 上限を超えて捨てたバイト数
+static volatile uint32_t uartTraceMaxWriteMs = 0;
+
+// リングから取り出して SD に書き込むタスク
+// 1セクタ溜まるごと、または一定時間ごとに書き込み、loop() 側は SD の待ちに関わらない
+static void uartTraceTask(void *) {
+  static uint8_t block[UART_TRACE_BLOCK_SIZE];
+  uint32_t lastWriteMs = millis();
+  uint32_t lastSyncMs = millis();
+  for (;;) {
+    uint32_t now = millis();
+    size_t pending = uartTrace.pending();
+    if (pending < sizeof(block) && (pending == 0 || now - lastWriteMs < UART_TRACE_FLUSH_MS)) {
+      vTaskDelay(pdMS_TO_TICKS(50));
+      continue;
+    }
+    size_t n = uartTrace.read(block, sizeof(block));
+    if (uartTraceWritten + n > UART_TRACE_MAX_FILE_BYTES) {
+      uartTraceDiscarded += n;
+      continue;
+    }
+    sdBusLock();
+    uint32_t start = millis();
+    uartTraceFile.write(block, n);
+    if (now - lastSyncMs >= UART_TRACE_SYNC_MS) {
+      uartTraceFile.flush();
+      lastSyncMs = now;
+    }
+    uint32_t took = millis() - start;
+    sdBusUnlock();
+    if (took > uartTraceMaxWriteMs) {
+      uartTraceMaxWriteMs = took;
+    }
+    uartTraceWritten += n;
+    lastWriteMs = now;
+  }
+}
+
+bool uartTraceBegin(uint32_t unixSec) {
+  if (!SD.begin(SD_CS_PIN, SPI, SD_SPI_FREQ)) {
+    Serial.println("[TRACE] SD card not found, UART trace disabled");
+    return false;
+  }
+  if (!SD.exists(UART_TRACE_DIR)) {
+    SD.mkdir(UART_TRACE_DIR);
+  }
+  // 起動ごとに新しいファイルに記録する
+  for (int i = 0; i < 10000; i++) {
+    snprintf(uartTracePath, sizeof(uartTracePath), UART_TRACE_DIR "/UT%04d.BIN", i);
+    if (!SD.exists(uartTracePath)) {
+      break;
+    }
+  }
+  uartTraceFile = SD.open(uartTracePath, FILE_WRITE);
+  if (!uartTraceFile) {
+    Serial.print("[TRACE] Cannot create ");
+    Serial.println(uartTracePath);
+    return false;
+  }
+
+  uartTrace.begin(millis(), unixSec);
+  TaskHandle_t task = nullptr;
+  // loop() は core 1 で動くため、書き込みは core 0 の低い優先度で行う
+  xTaskCreatePinnedToCore(uartTraceTask, "uartTrace", 3072, nullptr, 1, &task, 0);
+  memRegisterTask("uartTrace", task);
+
+  Serial.print("[TRACE] Recording UART trace to ");
+  Serial.println(uartTracePath);
+  return true;
+}
+
+void uartTraceLogStats() {
+  if (!uartTrace.active()) {
+    return;
+  }
+  Serial.print("[TRACE] ");
+  Serial.print(uartTracePath);
+  Serial.print(": recorded ");
+  Serial.print(uartTrace.recordedBytes());
+  Serial.print(" bytes, written ");
+  Serial.print(uartTraceWritten);
+  Serial.print(", pending ");
+  Serial.print(uartTrace.pending());
+  Serial.print(", lost ");
+  Serial.print(uartTrace.lostBytes());
+  Serial.print(", discarded ");
+  Serial.print(uartTraceDiscarded);
+  Serial.print(", max write ");
+  Serial.print(uartTraceMaxWriteMs);
+  Serial.println(" ms");
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+// ES920LR3（オペレーションモード）のホスト用エミュレータ
+//
+// ファームウェアから UART に書き込まれたバイト列を受け取り、モジュールと同様に
+// 送信フォーマットに従って1つの送信要求を切り出し、"OK" / "NG 102" などの応答行を返す。
+//   - バイナリ（format 2）: 先頭1バイトの長さぶんのペイロード（終端文字なし）
+//   - ASCII（format 1）: CR+LF までの文字列。モジュールは文字をそのまま送信するため、
+//     16進表記で送ったペイロードはエアー上でも16進表記の文字列（2倍の長さ）になる
+// バイナリではフレームの区切りを長さバイトだけで決めるため、UART でバイトが欠けると
+// 次のフレームの先頭を続きとして取り込み、以降の区切りがずれる（dropBytePermille で再現できる）。
+// ずれはリセット（reset()。実機では setup() の NRST）まで直らない。
+// 応答は仮想時刻で遅延させて出力キューに積むため、実時間より速く長時間の動作を再現できる。
+// NG 102 の連続（送信待ちの嵐）、応答なし、遅延した "OK"、モジュールの再起動を
+// 設定した頻度で発生させる。NG 102 はモジュールが送信できない状態を表すため、嵐は回数ではなく
+// 時間で終わる（その間の送信要求はすべて NG 102。再送を速めても嵐は短くならない）。
+//
+// ネットワークサーバーの役も兼ね、"OK" を返した送信要求のうち時刻要求（BATCH_FLAG_TIME_REQ）の
+// バッチには時刻ダウンリンク、確認応答要求（EVENT_FLAG_ACK_REQ）のイベントには確認応答ダウンリンクを
+// 受信窓の時刻に返す（一定の確率で届かない）。時刻は "OK" を出力した時刻の UNIX時刻
+// （unixEpochMs + 仮想時刻）で、ファームウェアが同期点とする時刻と一致する。ダウンリンクの行の形式は
+// 実機の出力に合わせていないため、16進数以外の語や1バイトの数値を含めてペイロードの取り出しを確かめる。
+// サーバーが受け取った（"OK" を返した）フレームの seq を数え、欠番を seqGaps() で返す。
+//
+// ヒープを使わない固定長のバッファのみで実装している（ソークベンチマークでの計測対象外にするため）。
+
+#include "sample_batch.h"
+#include "sensor_data.h"
+#include "timebase.h"
+#include "uplink_queue.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+class Es920Emulator {
+public:
+  struct Config {
+    uint32_t okLatencyMs = 80;       // 送信要求から "OK" までの標準的な時間
+    uint32_t latencyJitterMs = 40;   // 上記の揺らぎ
+    uint32_t lateOkPermille = 5;     // "OK" が大きく遅れる確率（‰）
+    uint32_t lateOkMs = 8000;        // 遅れた場合の応答時間
+    uint32_t silentPermille = 5;     // 応答しない確率（‰）
+    uint32_t stormEvery = 5000;      // 何回の送信要求ごとに NG 102 の嵐を起こすか（0で無効）
+    uint32_t stormMs = 300000;       // 嵐の継続時間（この間の送信要求にはすべて NG 102 を返す）
+    uint32_t rebootEvery = 50000;    // 何回の送信要求ごとに再起動するか（0で無効）
+    uint32_t maxPayload = 242;       // 受け付ける最大ペイロード長（超えたら NG）
+    bool binaryFormat = true;        // 送信フォーマット（false で ASCII の16進文字列）
+    uint32_t dropBytePermille = 0;   // ファームウェアからのバイトが UART で欠ける確率（‰）
+    bool downlinks = true;           // 時刻要求・確認応答要求にダウンリンクを返す
+    uint32_t downlinkDelayMs = 1000; // "OK" からダウンリンク（受信窓 RX1）までの時間
+    uint32_t downlinkLossPermille = 20; // ダウンリンクが届かない確率（‰）
+    uint64_t unixEpochMs = 1700000000000ULL; // 仮想時刻 0 の UNIX時刻
+  };
+
+  explicit Es920Emulator(const Config &cfg, uint32_t seed = 1) : cfg_(cfg), rng_(seed) {}
+
+  // モジュールの再起動後、ファームウェアが再初期化した状態に戻す
+  void reset() {
+    rxLen_ = 0;
+    payloadLen_ = 0;
+    head_ = tail_ = 0;
+    stormUntilMs_ = 0;
+    inStorm_ = false;
+    rebooted_ = false;
+  }
+
+  // ファームウェア → モジュール（UART TX）
+  void write(const uint8_t *data, size_t len, uint32_t nowMs) {
+    for (size_t i = 0; i < len; i++) {
+      if (rebooted_) {
+        continue; // 再起動後はモード選択待ちで送信要求を受け付けない
+      }
+      uint8_t c = data[i];
+      if (cfg_.dropBytePermille > 0 && next() % 1000 < cfg_.dropBytePermille) {
+        droppedBytes_++;
+        continue;
+      }
+      if (rxLen_ < sizeof(rx_)) {
+        rx_[rxLen_++] = c;
+      }
+      if (cfg_.binaryFormat) {
+        // 長さバイト + ペイロードがそろった時点で1つの送信要求
+        if (rxLen_ == (size_t)rx_[0] + 1) {
+          payloadLen_ = rx_[0];
+          memcpy(payload_, rx_ + 1, payloadLen_);
+          onRequest(payloadLen_, nowMs);
+          rxLen_ = 0;
+        }
+      } else if (rxLen_ >= 2 && rx_[rxLen_ - 2] == '\r' && rx_[rxLen_ - 1] == '\n') {
+        payloadLen_ = rxLen_ - 2;
+        memcpy(payload_, rx_, payloadLen_);
+        onRequest(payloadLen_, nowMs);
+        rxLen_ = 0;
+      }
+    }
+  }
+
+  // 最後に受け付けた送信要求のペイロード（エアー上で送られるバイト列）
+  const uint8_t *lastPayload() const { return payload_; }
+  size_t lastPayloadLen() const { return payloadLen_; }
+
+  // モジュール → ファームウェア（UART RX）。nowMs までに出力された次の1バイト、なければ -1
+  int read(uint32_t nowMs) {
+    while (head_ != tail_) {
+      Pending &p = queue_[head_];
+      if ((int32_t)(nowMs - p.dueMs) < 0) {
+        return -1;
+      }
+      if (p.pos < p.len) {
+        return (uint8_t)p.text[p.pos++];
+      }
+      head_ = (head_ + 1) % kQueueSize;
+    }
+    return -1;
+  }
+
+  // 次に出力が始まる時刻（出力待ちがなければ false）
+  bool nextOutputMs(uint32_t &dueMs) const {
+    if (head_ == tail_) {
+      return false;
+    }
+    dueMs = queue_[head_].dueMs;
+    return true;
+  }
+
+  uint32_t requests() const { return requests_; }
+  uint32_t reboots() const { return reboots_; }
+  uint32_t ngBusy() const { return ngBusy_; }
+  uint32_t ngOther() const { return ngOther_; }
+  uint32_t silent() const { return silent_; }
+  const Config &config() const { return cfg_; }
+  uint32_t droppedBytes() const { return droppedBytes_; }
+  uint32_t timeDownlinks() const { return timeDownlinks_; }
+  uint32_t ackDownlinks() const { return ackDownlinks_; }
+  uint32_t lostDownlinks() const { return lostDownlinks_; }
+  uint32_t seqGaps() const { return seqGaps_; }
+
+private:
+  static const int kQueueSize = 16;
+
+  struct Pending {
+    uint32_t dueMs;
+    char text[64];
+    uint8_t len;
+    uint8_t pos;
+  };
+
+  void onRequest(size_t len, uint32_t nowMs) {
+    requests_++;
+
+    if (cfg_.rebootEvery > 0 && requests_ % cfg_.rebootEvery == 0) {
+      reboots_++;
+      rebooted_ = true;
+      push(nowMs + 300, "Select Mode [1.terminal or 2.processor]");
+      return;
+    }
+    if (cfg_.stormEvery > 0 && requests_ % cfg_.stormEvery == 0) {
+      stormUntilMs_ = nowMs + cfg_.stormMs;
+      inStorm_ = true;
+    }
+    uint32_t latency = cfg_.okLatencyMs + next() % (cfg_.latencyJitterMs + 1);
+    if (inStorm_ && (int32_t)(nowMs - stormUntilMs_) >= 0) {
+      inStorm_ = false;
+    }
+    if (inStorm_) {
+      ngBusy_++;
+      push(nowMs + latency, "NG 102\r\n");
+      return;
+    }
+    if (len == 0 || len > cfg_.maxPayload) {
+      ngOther_++;
+      push(nowMs + latency, "NG 100\r\n");
+      return;
+    }
+    uint32_t r = next() % 1000;
+    if (r < cfg_.silentPermille) {
+      silent_++;
+      return;
+    }
+    if (r < cfg_.silentPermille + cfg_.lateOkPermille) {
+      latency = cfg_.lateOkMs;
+    }
+    uint32_t okMs;
+    if (push(nowMs + latency, "OK\r\n", &okMs)) {
+      onAccepted(len, nowMs, okMs);
+    }
+  }
+
+  // "OK" を返した送信要求をサーバーが受け取った。サーバーのデコーダと同じく種別ごとの長さがそろった
+  // フレームだけを受け付け、seq の欠番を数え、要求があればダウンリンクを返す
+  void onAccepted(size_t len, uint32_t nowMs, uint32_t okMs) {
+    uint8_t p[sizeof(payload_)];
+    if (!cfg_.binaryFormat) {
+      if (len % 2 != 0) {
+        return;
+      }
+      len /= 2;
+    }
+    for (size_t i = 0; i < len; i++) {
+      p[i] = cfg_.binaryFormat ? payload_[i] : (uint8_t)(unhex(payload_[2 * i]) << 4 | unhex(payload_[2 * i + 1]));
+    }
+    if (!decodable(p, len)) {
+      return;
+    }
+    uint8_t type = p[0] & FRAME_TYPE_MASK;
+    uint8_t seq = p[1];
+    if (seenSeq_) {
+      uint8_t gap = (uint8_t)(seq - lastSeq_ - 1);
+      if (gap < 128) {
+        seqGaps_ += gap;
+      }
+    }
+    seenSeq_ = true;
+    lastSeq_ = seq;
+
+    bool timeReq = type == FRAME_TYPE_BATCH && (p[2] & BATCH_FLAG_TIME_REQ);
+    bool ackReq = type == FRAME_TYPE_EVENT && (p[3] & EVENT_FLAG_ACK_REQ);
+    if (!cfg_.downlinks || !(timeReq || ackReq)) {
+      return;
+    }
+    if (next() % 1000 < cfg_.downlinkLossPermille) {
+      lostDownlinks_++;
+      return;
+    }
+    char text[64];
+    int n = snprintf(text, sizeof(text), "RX port:1 rssi:-48 data:");
+    if (timeReq) {
+      uint64_t unixMs = cfg_.unixEpochMs + clockMs(nowMs) + (uint32_t)(okMs - nowMs);
+      uint8_t dl[TIME_DOWNLINK_SIZE] = {TIME_DOWNLINK_TYPE, seq};
+      for (int i = 0; i < 6; i++) {
+        dl[2 + i] = (uint8_t)(unixMs >> (8 * i));
+      }
+      for (size_t i = 0; i < sizeof(dl); i++) {
+        n += snprintf(text + n, sizeof(text) - n, "%02X", dl[i]);
+      }
+      timeDownlinks_++;
+    } else {
+      n += snprintf(text + n, sizeof(text) - n, "%02X%02X", EVENT_ACK_DOWNLINK_TYPE, seq);
+      ackDownlinks_++;
+    }
+    snprintf(text + n, sizeof(text) - n, "\r\n");
+    push(okMs + cfg_.downlinkDelayMs, text);
+  }
+
+  // uplink_decoder が行を取り出せる長さか（センサーフレームは seq を持たないので対象外）
+  static bool decodable(const uint8_t *p, size_t len) {
+    if (len == 0) {
+      return false;
+    }
+    switch (p[0] & FRAME_TYPE_MASK) {
+      case FRAME_TYPE_EVENT:
+        return len == sizeof(EventData);
+      case FRAME_TYPE_DIAG:
+        return len == sizeof(DiagData);
+      case FRAME_TYPE_BATCH: {
+        BatchReader reader;
+        BatchSample s;
+        uint64_t t;
+        if (!reader.begin(p, len)) {
+          return false;
+        }
+        while (reader.next(s, t)) {
+        }
+        return !reader.truncated();
+      }
+      default:
+        return false;
+    }
+  }
+
+  // 49.7日で一周する仮想時刻を64ビットに延ばす（呼び出しは時刻順）
+  uint64_t clockMs(uint32_t nowMs) {
+    clock64_ += (uint32_t)(nowMs - clockLast_);
+    clockLast_ = nowMs;
+    return clock64_;
+  }
+
+  static uint8_t unhex(uint8_t c) { return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10; }
+
+  // 出力キューに積む。積めたら true を返し、出力する時刻を dueOut に返す
+  bool push(uint32_t dueMs, const char *text, uint32_t *dueOut = nullptr) {
+    uint8_t nextTail = (tail_ + 1) % kQueueSize;
+    if (nextTail == head_) {
+      return false; // 出力キューが満杯（実機のUARTバッファあふれに相当）
+    }
+    // 出力は先着順（前の応答より早く出力されることはない）
+    if (head_ != tail_) {
+      uint32_t lastDue = queue_[(tail_ + kQueueSize - 1) % kQueueSize].dueMs;
+      if ((int32_t)(dueMs - lastDue) < 0) {
+        dueMs = lastDue;
+      }
+    }
+    Pending &p = queue_[tail_];
+    p.dueMs = dueMs;
+    p.len = (uint8_t)strlen(text);
+    memcpy(p.text, text, p.len);
+    p.pos = 0;
+    tail_ = nextTail;
+    if (dueOut != nullptr) {
+      *dueOut = dueMs;
+    }
+    return true;
+  }
+
+  uint32_t next() {
+    rng_ ^= rng_ << 13;
+    rng_ ^= rng_ >> 17;
+    rng_ ^= rng_ << 5;
+    return rng_;
+  }
+
+  Config cfg_;
+  uint32_t rng_;
+  uint8_t rx_[512];
+  size_t rxLen_ = 0;
+  uint8_t payload_[sizeof(rx_)];
+  size_t payloadLen_ = 0;
+  Pending queue_[kQueueSize];
+  int head_ = 0;
+  int tail_ = 0;
+  uint32_t stormUntilMs_ = 0;
+  bool inStorm_ = false;
+  bool rebooted_ = false;
+  uint32_t requests_ = 0;
+  uint32_t reboots_ = 0;
+  uint32_t ngBusy_ = 0;
+  uint32_t ngOther_ = 0;
+  uint32_t silent_ = 0;
+  uint32_t droppedBytes_ = 0;
+  uint64_t clock64_ = 0;
+  uint32_t clockLast_ = 0;
+  bool seenSeq_ = false;
+  uint8_t lastSeq_ = 0;
+  uint32_t seqGaps_ = 0;
+  uint32_t timeDownlinks_ = 0;
+  uint32_t ackDownlinks_ = 0;
+  uint32_t lostDownlinks_ = 0;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+// サンプルの記録（include/sample_log.h）のホスト用ストレージ
+//
+// ディレクトリ内の通常のファイルに書き込む。SD カードの書き込みが詰まる状況を再現するため、
+// 一定回数の書き込みごとに指定した時間だけ待たせることができる。
+
+#include "sample_log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <dirent.h>
+#include <thread>
+
+class FileLogStorage : public LogStorage {
+public:
+  struct Config {
+    uint32_t stallEvery = 0; // 何回の書き込みごとに待たせるか（0で無効）
+    uint32_t stallMs = 0;    // 待たせる時間
+  };
+
+  FileLogStorage() {}
+  explicit FileLogStorage(const Config &cfg) : cfg_(cfg) {}
+  ~FileLogStorage() override { close(); }
+
+  bool open(const char *path) override {
+    close();
+    file_ = fopen(path, "wb");
+    return file_ != nullptr;
+  }
+
+  bool write(const uint8_t *p, size_t len) override {
+    if (file_ == nullptr) {
+      return false;
+    }
+    writes_++;
+    if (cfg_.stallEvery > 0 && writes_ % cfg_.stallEvery == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(cfg_.stallMs));
+      stalls_++;
+    }
+    return fwrite(p, 1, len, file_) == len;
+  }
+
+  bool seekBack(size_t len) override { return file_ != nullptr && fseek(file_, -(long)len, SEEK_CUR) == 0; }
+
+  bool sync() override { return file_ != nullptr && fflush(file_) == 0; }
+
+  void close() override {
+    if (file_ != nullptr) {
+      fclose(file_);
+      file_ = nullptr;
+    }
+  }
+
+  bool remove(const char *path) override { return ::remove(path) == 0; }
+
+  bool rename(const char *from, const char *to) override { return ::rename(from, to) == 0; }
+
+  bool listDir(const char *dir, void (*fn)(const char *name, void *ctx), void *ctx) override {
+    DIR *d = opendir(dir);
+    if (d == nullptr) {
+      return false;
+    }
+    while (struct dirent *e = readdir(d)) {
+      fn(e->d_name, ctx);
+    }
+    closedir(d);
+    return true;
+  }
+
+  bool writeFile(const char *path, const uint8_t *p, size_t len) override {
+    FILE *f = fopen(path, "wb");
+    if (f == nullptr) {
+      return false;
+    }
+    bool ok = fwrite(p, 1, len, f) == len;
+    return fclose(f) == 0 && ok;
+  }
+
+  bool readFile(const char *path, uint8_t *p, size_t maxLen, size_t &len) override {
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) {
+      return false;
+    }
+    len = fread(p, 1, maxLen, f);
+    fclose(f);
+    return true;
+  }
+
+  uint32_t writes() const { return writes_; }
+  uint32_t stalls() const { return stalls_; }
+
+private:
+  Config cfg_;
+  FILE *file_ = nullptr;
+  uint32_t writes_ = 0;
+  uint32_t stalls_ = 0;
+};
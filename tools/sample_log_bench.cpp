@@ -0,0 +1,538 @@
+// サンプルの記録（include/sample_log.h）のベンチマーク（ホスト用）
+//
+// ファームウェアと同じ SampleLogBuffer / SampleLogWriter を通常のファイル（tools/file_log_storage.h）に
+// つなぎ、書き込み側（loop() に相当）と書き出しスレッド（SD 書き込みタスクに相当）で動かす。
+//   - --rate 0（既定）: 空きバッファを待ちながら全速で追加し、持続できるサンプル数/秒を測る。
+//     書き出しスレッドは書き出し待ちがなければ --idle-ms 待つため（ファームウェアと同じ 20ms）、
+//     上限はおおむね バッファ数 × バッファのサンプル数 / idle-ms になる。--idle-ms 1 でストレージ側の上限を測る
+//   - --rate HZ: 実時間で HZ サンプル/秒を追加し、append() の最大時間と捨てたサンプル数を測る。
+//     --stall-every / --stall-ms で書き込みを詰まらせても append() が待たないことを確認する。
+//     --display-ms MS で、LCD の描画（SD と同じ SPI バスを MS だけ使う）を DISPLAY_PERIOD_MS ごとに
+//     ファームウェアの serviceDisplay() と同じ条件（書き出し待ち・書き込み中は次に回す）で挟み、
+//     1回の loop() の最大時間が描画時間 + LOOP_SLACK_MS に収まることを確認する（超えたら終了コード1）。
+//     --display-ungated は書き込みを待って描く（調停しない場合の比較用）
+//   - --virtual: --rate HZ（既定1）の仮想時刻で追加し、書き出し待ちのバッファをその場で書き込む。
+//     10秒ごとの書き出しで書きかけのブロックを上書きし、ファイル上の1サンプルあたりのバイト数が
+//     ブロックを使い切った場合（512 / 54 = 9.48）とほぼ同じになることを確認する（1%を超えたら終了コード1）。
+//     最後に end() を呼ばずに（電源断に相当）ディスク上の索引を読み、最後のサンプルから書き出し間隔
+//     （FLUSH_MS）以内まで記録されていることも確認する
+// 終了後に索引とすべてのファイルを読み直し、ブロックの CRC・通し番号・サンプルの値と時刻を検証して、
+// 索引による時刻範囲の検索が範囲内のサンプルをすべて返すことを確認する（不一致があれば終了コード1）。
+// 続けて索引ファイルを消して書き込みを再開し、ファイル名から索引を作り直して既存のファイルを
+// 上書きしない番号から続けることを確認する。
+//
+// ビルド:
+//   g++ -O2 -std=c++17 -Iinclude -Itools tools/sample_log_bench.cpp -o sample_log_bench -lpthread
+//
+// 使い方:
+//   sample_log_bench [--samples N] [--rate HZ] [--virtual] [--dir PATH] [--buffers N] [--blocks N] [--file-kb N]
+//                    [--max-files N] [--idle-ms MS] [--stall-every WRITES] [--stall-ms MS]
+//                    [--display-ms MS] [--display-ungated]
+
+#include "sample_log.h"
+
+#include "file_log_storage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+#define BASE_UNIX_MS 1760000000000ULL
+#define FLUSH_MS 10000 // ファームウェアの SAMPLE_LOG_FLUSH_MS
+#define MAX_BYTES_PER_SAMPLE_OVERHEAD 0.01 // --virtual: ブロックを使い切った場合に対して許す増加
+#define DISPLAY_PERIOD_MS 100 // --display-ms: 再描画の間隔（ファームウェアより詰めて書き込みと重ねる）
+#define LOOP_SLACK_MS 50      // --display-ms: 描画時間に加えて許す分（1コアのホストでは書き出しスレッドに割り込まれる）
+
+struct Options {
+  uint64_t samples = 2000000;
+  uint32_t rateHz = 0;
+  bool virtualClock = false;
+  const char *dir = "/tmp/sample_log_bench";
+  uint32_t buffers = 2;
+  uint32_t blocks = 16;
+  uint32_t fileKb = 1024;
+  uint32_t maxFiles = SAMPLE_LOG_INDEX_FILES;
+  uint32_t idleMs = 20; // 書き出し待ちがないときの待ち時間（ファームウェアのタスクと同じ）
+  uint32_t displayMs = 0;
+  bool displayUngated = false;
+  FileLogStorage::Config storage;
+};
+
+// 仮想時刻のサンプル i（1kHz 以下の周期。最初の 1/10 は時刻未同期）
+static uint32_t gPeriodMs = 1;
+static uint64_t gSyncAt = 0;
+
+static BatchSample makeSample(uint64_t i) {
+  BatchSample s;
+  s.windDirection = (uint16_t)(i % 360);
+  s.airSpeed100 = (uint16_t)(i * 7 % 5000);
+  s.virtualTemp100 = (uint16_t)(i * 13 % 5000);
+  s.rssiAbs = (uint8_t)(i % 100);
+  return s;
+}
+
+static uint32_t localMsOf(uint64_t i) { return (uint32_t)(i * gPeriodMs); }
+static uint64_t unixMsOf(uint64_t i) { return i < gSyncAt ? 0 : BASE_UNIX_MS + (uint64_t)localMsOf(i); }
+
+static bool readWhole(const char *path, std::vector<uint8_t> &out) {
+  FILE *f = fopen(path, "rb");
+  if (f == nullptr) {
+    return false;
+  }
+  out.clear();
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.insert(out.end(), buf, buf + n);
+  }
+  fclose(f);
+  return true;
+}
+
+struct VerifyStats {
+  uint64_t files = 0;
+  uint64_t blocks = 0;
+  uint64_t samples = 0;
+  uint64_t droppedInHeaders = 0;
+  uint64_t errors = 0;
+  uint64_t firstIndex = 0;
+  uint64_t lastIndex = 0;
+};
+
+static void fail(VerifyStats &st, const char *what, uint32_t fileNo, size_t block) {
+  if (st.errors < 10) {
+    printf("[LOG] FAIL: %s (file %u block %zu)\n", what, fileNo, block);
+  }
+  st.errors++;
+}
+
+// 索引に載っているファイルをすべて読み直して検証する
+static void verifyAll(const Options &opt, const SampleLogIndex &index, VerifyStats &st) {
+  std::vector<uint8_t> data;
+  char path[256];
+  bool first = true;
+  uint32_t expectSeq = 0;
+  uint64_t expectIndex = 0;
+  for (size_t f = 0; f < index.size(); f++) {
+    const SampleLogIndex::Entry &e = index.at(f);
+    SampleLogWriter::filePath(opt.dir, e.fileNo, path, sizeof(path));
+    if (!readWhole(path, data)) {
+      fail(st, "missing file", e.fileNo, 0);
+      continue;
+    }
+    st.files++;
+    size_t blocks = data.size() / SAMPLE_LOG_BLOCK_SIZE;
+    if (data.size() % SAMPLE_LOG_BLOCK_SIZE != 0 || blocks != e.blocks) {
+      fail(st, "file size does not match index", e.fileNo, blocks);
+    }
+    for (size_t b = 0; b < blocks; b++) {
+      SampleLogBlockReader reader;
+      if (!reader.begin(data.data() + b * SAMPLE_LOG_BLOCK_SIZE)) {
+        fail(st, "bad block", e.fileNo, b);
+        continue;
+      }
+      const SampleLogBlockHeader &h = reader.header();
+      st.blocks++;
+      st.droppedInHeaders += h.dropped;
+      if (!first && h.seq != expectSeq) {
+        fail(st, "block sequence gap", e.fileNo, b);
+      }
+      expectSeq = h.seq + 1;
+      uint32_t localMs;
+      uint64_t unixMs;
+      BatchSample s;
+      bool firstInBlock = true;
+      while (reader.next(localMs, unixMs, s)) {
+        uint64_t i = localMs / gPeriodMs;
+        if (first) {
+          st.firstIndex = i;
+          first = false;
+        } else if (i != expectIndex + (firstInBlock ? h.dropped : 0)) {
+          fail(st, "sample index mismatch", e.fileNo, b);
+        }
+        firstInBlock = false;
+        expectIndex = i + 1;
+        BatchSample want = makeSample(i);
+        if (localMs != localMsOf(i) || unixMs != unixMsOf(i) || memcmp(&s, &want, sizeof(s)) != 0) {
+          fail(st, "sample value mismatch", e.fileNo, b);
+        }
+        st.samples++;
+        st.lastIndex = i;
+      }
+    }
+    if (blocks > 0 && e.lastLocalMs != localMsOf(st.lastIndex)) {
+      fail(st, "index time range mismatch", e.fileNo, blocks);
+    }
+  }
+}
+
+// 索引と二分探索で UNIX時刻 [fromMs, toMs] のサンプルを数える。読んだブロック数を blocksRead に返す
+static uint64_t countRange(const Options &opt, const SampleLogIndex &index, uint64_t fromMs, uint64_t toMs,
+                           uint64_t &blocksRead) {
+  uint32_t files[SAMPLE_LOG_INDEX_FILES];
+  size_t n = index.find(fromMs, toMs, files, SAMPLE_LOG_INDEX_FILES);
+  std::vector<uint8_t> data;
+  char path[256];
+  uint64_t count = 0;
+  blocksRead = 0;
+  for (size_t f = 0; f < n; f++) {
+    SampleLogWriter::filePath(opt.dir, files[f], path, sizeof(path));
+    if (!readWhole(path, data)) {
+      continue;
+    }
+    size_t blocks = data.size() / SAMPLE_LOG_BLOCK_SIZE;
+    for (size_t b = sampleLogSeek(data.data(), blocks, fromMs); b < blocks; b++) {
+      SampleLogBlockReader reader;
+      if (!reader.begin(data.data() + b * SAMPLE_LOG_BLOCK_SIZE)) {
+        continue;
+      }
+      blocksRead++;
+      if (reader.header().firstUnixMs > toMs) {
+        break;
+      }
+      uint32_t localMs;
+      uint64_t unixMs;
+      BatchSample s;
+      while (reader.next(localMs, unixMs, s)) {
+        count += unixMs != 0 && unixMs >= fromMs && unixMs <= toMs ? 1 : 0;
+      }
+    }
+  }
+  return count;
+}
+
+// 電源断に相当: end() を呼ばずにディスク上の索引だけを読み、最後のファイルの記録がどこまで
+// 確定しているかを確かめる。書き出し間隔を超えて遅れていれば失敗
+static void checkPowerCut(const Options &opt, FileLogStorage &storage, uint64_t lastSample, VerifyStats &st) {
+  static uint8_t buf[SampleLogIndex::kMaxBytes];
+  static SampleLogIndex index;
+  char path[256];
+  size_t len;
+  SampleLogWriter::indexPath(opt.dir, path, sizeof(path));
+  if (!storage.readFile(path, buf, sizeof(buf), len) || !index.decode(buf, len) || index.size() == 0) {
+    fail(st, "no index on disk before end()", 0, 0);
+    return;
+  }
+  const SampleLogIndex::Entry &e = index.at(index.size() - 1);
+  std::vector<uint8_t> data;
+  SampleLogWriter::filePath(opt.dir, e.fileNo, path, sizeof(path));
+  if (!readWhole(path, data) || data.size() < (size_t)e.blocks * SAMPLE_LOG_BLOCK_SIZE) {
+    fail(st, "file shorter than the index before end()", e.fileNo, e.blocks);
+    return;
+  }
+  uint32_t behindMs = localMsOf(lastSample) - e.lastLocalMs;
+  uint64_t unixBehindMs = unixMsOf(lastSample) - e.lastUnixMs;
+  printf("[LOG] power cut: index on disk %u ms behind the last sample (unix %llu ms), limit %u ms\n", behindMs,
+         (unsigned long long)unixBehindMs, FLUSH_MS);
+  if (behindMs > FLUSH_MS || unixBehindMs > FLUSH_MS) {
+    fail(st, "index on disk stale by more than the flush interval", e.fileNo, e.blocks);
+  }
+}
+
+// 索引ファイルを失った状態から書き込みを再開する。ファイル名から索引を作り直し、既存の最大の番号の
+// 次から書くこと（上書きしないこと）を確かめる
+static void checkIndexLoss(const Options &opt, const SampleLogIndex &before, VerifyStats &st) {
+  char path[256];
+  SampleLogWriter::indexPath(opt.dir, path, sizeof(path));
+  remove(path);
+  FileLogStorage storage;
+  SampleLogWriter::Config cfg;
+  cfg.dir = opt.dir;
+  cfg.maxFiles = opt.maxFiles;
+  SampleLogWriter writer(storage, cfg);
+  uint32_t lastFileNo = before.at(before.size() - 1).fileNo;
+  bool ok = writer.begin();
+  writer.end();
+  const SampleLogIndex &after = writer.index();
+  printf("[LOG] index loss: rebuilt=%s, %zu files listed, resumed at file %u (last was %u)\n",
+         writer.indexRebuilt() ? "yes" : "no", after.size(), writer.currentFileNo(), lastFileNo);
+  if (!ok || !writer.indexRebuilt() || writer.currentFileNo() != lastFileNo + 1 ||
+      after.size() != std::min<size_t>(before.size() + 1, opt.maxFiles)) {
+    fail(st, "index not rebuilt from file names", writer.currentFileNo(), after.size());
+  }
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: sample_log_bench [--samples N] [--rate HZ] [--virtual] [--dir PATH] [--buffers N] [--blocks N]\n"
+          "                        [--file-kb N]"
+          " [--max-files N] [--idle-ms MS] [--stall-every WRITES] [--stall-ms MS]\n"
+          "                        [--display-ms MS] [--display-ungated]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  Options opt;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--virtual") == 0) {
+      opt.virtualClock = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--display-ungated") == 0) {
+      opt.displayUngated = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+    }
+    const char *a = argv[i];
+    if (strcmp(a, "--dir") == 0) {
+      opt.dir = argv[++i];
+      continue;
+    }
+    unsigned long long v = strtoull(argv[++i], nullptr, 10);
+    if (strcmp(a, "--samples") == 0) {
+      opt.samples = v;
+    } else if (strcmp(a, "--rate") == 0) {
+      opt.rateHz = (uint32_t)v;
+    } else if (strcmp(a, "--buffers") == 0) {
+      opt.buffers = (uint32_t)std::min<unsigned long long>(std::max<unsigned long long>(v, 2), SAMPLE_LOG_MAX_BUFFERS);
+    } else if (strcmp(a, "--blocks") == 0) {
+      opt.blocks = (uint32_t)std::max<unsigned long long>(v, 1);
+    } else if (strcmp(a, "--file-kb") == 0) {
+      opt.fileKb = (uint32_t)v;
+    } else if (strcmp(a, "--max-files") == 0) {
+      opt.maxFiles = (uint32_t)v;
+    } else if (strcmp(a, "--idle-ms") == 0) {
+      opt.idleMs = (uint32_t)v;
+    } else if (strcmp(a, "--stall-every") == 0) {
+      opt.storage.stallEvery = (uint32_t)v;
+    } else if (strcmp(a, "--stall-ms") == 0) {
+      opt.storage.stallMs = (uint32_t)v;
+    } else if (strcmp(a, "--display-ms") == 0) {
+      opt.displayMs = (uint32_t)v;
+    } else {
+      usage();
+    }
+  }
+  if (opt.virtualClock && opt.rateHz == 0) {
+    opt.rateHz = 1;
+  }
+  gPeriodMs = opt.rateHz > 0 && opt.rateHz < 1000 ? 1000 / opt.rateHz : 1;
+  gSyncAt = opt.samples / 10;
+
+  // 前回の実行のファイルを消してから始める
+  mkdir(opt.dir, 0755);
+  char path[256];
+  for (uint32_t n = 0; n < 100000; n++) {
+    SampleLogWriter::filePath(opt.dir, n, path, sizeof(path));
+    remove(path);
+  }
+  SampleLogWriter::indexPath(opt.dir, path, sizeof(path));
+  remove(path);
+
+  std::vector<uint8_t> mem((size_t)opt.buffers * opt.blocks * SAMPLE_LOG_BLOCK_SIZE);
+  SampleLogBuffer buffer(mem.data(), opt.buffers, opt.blocks, FLUSH_MS);
+  FileLogStorage storage(opt.storage);
+  SampleLogWriter::Config cfg;
+  cfg.dir = opt.dir;
+  cfg.maxFileBytes = opt.fileKb * 1024;
+  cfg.maxFiles = opt.maxFiles;
+  SampleLogWriter writer(storage, cfg);
+  if (!writer.begin()) {
+    fprintf(stderr, "%s: cannot create log files\n", opt.dir);
+    return 2;
+  }
+
+  // LCD と SD が共用する SPI バス（ファームウェアの sdBusLock() / sdBusTryLock()）
+  std::mutex bus;
+
+  // 書き出し待ちのバッファを1つ書き込む（ファームウェアの sampleLogTask の1回分）。なければ false
+  uint32_t maxWriteUs = 0;
+  auto writeOne = [&]() {
+    size_t len;
+    bool openTail;
+    bool timed;
+    uint8_t *buf = buffer.peek(len, openTail, timed);
+    if (buf == nullptr) {
+      return false;
+    }
+    bus.lock();
+    auto w0 = std::chrono::steady_clock::now();
+    writer.write(buf, len, openTail, timed);
+    uint32_t us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - w0).count();
+    bus.unlock();
+    maxWriteUs = std::max(maxWriteUs, us);
+    buffer.release();
+    return true;
+  };
+
+  // 書き出しスレッド（ファームウェアの sampleLogTask に相当）。--virtual では使わない
+  std::atomic<bool> stop(false);
+  std::thread task([&] {
+    while (!opt.virtualClock) {
+      if (!writeOne()) {
+        if (stop.load()) {
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(opt.idleMs));
+      }
+    }
+  });
+
+  // LCD の描画（--display-ms）。書き出し待ち・書き込み中なら描かずに次に回す（--display-ungated では待って描く）
+  bool display = opt.displayMs > 0 && opt.rateHz > 0 && !opt.virtualClock;
+  bool displayDirty = false;
+  uint32_t drawn = 0;
+  uint32_t deferred = 0;
+  auto draw = [&]() {
+    if (!opt.displayUngated) {
+      if (buffer.pendingBuffers() > 0 || !bus.try_lock()) {
+        deferred++;
+        return;
+      }
+    } else {
+      bus.lock();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(opt.displayMs));
+    bus.unlock();
+    drawn++;
+    displayDirty = false;
+  };
+
+  // 書き込み側（loop() に相当）
+  uint64_t maxAppendNs = 0;
+  uint64_t maxLoopNs = 0;
+  uint64_t waits = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  auto nextDisplay = t0;
+  for (uint64_t i = 0; i < opt.samples; i++) {
+    if (opt.virtualClock) {
+      while (writeOne()) {
+      }
+    } else if (opt.rateHz == 0) {
+      while (!buffer.writable()) {
+        waits++;
+        std::this_thread::yield();
+      }
+    } else if (i % 64 == 0) {
+      std::this_thread::sleep_until(t0 + std::chrono::nanoseconds(i * 1000000000ULL / opt.rateHz));
+    }
+    auto a0 = std::chrono::steady_clock::now();
+    buffer.append(localMsOf(i), unixMsOf(i), makeSample(i));
+    buffer.poll(localMsOf(i));
+    auto a1 = std::chrono::steady_clock::now();
+    maxAppendNs = std::max(maxAppendNs, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(a1 - a0).count());
+    if (display) {
+      if (a1 >= nextDisplay) {
+        displayDirty = true;
+        nextDisplay += std::chrono::milliseconds(DISPLAY_PERIOD_MS);
+      }
+      if (displayDirty) {
+        draw();
+      }
+      maxLoopNs = std::max(maxLoopNs, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::steady_clock::now() - a0).count());
+    }
+  }
+  VerifyStats st;
+  if (opt.virtualClock) {
+    while (writeOne()) {
+    }
+    checkPowerCut(opt, storage, opt.samples - 1, st);
+  }
+  buffer.flush();
+  auto t1 = std::chrono::steady_clock::now();
+  while (opt.virtualClock && writeOne()) {
+  }
+  while (buffer.pendingBuffers() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  stop.store(true);
+  task.join();
+  writer.end();
+  auto t2 = std::chrono::steady_clock::now();
+  double appendSec = std::chrono::duration<double>(t1 - t0).count();
+  double totalSec = std::chrono::duration<double>(t2 - t0).count();
+
+  printf("[LOG] %llu samples offered in %.2f s, written in %.2f s: %.0f samples/s sustained, %.1f MB/s\n",
+         (unsigned long long)opt.samples, appendSec, totalSec, buffer.appended() / totalSec,
+         writer.bytesWritten() / totalSec / 1e6);
+  printf("[LOG] buffers=%u x %u blocks, appended=%u dropped=%u, producer waits=%llu, max append=%llu ns\n",
+         opt.buffers, opt.blocks, buffer.appended(), buffer.dropped(), (unsigned long long)waits,
+         (unsigned long long)maxAppendNs);
+  printf("[LOG] writes=%u stalls=%u (%u ms), max write=%u us, %.2f bytes written per sample, files kept=%zu "
+         "removed=%u errors=%u\n",
+         storage.writes(), storage.stalls(), opt.storage.stallMs, maxWriteUs,
+         (double)writer.bytesWritten() / std::max<uint32_t>(buffer.appended(), 1), writer.index().size(),
+         writer.filesRemoved(), writer.errors());
+  bool loopTooLong = false;
+  if (display) {
+    uint32_t loopMs = (uint32_t)(maxLoopNs / 1000000);
+    loopTooLong = !opt.displayUngated && loopMs > opt.displayMs + LOOP_SLACK_MS;
+    printf("[LOG] loop: max %u ms with %u ms draws every %u ms (%s), drawn=%u deferred=%u loops, limit %u ms%s\n",
+           loopMs, opt.displayMs, DISPLAY_PERIOD_MS, opt.displayUngated ? "ungated" : "deferred while writing",
+           drawn, deferred, opt.displayMs + LOOP_SLACK_MS, loopTooLong ? " EXCEEDED" : "");
+  }
+
+  // 索引を読み直して検証する（ファームウェアの再起動後と同じく索引ファイルから）
+  static uint8_t indexBuf[SampleLogIndex::kMaxBytes];
+  size_t indexLen;
+  static SampleLogIndex index;
+  SampleLogWriter::indexPath(opt.dir, path, sizeof(path));
+  if (!storage.readFile(path, indexBuf, sizeof(indexBuf), indexLen) || !index.decode(indexBuf, indexLen)) {
+    printf("[LOG] FAIL: cannot read index %s\n", path);
+    return 1;
+  }
+  auto v0 = std::chrono::steady_clock::now();
+  verifyAll(opt, index, st);
+  double verifySec = std::chrono::duration<double>(std::chrono::steady_clock::now() - v0).count();
+  uint64_t expected = st.samples > 0 ? st.lastIndex - st.firstIndex + 1 : 0;
+  if (st.samples + st.droppedInHeaders < expected) {
+    fail(st, "samples missing without drop count", 0, 0);
+  }
+  if (buffer.dropped() == 0 && st.lastIndex != opt.samples - 1) {
+    fail(st, "last sample not recorded", 0, 0);
+  }
+  double fileBytesPerSample = (double)st.blocks * SAMPLE_LOG_BLOCK_SIZE / std::max<uint64_t>(st.samples, 1);
+  double fullBlockBytesPerSample = (double)SAMPLE_LOG_BLOCK_SIZE / SAMPLE_LOG_SAMPLES_PER_BLOCK;
+  printf("[LOG] verify: %llu files, %llu blocks, %llu samples (#%llu-#%llu), %llu dropped in headers, %.0f "
+         "samples/s read\n",
+         (unsigned long long)st.files, (unsigned long long)st.blocks, (unsigned long long)st.samples,
+         (unsigned long long)st.firstIndex, (unsigned long long)st.lastIndex,
+         (unsigned long long)st.droppedInHeaders, st.samples / std::max(verifySec, 1e-9));
+  printf("[LOG] on file: %.2f bytes per sample (full blocks %.2f), written %.2fx the file size\n",
+         fileBytesPerSample, fullBlockBytesPerSample,
+         (double)writer.bytesWritten() / std::max<uint64_t>(st.blocks * SAMPLE_LOG_BLOCK_SIZE, 1));
+  if (opt.virtualClock && fileBytesPerSample > fullBlockBytesPerSample * (1 + MAX_BYTES_PER_SAMPLE_OVERHEAD)) {
+    fail(st, "partial blocks waste file space", 0, 0);
+  }
+
+  // 残っている範囲の中ほどの10秒間を索引から探す（短い実行では最後のサンプルまで）
+  uint64_t fromIndex = std::max(st.firstIndex, gSyncAt) + (st.lastIndex - std::max(st.firstIndex, gSyncAt)) / 2;
+  uint64_t from = unixMsOf(fromIndex);
+  uint64_t to = from + 10000 - 1;
+  uint64_t blocksRead;
+  auto r0 = std::chrono::steady_clock::now();
+  uint64_t found = countRange(opt, index, from, to, blocksRead);
+  double rangeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - r0).count();
+  uint64_t want = std::min<uint64_t>(10000 / gPeriodMs, st.lastIndex - fromIndex + 1);
+  printf("[LOG] range lookup: %llu samples in 10 s (want %llu%s), %llu blocks read, %.2f ms\n",
+         (unsigned long long)found, (unsigned long long)want, buffer.dropped() > 0 ? " minus drops" : "",
+         (unsigned long long)blocksRead, rangeMs);
+  if (found > want || (buffer.dropped() == 0 && found != want)) {
+    fail(st, "range lookup count mismatch", 0, 0);
+  }
+
+  checkIndexLoss(opt, index, st);
+
+  if (loopTooLong) {
+    printf("[LOG] FAIL: loop() blocked behind an SD write\n");
+    return 1;
+  }
+  if (st.errors > 0 || writer.errors() > 0) {
+    printf("[LOG] FAIL: %llu verification errors, %u write errors\n", (unsigned long long)st.errors,
+           writer.errors());
+    return 1;
+  }
+  printf("[LOG] PASS\n");
+  return 0;
+}
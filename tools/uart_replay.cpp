@@ -0,0 +1,494 @@
+// UART トレースの再生（ホスト用）
+//
+// ファームウェアが SD カードに記録した UART トレース（include/uart_trace.h、/trace/UTnnnn.BIN）を読み、
+// 記録された時刻を仮想時刻としてファームウェアと同じプロトコル処理（UplinkSession / CommandTimeouts）へ
+// 流し直す。実時間を待たないため、数時間ぶんのトレースも数秒で再生できる。
+// 現場で起きた NG 102 の嵐や M-BUS の干渉を記録しておけば、同じ入力に対する処理の変更前後を
+// 何度でも比べられる（--min-success / --max-p95 を下回ったら終了コード1）。
+//
+// 再生は開ループ: 送信（コマンド・アップリンク）の時刻はトレースに記録されたとおりで、
+// 処理を変えてもモジュールへの送信タイミングは変わらない。変わるのは応答の判定（タイムアウト、
+// 遅れた応答の扱い）と、そこから得られる統計。
+//
+// 区間の扱いはファームウェアに合わせる:
+//   - 最初のアップリンクまで（setup()）: コマンドのマークから次のマークまでを1つのコマンドとし、
+//     応答の最初のバイトまでの時間をコマンド種別ごとに集計する。応答は無受信 50ms で終わりとみなす
+//   - 最初のアップリンク以降（loop()）: 受信バイトを UplinkSession に渡し、送信結果を照合する
+//   - モジュールの再起動（"Select Mode ["）を受信したら、または loop() の区間でコマンドを送ったら
+//     （recoverModule() によるモジュールのやり直し）setup() の区間に戻る
+//
+// 送信フォーマット（include/uplink_frame.h）は setup() 区間の "format 1"/"format 2" に "OK" が返ったかで
+// 判定する（setup() を含まないトレースは --format で指定）。loop() 区間ではアップリンクのマークまでに
+// 送信したバイトが1つの完全なフレーム（バイナリは [len][payload]、ASCII は偶数長の16進表記 + CR LF）に
+// なっているかを確かめ、モジュールの応答に対してファームウェアのフレーム同期の監視（FrameSyncMonitor）を
+// 同じように動かして、実機の応答でずれの判定（モジュールのリセット）が何回起きるかを数える。
+//
+// ビルド:
+//   g++ -O2 -std=c++17 -Iinclude tools/uart_replay.cpp -o uart_replay
+//
+// 使い方:
+//   uart_replay [--module-timeout MS] [--min-success PCT] [--max-p95 MS] [--format binary|hex]
+//               [--max-misframed N] [-v] trace.bin [trace.bin ...]
+
+#include "rtt_estimator.h"
+#include "uart_trace.h"
+#include "uplink_frame.h"
+#include "uplink_session.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define UPLINK_MODULE_TIMEOUT_MS 5000
+#define UPLINK_MODULE_TIMEOUT_MIN_MS 1000
+#define UPLINK_CONFIRM_TIMEOUT_MS 30000
+#define COMMAND_IDLE_GAP_MS 50
+#define POLL_STEP_MS 10 // loop() が応答を確認する間隔に相当
+#define TX_FRAME_MAX (2 * 255 + 2)
+
+struct Options {
+  uint32_t moduleTimeoutMs = 0; // 0 ならファームウェアと同じく応答時間の推定値から決める
+  double minSuccessPct = -1;
+  int64_t maxP95Ms = -1;
+  int64_t maxMisframed = -1;
+  int format = -1; // -1 なら setup() 区間の format コマンドから判定する
+  bool verbose = false;
+};
+
+struct CommandStats {
+  LatencyHistogram firstByte; // コマンド送信から応答の最初のバイトまで
+  uint32_t sent = 0;
+  uint32_t busy = 0;       // NG 102
+  uint32_t ng = 0;         // その他の NG
+  uint32_t noResponse = 0; // 次の送信までに応答がなかった
+};
+
+class Replay {
+public:
+  explicit Replay(const Options &opt) : opt_(opt) {
+    session_.setModuleTimeoutMs(moduleTimeoutMs());
+    if (opt_.format >= 0) {
+      format_ = (FrameFormat)opt_.format;
+      formatKnown_ = true;
+    }
+  }
+
+  bool run(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) {
+      perror(path);
+      return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+
+    UartTraceReader reader;
+    if (!reader.begin(data.data(), data.size())) {
+      fprintf(stderr, "%s: not a UART trace\n", path);
+      return false;
+    }
+    // ファイルは起動ごとに分かれるため、ファイルの始まりは再起動後の setup() に相当する
+    restart();
+    clock_ = reader.startMs();
+    uint32_t firstMs = reader.startMs();
+    UartTraceReader::Record r;
+    while (reader.next(r)) {
+      advance(r.timeMs);
+      if (r.channel == UTRACE_CH_MARK) {
+        onMark(r);
+      } else if (r.channel == UTRACE_CH_LORA_RX) {
+        for (size_t i = 0; i < r.len; i++) {
+          onLoraByte((char)r.data[i], r.timeMs);
+        }
+      } else if (r.channel == UTRACE_CH_LORA_TX) {
+        loraTxBytes_ += r.len;
+        onLoraTx(r.data, r.len);
+      } else {
+        mbusBytes_ += r.len;
+        if (inCommand_) {
+          mbusInCommand_ += r.len;
+        }
+      }
+      records_++;
+    }
+    closeCommand();
+    virtualMs_ += clock_ - firstMs;
+    if (reader.truncated()) {
+      truncatedFiles_++;
+    }
+    files_++;
+    return true;
+  }
+
+  // 結果を出力し、しきい値を満たしていれば true
+  bool report(double wallSec) const {
+    const UplinkSession &s = session_;
+    printf("[REPLAY] %u files, %llu records, virtual time %.1f h in %.3f s (%.0fx real time)%s\n", files_,
+           (unsigned long long)records_, virtualMs_ / 3600000.0, wallSec,
+           wallSec > 0 ? virtualMs_ / 1000.0 / wallSec : 0.0, truncatedFiles_ ? ", truncated" : "");
+    printf("[REPLAY] bytes: lora tx=%llu rx=%llu, mbus rx=%llu (%llu during commands), lost=%llu\n",
+           (unsigned long long)loraTxBytes_, (unsigned long long)loraRxBytes_, (unsigned long long)mbusBytes_,
+           (unsigned long long)mbusInCommand_, (unsigned long long)lostBytes_);
+    printf("[REPLAY] commands:\n");
+    for (int i = 0; i < CMD_TYPE_COUNT; i++) {
+      const CommandStats &c = commands_[i];
+      if (c.sent == 0) {
+        continue;
+      }
+      const LatencyHistogram &h = c.firstByte;
+      printf("  %-8s sent=%u ng102=%u ng=%u no-response=%u, first byte: mean=%u p50<=%u p95<=%u max=%u ms\n",
+             commandTypeName((CommandType)i), c.sent, c.busy, c.ng, c.noResponse, h.mean(), h.percentile(50),
+             h.percentile(95), h.max());
+    }
+    printf("[REPLAY] uplinks: sent=%u accepted=%u rejected=%u timeouts=%u unresolved=%d stray=%u restarts=%u\n",
+           s.sent(), s.accepted(), s.rejected(), s.timeouts(), s.awaitingModule(), s.strayLines(), restarts_);
+    printf("[REPLAY] frames: format=%s checked=%u misframed=%u unchecked=%u, sync resets=%u\n",
+           !formatKnown_ ? "unknown" : format_ == FRAME_FORMAT_BINARY ? "binary" : "hex (ascii)", framesChecked_,
+           misframed_, framesUnchecked_, syncRestarts_);
+    printf("[REPLAY] success rate: %.2f%% (accepted / sent)\n", successPct());
+    printf("[REPLAY] send->ok: mean=%u p50<=%u p95<=%u max=%u ms, uplink rto=%u ms\n", s.moduleLatency().mean(),
+           s.moduleLatency().percentile(50), s.moduleLatency().percentile(95), s.moduleLatency().max(),
+           timeouts_[CMD_UPLINK].timeoutMs());
+    printf("[REPLAY] send->confirm: mean=%u p50<=%u p95<=%u max=%u ms, confirmed=%u unconfirmed=%u\n",
+           s.confirmLatency().mean(), s.confirmLatency().percentile(50), s.confirmLatency().percentile(95),
+           s.confirmLatency().max(), s.confirmed(), s.unconfirmed());
+
+    bool ok = true;
+    if (opt_.minSuccessPct >= 0 && successPct() < opt_.minSuccessPct) {
+      printf("[REPLAY] FAIL: success rate %.2f%% below %.2f%%\n", successPct(), opt_.minSuccessPct);
+      ok = false;
+    }
+    if (opt_.maxMisframed >= 0 && misframed_ > opt_.maxMisframed) {
+      printf("[REPLAY] FAIL: %u misframed uplinks, limit %lld\n", misframed_, (long long)opt_.maxMisframed);
+      ok = false;
+    }
+    if (opt_.maxP95Ms >= 0 && s.moduleLatency().percentile(95) > (uint32_t)opt_.maxP95Ms) {
+      printf("[REPLAY] FAIL: send->ok p95 %u ms above %lld ms\n", s.moduleLatency().percentile(95),
+             (long long)opt_.maxP95Ms);
+      ok = false;
+    }
+    return ok;
+  }
+
+private:
+  uint32_t moduleTimeoutMs() {
+    if (opt_.moduleTimeoutMs > 0) {
+      return opt_.moduleTimeoutMs;
+    }
+    uint32_t ms = timeouts_[CMD_UPLINK].timeoutMs();
+    return ms < UPLINK_MODULE_TIMEOUT_MIN_MS ? UPLINK_MODULE_TIMEOUT_MIN_MS : ms;
+  }
+
+  double successPct() const {
+    return session_.sent() > 0 ? 100.0 * session_.accepted() / session_.sent() : 100.0;
+  }
+
+  void restart() {
+    closeCommand();
+    session_.reset();
+    frameSync_.reset();
+    inLoop_ = false;
+    txLen_ = 0;
+  }
+
+  // 仮想時刻を進める。loop() の区間では一定間隔で応答待ちのタイムアウトを判定する
+  void advance(uint32_t t) {
+    if (inLoop_) {
+      while ((int32_t)(t - clock_) > POLL_STEP_MS) {
+        clock_ += POLL_STEP_MS;
+        handle(session_.poll(clock_), clock_);
+      }
+      handle(session_.poll(t), t);
+    } else if (inCommand_ && respLen_ > 0 && (int32_t)(t - lastByteMs_) >= COMMAND_IDLE_GAP_MS) {
+      closeCommand();
+    }
+    if ((int32_t)(t - clock_) > 0) {
+      clock_ = t;
+    }
+  }
+
+  void onMark(const UartTraceReader::Record &r) {
+    switch (r.markType) {
+    case UTRACE_MARK_COMMAND:
+      if (inLoop_) {
+        restart(); // loop() 中にコマンドを送るのはモジュールをやり直す recoverModule() だけ
+      }
+      closeCommand();
+      if (r.markArg < CMD_TYPE_COUNT) {
+        inCommand_ = true;
+        commandType_ = (CommandType)r.markArg;
+        commandStartMs_ = r.timeMs;
+        respLen_ = 0;
+        cmdLen_ = 0;
+        firstByteMs_ = 0;
+        commands_[commandType_].sent++;
+      }
+      break;
+    case UTRACE_MARK_UPLINK:
+      closeCommand();
+      inLoop_ = true;
+      checkFrame(r.markArg, r.timeMs);
+      session_.onSent((uint8_t)r.markArg, r.timeMs);
+      if (opt_.verbose) {
+        printf("%10u  uplink seq %u\n", r.timeMs, r.markArg);
+      }
+      break;
+    case UTRACE_MARK_LOST:
+      lostBytes_ += r.markArg;
+      break;
+    }
+  }
+
+  // コマンドの区間ではコマンド文字列、それ以外はアップリンクのフレームとして送信バイトを集める
+  void onLoraTx(const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      if (inCommand_) {
+        if (cmdLen_ < sizeof(cmd_) - 1) {
+          cmd_[cmdLen_++] = (char)p[i];
+        }
+      } else {
+        if (txLen_ < sizeof(tx_)) {
+          tx_[txLen_] = p[i];
+        }
+        txLen_++;
+      }
+    }
+  }
+
+  // アップリンクのマークまでに送信したバイトが1つの完全なフレームか
+  bool frameComplete() const {
+    if (txLen_ == 0 || txLen_ > sizeof(tx_)) {
+      return false;
+    }
+    if (format_ == FRAME_FORMAT_BINARY) {
+      return tx_[0] > 0 && txLen_ == (size_t)tx_[0] + 1;
+    }
+    if (txLen_ < 4 || txLen_ % 2 != 0 || tx_[txLen_ - 2] != '\r' || tx_[txLen_ - 1] != '\n') {
+      return false;
+    }
+    for (size_t i = 0; i < txLen_ - 2; i++) {
+      uint8_t c = tx_[i];
+      if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void checkFrame(uint32_t seq, uint32_t t) {
+    if (!formatKnown_) {
+      framesUnchecked_++;
+    } else if (frameComplete()) {
+      framesChecked_++;
+    } else {
+      framesChecked_++;
+      misframed_++;
+      if (opt_.verbose) {
+        printf("%10u  uplink seq %u misframed: %zu bytes sent\n", t, seq, txLen_);
+      }
+    }
+    txLen_ = 0;
+  }
+
+  // ファームウェアの checkFrameSync() と同じ判定。バイナリでずれたと判断したらモジュールをリセットしたものとして数える
+  void onSyncAnomaly(uint32_t t) {
+    if (!formatKnown_ || format_ != FRAME_FORMAT_BINARY || !frameSync_.onAnomaly()) {
+      return;
+    }
+    syncRestarts_++;
+    if (opt_.verbose) {
+      printf("%10u  frame boundary lost, firmware would reset the module\n", t);
+    }
+  }
+
+  void onLoraByte(char c, uint32_t t) {
+    loraRxBytes_++;
+    if (inLoop_) {
+      SessionEvent ev = session_.feed(c, t);
+      if (opt_.verbose && ev != EV_NONE) {
+        printf("%10u  seq %u %s: %s\n", t, session_.lastSeq(), eventName(ev), session_.lastLine());
+      }
+      handle(ev, t);
+      return;
+    }
+    if (!inCommand_) {
+      return; // JOIN 待ちなど、コマンドの応答の後に届いたバイト
+    }
+    if (respLen_ == 0) {
+      firstByteMs_ = t - commandStartMs_ + 1;
+    }
+    if (respLen_ < sizeof(resp_) - 1) {
+      resp_[respLen_] = c;
+    }
+    respLen_++;
+    lastByteMs_ = t;
+  }
+
+  // コマンドの応答を確定する
+  void closeCommand() {
+    if (!inCommand_) {
+      return;
+    }
+    inCommand_ = false;
+    CommandStats &c = commands_[commandType_];
+    if (respLen_ == 0) {
+      c.noResponse++;
+      return;
+    }
+    resp_[respLen_ < sizeof(resp_) ? respLen_ : sizeof(resp_) - 1] = '\0';
+    c.firstByte.add(firstByteMs_);
+    ModuleLine kind = classifyModuleLine(resp_);
+    c.busy += kind == LINE_NG_BUSY ? 1 : 0;
+    c.ng += kind == LINE_NG ? 1 : 0;
+    cmd_[cmdLen_] = '\0';
+    if (opt_.format < 0 && kind == LINE_OK && strncmp(cmd_, "format ", 7) == 0) {
+      // setup() は "format 2" が拒否されたら "format 1" を送る。最後に受け付けられたものが有効
+      format_ = cmd_[7] == '2' ? FRAME_FORMAT_BINARY : FRAME_FORMAT_HEX;
+      formatKnown_ = true;
+    }
+    if (opt_.verbose) {
+      printf("%10u  %s: %u ms%s\n", commandStartMs_, commandTypeName(commandType_), firstByteMs_,
+             kind == LINE_NG_BUSY ? " NG 102" : kind == LINE_NG ? " NG" : "");
+    }
+  }
+
+  // UplinkLoop::handle()（include/uplink_loop.h）のうち、送信結果の判定に関わる部分
+  void handle(SessionEvent ev, uint32_t nowMs) {
+    switch (ev) {
+    case EV_ACCEPTED:
+    case EV_REJECTED:
+      timeouts_[CMD_UPLINK].sample(session_.lastLatencyMs());
+      session_.setModuleTimeoutMs(moduleTimeoutMs());
+      frameSync_.onMatched();
+      break;
+    case EV_TIMEOUT:
+      timeouts_[CMD_UPLINK].onTimeout();
+      session_.setModuleTimeoutMs(moduleTimeoutMs());
+      onSyncAnomaly(nowMs);
+      break;
+    case EV_STRAY:
+      onSyncAnomaly(nowMs);
+      break;
+    case EV_REBOOT:
+      restarts_++;
+      restart();
+      break;
+    default:
+      break;
+    }
+  }
+
+  static const char *eventName(SessionEvent ev) {
+    switch (ev) {
+    case EV_ACCEPTED:
+      return "accepted";
+    case EV_REJECTED:
+      return "rejected";
+    case EV_CONFIRMED:
+      return "confirmed";
+    case EV_TIMEOUT:
+      return "timeout";
+    case EV_REBOOT:
+      return "reboot";
+    case EV_STRAY:
+      return "stray";
+    default:
+      return "line";
+    }
+  }
+
+  Options opt_;
+  UplinkSession session_{UPLINK_MODULE_TIMEOUT_MS, UPLINK_CONFIRM_TIMEOUT_MS};
+  CommandTimeouts timeouts_;
+  CommandStats commands_[CMD_TYPE_COUNT];
+  uint32_t clock_ = 0;
+  bool inLoop_ = false;
+  bool inCommand_ = false;
+  CommandType commandType_ = CMD_CONFIG;
+  uint32_t commandStartMs_ = 0;
+  uint32_t firstByteMs_ = 0;
+  uint32_t lastByteMs_ = 0;
+  char resp_[256];
+  size_t respLen_ = 0;
+  char cmd_[64];
+  size_t cmdLen_ = 0;
+  uint8_t tx_[TX_FRAME_MAX];
+  size_t txLen_ = 0;
+  FrameFormat format_ = FRAME_FORMAT_BINARY;
+  bool formatKnown_ = false;
+  FrameSyncMonitor frameSync_;
+  uint32_t framesChecked_ = 0;
+  uint32_t framesUnchecked_ = 0;
+  uint32_t misframed_ = 0;
+  uint32_t syncRestarts_ = 0;
+  uint32_t files_ = 0;
+  uint32_t truncatedFiles_ = 0;
+  uint32_t restarts_ = 0;
+  uint64_t records_ = 0;
+  uint64_t virtualMs_ = 0;
+  uint64_t loraTxBytes_ = 0;
+  uint64_t loraRxBytes_ = 0;
+  uint64_t mbusBytes_ = 0;
+  uint64_t mbusInCommand_ = 0;
+  uint64_t lostBytes_ = 0;
+};
+
+static void usage() {
+  fprintf(stderr, "Usage: uart_replay [--module-timeout MS] [--min-success PCT] [--max-p95 MS] [--format binary|hex]\n"
+                  "                   [--max-misframed N] [-v] trace.bin ...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  Options opt;
+  std::vector<const char *> paths;
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    if (strcmp(a, "-v") == 0) {
+      opt.verbose = true;
+    } else if (a[0] != '-') {
+      paths.push_back(a);
+    } else if (i + 1 >= argc) {
+      usage();
+    } else if (strcmp(a, "--module-timeout") == 0) {
+      opt.moduleTimeoutMs = (uint32_t)strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(a, "--min-success") == 0) {
+      opt.minSuccessPct = strtod(argv[++i], nullptr);
+    } else if (strcmp(a, "--max-p95") == 0) {
+      opt.maxP95Ms = strtoll(argv[++i], nullptr, 10);
+    } else if (strcmp(a, "--max-misframed") == 0) {
+      opt.maxMisframed = strtoll(argv[++i], nullptr, 10);
+    } else if (strcmp(a, "--format") == 0) {
+      const char *f = argv[++i];
+      if (strcmp(f, "binary") == 0) {
+        opt.format = FRAME_FORMAT_BINARY;
+      } else if (strcmp(f, "hex") == 0) {
+        opt.format = FRAME_FORMAT_HEX;
+      } else {
+        usage();
+      }
+    } else {
+      usage();
+    }
+  }
+  if (paths.empty()) {
+    usage();
+  }
+
+  static Replay replay(opt);
+  auto t0 = std::chrono::steady_clock::now();
+  for (const char *p : paths) {
+    if (!replay.run(p)) {
+      return 2;
+    }
+  }
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  return replay.report(sec) ? 0 : 1;
+}
@@ -0,0 +1,927 @@
+// アップリンクペイロードの一括デコーダ（ホスト用）
+//
+// ネットワークサーバーからエクスポートしたアップリンク（JSON Lines または CSV）を
+// 標準入力またはファイル（mmap）から読み込み、base64ペイロードを SensorData
+// （include/sensor_data.h と同じレイアウト定義）としてデコードし、列指向で出力する。
+// decode_sensor_data.go の1メッセージ1プロセス方式では1か月分のバックフィルに
+// 数時間かかるため、複数スレッド + SIMD base64 でまとめて処理する。
+//
+// ビルド:
+//   g++ -O2 -march=native -std=c++17 -pthread -Iinclude tools/uplink_decoder.cpp -o uplink_decoder
+//
+// 使い方:
+//   uplink_decoder [options] [file]
+//     -i jsonl|csv   入力形式（省略時は先頭文字から自動判定）
+//     -k NAME        ペイロードのキー名/列名（省略時は data, frm_payload, payload の順に探す）
+//     -o csv|bin|none 出力形式（既定: csv。none はデコードのみ）
+//     -j N           スレッド数（既定: ハードウェアスレッド数）
+//     --scalar       SIMD を使わずスカラー版 base64 デコーダを使う
+//     --bench [N]    N件（既定: 1000万件）の合成アップリンクでスループットを計測（-o の形式で /dev/null へ出力）
+//
+// シーケンス番号（seq）はノードごとに入力順で追跡し、欠落したフレーム数を
+// 標準エラーに出力する。seq は8bitでローリングするため、256フレーム以上連続して
+// 欠落した場合は検出できない。seq が後戻りした場合（255→0 付近の折り返しを除く）は
+// ノードの再起動で番号が0に戻ったものとして扱い、欠落には数えない。
+// ファームウェアは NG で拒否された送信の番号を次の送信に再利用するため、欠番は電波上の欠落だけを表す。seq を持たない旧形式（8バイト）のペイロードは seq=0 として扱う。
+//
+// モジュールの送信フォーマットが ASCII（format 1）のノードは16進表記の文字列がそのまま
+// ペイロードになる（include/uplink_frame.h）。base64 を戻した結果が偶数長の大文字16進表記だけから
+// なる場合はバイナリに戻してからデコードする（バイナリのフレームの先頭バイトは nodeId が0-10なので、
+// 長さが数バイトを超えるフレームが偶然16進表記だけになることは実質ない）。
+//
+// 時刻付きバッチフレーム（FRAME_TYPE_BATCH）はサンプルごとに1行へ展開し、
+// サンプル時刻を timeMs 列に出力する（timeSynced=1 ならUNIX時刻、0 なら起動からの経過時間）。
+// 時刻を持たない SensorData のフレームは timeMs=0 になる。
+// 変化時のみ送信するモード（BATCH_FLAG_HELD）のフレームでは、送信を省いたサンプルを直前の値で
+// 公称周期ごとに補完した行も出力する（held=1。値は送信した値から不感帯以内）。
+// イベントフレーム（FRAME_TYPE_EVENT）は検出時のサンプルと検出時刻を1行にし、events 列に EVENT_* を出力する
+// （decode_sensor_data.go の DecodeEventData と同じ解釈）。
+// 診断フレーム（FRAME_TYPE_DIAG）は行を出力しない。イベント・診断フレームはセンサーデータと共通の seq を
+// 使うため、どちらも欠落検出に含める。
+//
+// 出力形式:
+//   csv : ヘッダ行 + 1レコード1行（生の整数値。airSpeed100 等は×100のまま）
+//   bin : "SDCOL1\0\0" + 列数(u32) + 列ごとに [名前長(u8) 名前 幅(u8)]、
+//         以降ブロックごとに 行数(u32) + 列ごとの連続配列（リトルエンディアン）
+
+#include "sample_batch.h"
+#include "sensor_data.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+// ---------------------------------------------------------------------------
+// 列定義（SensorData のレイアウトから生成）
+// ---------------------------------------------------------------------------
+
+struct FieldDef {
+  const char *name;
+  size_t offset;
+  size_t width;
+};
+
+// 1行ぶんのデコード結果
+struct __attribute__((packed)) DecodedRow {
+  SensorData sensor;
+  uint64_t timeMs;    // サンプル時刻（ミリ秒）
+  uint8_t timeSynced; // timeMs がUNIX時刻なら1
+  uint8_t held;       // 送信を省いたサンプルを補完した行なら1
+  uint8_t events;     // イベントフレームの行なら EVENT_*（それ以外は0）
+};
+
+#define SENSOR_FIELD(name) \
+  { #name, offsetof(DecodedRow, sensor) + offsetof(SensorData, name), sizeof(((SensorData *)0)->name) }
+#define ROW_FIELD(name) \
+  { #name, offsetof(DecodedRow, name), sizeof(((DecodedRow *)0)->name) }
+
+static const FieldDef kFields[] = {
+    SENSOR_FIELD(nodeId),
+    SENSOR_FIELD(windDirection),
+    SENSOR_FIELD(airSpeed100),
+    SENSOR_FIELD(virtualTemp100),
+    SENSOR_FIELD(rssiAbs),
+    SENSOR_FIELD(seq),
+    ROW_FIELD(timeMs),
+    ROW_FIELD(timeSynced),
+    ROW_FIELD(held),
+    ROW_FIELD(events),
+};
+
+static const size_t kFieldCount = sizeof(kFields) / sizeof(kFields[0]);
+
+// ---------------------------------------------------------------------------
+// base64 デコード
+// ---------------------------------------------------------------------------
+
+static int8_t kB64Table[256];
+
+static void initB64Table() {
+  memset(kB64Table, -1, sizeof(kB64Table));
+  const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  for (int i = 0; i < 64; i++) {
+    kB64Table[(uint8_t)alphabet[i]] = (int8_t)i;
+  }
+}
+
+// スカラー版: 成功時はデコード後のバイト数、失敗時は -1
+static int decodeBase64Scalar(const char *src, size_t len, uint8_t *dst) {
+  while (len > 0 && src[len - 1] == '=') {
+    len--;
+  }
+  if (len % 4 == 1) {
+    return -1;
+  }
+  uint32_t acc = 0;
+  int bits = 0;
+  int n = 0;
+  for (size_t i = 0; i < len; i++) {
+    int8_t v = kB64Table[(uint8_t)src[i]];
+    if (v < 0) {
+      return -1;
+    }
+    acc = (acc << 6) | (uint32_t)v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      dst[n++] = (uint8_t)(acc >> bits);
+    }
+  }
+  return n;
+}
+
+#if defined(__SSSE3__)
+// SSSE3版: 16文字 → 12バイト（dst には16バイト書き込む）
+// W. Muła / D. Lemire の pshufb による文字分類・変換を利用
+static inline bool decodeBlock16(__m128i in, uint8_t *dst) {
+  const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                      0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                        0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask2F = _mm_set1_epi8(0x2F);
+
+  __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask2F);
+  __m128i loNibbles = _mm_and_si128(in, mask2F);
+  __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+  __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+  __m128i invalid = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+  if (_mm_movemask_epi8(invalid) != 0xFFFF) {
+    return false;
+  }
+  __m128i eq2F = _mm_cmpeq_epi8(in, mask2F);
+  __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, hiNibbles));
+  __m128i values = _mm_add_epi8(in, roll);
+
+  // 6bit × 4 → 24bit に詰める
+  __m128i mergeAB = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  __m128i merged = _mm_madd_epi16(mergeAB, _mm_set1_epi32(0x00011000));
+  __m128i out = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                       14, 13, 12, -1, -1, -1, -1));
+  _mm_storeu_si128((__m128i *)dst, out);
+  return true;
+}
+
+// dst には (len/4)*3 + 16 バイト以上の領域が必要
+// 16文字単位のブロックだけを SIMD で処理し、端数はスカラー版で処理する
+// （端数を 'A' で埋めて1ブロックにすると、コピーの分だけスカラー版より遅くなる）
+static int decodeBase64Simd(const char *src, size_t len, uint8_t *dst) {
+  while (len > 0 && src[len - 1] == '=') {
+    len--;
+  }
+  if (len % 4 == 1) {
+    return -1;
+  }
+  size_t outLen = len * 3 / 4;
+  uint8_t *out = dst;
+  while (len >= 16) {
+    if (!decodeBlock16(_mm_loadu_si128((const __m128i *)src), out)) {
+      return -1;
+    }
+    src += 16;
+    len -= 16;
+    out += 12;
+  }
+  if (len > 0 && decodeBase64Scalar(src, len, out) < 0) {
+    return -1;
+  }
+  return (int)outLen;
+}
+#endif
+
+static bool gUseSimd = true;
+
+// これより短いペイロードはスカラー版の方が速い（SensorData の9バイト = 12文字など）
+static const size_t kSimdMinChars = 16;
+
+static int decodeBase64(const char *src, size_t len, uint8_t *dst) {
+#if defined(__SSSE3__)
+  if (gUseSimd && len >= kSimdMinChars) {
+    return decodeBase64Simd(src, len, dst);
+  }
+#endif
+  return decodeBase64Scalar(src, len, dst);
+}
+
+// ---------------------------------------------------------------------------
+// 入力行からペイロード文字列を取り出す
+// ---------------------------------------------------------------------------
+
+enum InputFormat { INPUT_AUTO, INPUT_JSONL, INPUT_CSV };
+
+struct InputSpec {
+  InputFormat format = INPUT_AUTO;
+  std::vector<std::string> keys;    // JSONのキー候補
+  std::vector<std::string> needles; // keys を '"' で囲んだ検索文字列
+  int csvColumn = -1;               // CSVの列番号
+};
+
+// JSONの1行から "key": "value" の value を探す（エスケープを含まない base64 前提）
+static bool findJsonString(const char *p, const char *end, const std::string &needle,
+                           const char **valBegin, const char **valEnd) {
+  while (p < end) {
+    const char *hit = (const char *)memmem(p, end - p, needle.data(), needle.size());
+    if (hit == nullptr) {
+      return false;
+    }
+    const char *q = hit + needle.size();
+    while (q < end && (*q == ' ' || *q == '\t')) {
+      q++;
+    }
+    if (q < end && *q == ':') {
+      q++;
+      while (q < end && (*q == ' ' || *q == '\t')) {
+        q++;
+      }
+      if (q < end && *q == '"') {
+        q++;
+        const char *e = (const char *)memchr(q, '"', end - q);
+        if (e == nullptr) {
+          return false;
+        }
+        *valBegin = q;
+        *valEnd = e;
+        return true;
+      }
+    }
+    p = hit + needle.size();
+  }
+  return false;
+}
+
+static bool findCsvField(const char *p, const char *end, int column,
+                         const char **valBegin, const char **valEnd) {
+  for (int col = 0; p <= end; col++) {
+    const char *comma = (const char *)memchr(p, ',', end - p);
+    const char *fieldEnd = comma ? comma : end;
+    if (col == column) {
+      if (fieldEnd - p >= 2 && *p == '"' && fieldEnd[-1] == '"') {
+        p++;
+        fieldEnd--;
+      }
+      *valBegin = p;
+      *valEnd = fieldEnd;
+      return true;
+    }
+    if (comma == nullptr) {
+      break;
+    }
+    p = comma + 1;
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+// 列バッファ
+// ---------------------------------------------------------------------------
+
+// 欠落検出の対象になるフレームの seq
+struct SeqMark {
+  uint8_t node;
+  uint8_t seq;
+};
+
+struct Columns {
+  std::vector<uint8_t> data[kFieldCount];
+  std::vector<SeqMark> seqs; // 入力順。旧形式のペイロードとバッチの2行目以降は含めず、診断フレームは行なしで含める
+  size_t rows = 0;
+  size_t errors = 0;
+  size_t skipped = 0; // 診断フレームなどセンサーデータ・イベント以外のフレーム
+
+  void clear() {
+    for (auto &c : data) {
+      c.clear();
+    }
+    seqs.clear();
+    rows = 0;
+    errors = 0;
+    skipped = 0;
+  }
+
+  void append(const DecodedRow &row, bool withSeq) {
+    const uint8_t *p = (const uint8_t *)&row;
+    if (withSeq) {
+      seqs.push_back({row.sensor.nodeId, row.sensor.seq});
+    }
+    for (size_t f = 0; f < kFieldCount; f++) {
+      const uint8_t *v = p + kFields[f].offset;
+      // 1バイトの列は push_back（範囲 insert の呼び出しコストが行あたりの処理の大半を占めるため）
+      if (kFields[f].width == 1) {
+        data[f].push_back(v[0]);
+      } else {
+        data[f].insert(data[f].end(), v, v + kFields[f].width);
+      }
+    }
+    rows++;
+  }
+
+  // SensorData のフレーム。旧形式の短いペイロードは末尾のフィールドを0で埋める
+  void appendSensor(const uint8_t *payload, size_t len) {
+    DecodedRow row = {};
+    memcpy(&row.sensor, payload, std::min(len, sizeof(SensorData)));
+    append(row, len >= sizeof(SensorData));
+  }
+
+  // バッチフレームをサンプルごとの行に展開する。途中で切れていたらエラーに数える
+  void appendBatch(const uint8_t *payload, size_t len) {
+    BatchReader reader;
+    if (!reader.begin(payload, len)) {
+      errors++;
+      return;
+    }
+    const BatchHeader &h = reader.header();
+    DecodedRow row = {};
+    row.sensor.nodeId = h.header & FRAME_NODE_MASK;
+    row.sensor.seq = h.seq;
+    row.timeSynced = (h.flags & BATCH_FLAG_SYNCED) ? 1 : 0;
+    BatchSample s;
+    uint64_t timeMs;
+    bool first = true;
+    while (reader.next(s, timeMs)) {
+      row.timeMs = timeMs;
+      row.sensor.windDirection = s.windDirection;
+      row.sensor.airSpeed100 = s.airSpeed100;
+      row.sensor.virtualTemp100 = s.virtualTemp100;
+      row.sensor.rssiAbs = s.rssiAbs;
+      row.held = reader.held() ? 1 : 0;
+      append(row, first);
+      first = false;
+    }
+    if (reader.truncated()) {
+      errors++;
+    }
+  }
+
+  // 診断フレームは行にせず seq だけを欠落検出に渡す
+  void noteDiag(const uint8_t *payload, size_t len) {
+    if (len < sizeof(DiagData)) {
+      errors++;
+      return;
+    }
+    DiagData d;
+    memcpy(&d, payload, sizeof(DiagData));
+    seqs.push_back({(uint8_t)(d.header & FRAME_NODE_MASK), d.seq});
+    skipped++;
+  }
+
+  // イベントフレームを1行にする。短すぎればエラーに数える
+  void appendEvent(const uint8_t *payload, size_t len) {
+    if (len < sizeof(EventData)) {
+      errors++;
+      return;
+    }
+    EventData ev;
+    memcpy(&ev, payload, sizeof(EventData));
+    DecodedRow row = {};
+    row.sensor.nodeId = ev.header & FRAME_NODE_MASK;
+    row.sensor.seq = ev.seq;
+    row.sensor.windDirection = ev.sample.windDirection;
+    row.sensor.airSpeed100 = ev.sample.airSpeed100;
+    row.sensor.virtualTemp100 = ev.sample.virtualTemp100;
+    row.sensor.rssiAbs = ev.sample.rssiAbs;
+    row.timeMs = (uint64_t)ev.timeSec * 1000 + ev.timeMs;
+    row.timeSynced = (ev.flags & EVENT_FLAG_SYNCED) ? 1 : 0;
+    row.events = ev.events;
+    append(row, true);
+  }
+
+  uint64_t value(size_t f, size_t row) const {
+    const uint8_t *v = &data[f][row * kFields[f].width];
+    uint64_t x = 0;
+    for (size_t i = 0; i < kFields[f].width; i++) {
+      x |= (uint64_t)v[i] << (8 * i);
+    }
+    return x;
+  }
+};
+
+// ASCII フォーマットで送られた16進表記のペイロードならバイナリに戻し、戻した長さを返す。そうでなければ n
+static int unhexAsciiPayload(uint8_t *buf, int n) {
+  if (n < 2 || n % 2 != 0) {
+    return n;
+  }
+  for (int i = 0; i < n; i++) {
+    uint8_t c = buf[i];
+    if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))) {
+      return n;
+    }
+  }
+  for (int i = 0; i < n / 2; i++) {
+    uint8_t hi = buf[2 * i];
+    uint8_t lo = buf[2 * i + 1];
+    buf[i] = (uint8_t)(((hi <= '9' ? hi - '0' : hi - 'A' + 10) << 4) | (lo <= '9' ? lo - '0' : lo - 'A' + 10));
+  }
+  return n / 2;
+}
+
+static void decodeRange(const char *p, const char *end, const InputSpec &spec, Columns &cols) {
+  uint8_t buf[512];
+  while (p < end) {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    const char *lineEnd = nl ? nl : end;
+    const char *next = nl ? nl + 1 : end;
+    if (lineEnd > p && lineEnd[-1] == '\r') {
+      lineEnd--;
+    }
+    if (lineEnd == p) {
+      p = next;
+      continue;
+    }
+
+    const char *vb = nullptr;
+    const char *ve = nullptr;
+    bool found = false;
+    if (spec.format == INPUT_CSV) {
+      found = findCsvField(p, lineEnd, spec.csvColumn, &vb, &ve);
+    } else {
+      for (const auto &needle : spec.needles) {
+        if (findJsonString(p, lineEnd, needle, &vb, &ve)) {
+          found = true;
+          break;
+        }
+      }
+    }
+
+    size_t len = found ? (size_t)(ve - vb) : 0;
+    if (!found || len > 4 * (sizeof(buf) - 16) / 3) {
+      cols.errors++;
+    } else {
+      int n = decodeBase64(vb, len, buf);
+      n = unhexAsciiPayload(buf, n);
+      uint8_t type = n > 0 ? (buf[0] & FRAME_TYPE_MASK) : FRAME_TYPE_SENSOR;
+      if (type == FRAME_TYPE_BATCH) {
+        cols.appendBatch(buf, (size_t)n);
+      } else if (type == FRAME_TYPE_EVENT) {
+        cols.appendEvent(buf, (size_t)n);
+      } else if (type == FRAME_TYPE_DIAG) {
+        cols.noteDiag(buf, (size_t)n);
+      } else if (type != FRAME_TYPE_SENSOR) {
+        cols.skipped++;
+      } else if (n < (int)offsetof(SensorData, seq)) {
+        cols.errors++;
+      } else {
+        cols.appendSensor(buf, (size_t)n);
+      }
+    }
+    p = next;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// 出力
+// ---------------------------------------------------------------------------
+
+enum OutputFormat { OUTPUT_CSV, OUTPUT_BIN, OUTPUT_NONE };
+
+static void formatCsv(const Columns &cols, std::string &out) {
+  char num[24];
+  out.reserve(out.size() + cols.rows * 40);
+  for (size_t r = 0; r < cols.rows; r++) {
+    for (size_t f = 0; f < kFieldCount; f++) {
+      if (f > 0) {
+        out += ',';
+      }
+      int n = snprintf(num, sizeof(num), "%llu", (unsigned long long)cols.value(f, r));
+      out.append(num, n);
+    }
+    out += '\n';
+  }
+}
+
+static void writeHeader(OutputFormat fmt, FILE *fp) {
+  if (fmt == OUTPUT_CSV) {
+    for (size_t f = 0; f < kFieldCount; f++) {
+      fprintf(fp, "%s%s", f ? "," : "", kFields[f].name);
+    }
+    fputc('\n', fp);
+  } else if (fmt == OUTPUT_BIN) {
+    fwrite("SDCOL1\0\0", 1, 8, fp);
+    uint32_t n = kFieldCount;
+    fwrite(&n, sizeof(n), 1, fp);
+    for (size_t f = 0; f < kFieldCount; f++) {
+      uint8_t nameLen = (uint8_t)strlen(kFields[f].name);
+      uint8_t width = (uint8_t)kFields[f].width;
+      fwrite(&nameLen, 1, 1, fp);
+      fwrite(kFields[f].name, 1, nameLen, fp);
+      fwrite(&width, 1, 1, fp);
+    }
+  }
+}
+
+static void writeBinBlock(const std::vector<Columns> &parts, FILE *fp) {
+  uint32_t rows = 0;
+  for (const auto &c : parts) {
+    rows += (uint32_t)c.rows;
+  }
+  fwrite(&rows, sizeof(rows), 1, fp);
+  for (size_t f = 0; f < kFieldCount; f++) {
+    for (const auto &c : parts) {
+      fwrite(c.data[f].data(), 1, c.data[f].size(), fp);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// 並列処理
+// ---------------------------------------------------------------------------
+
+struct Pipeline {
+  InputSpec spec;
+  OutputFormat output = OUTPUT_CSV;
+  unsigned threads = 1;
+  FILE *out = stdout;
+  size_t rows = 0;
+  size_t errors = 0;
+  size_t skipped = 0;
+
+  // ノードごとのシーケンス番号追跡
+  bool seen[256] = {false};
+  uint8_t lastSeq[256] = {0};
+  uint64_t lost[256] = {0};
+  uint64_t duplicates[256] = {0};
+  uint64_t restarts[256] = {0};
+
+  std::vector<Columns> parts;
+  std::vector<std::string> text;
+
+  // [begin, end) は行単位で完結していること
+  void processBlock(const char *begin, const char *end) {
+    parts.resize(threads);
+    text.resize(threads);
+
+    // 行境界でスレッド数に分割
+    std::vector<const char *> cuts(threads + 1, end);
+    cuts[0] = begin;
+    size_t step = (size_t)(end - begin) / threads;
+    for (unsigned t = 1; t < threads; t++) {
+      const char *c = std::max(cuts[t - 1], begin + step * t);
+      const char *nl = c < end ? (const char *)memchr(c, '\n', end - c) : nullptr;
+      cuts[t] = nl ? nl + 1 : end;
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back([this, t, &cuts]() {
+        parts[t].clear();
+        text[t].clear();
+        decodeRange(cuts[t], cuts[t + 1], spec, parts[t]);
+        if (output == OUTPUT_CSV) {
+          formatCsv(parts[t], text[t]);
+        }
+      });
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
+
+    trackSequence();
+    for (unsigned t = 0; t < threads; t++) {
+      rows += parts[t].rows;
+      errors += parts[t].errors;
+      skipped += parts[t].skipped;
+      if (output == OUTPUT_CSV) {
+        fwrite(text[t].data(), 1, text[t].size(), out);
+      }
+    }
+    if (output == OUTPUT_BIN) {
+      writeBinBlock(parts, out);
+    }
+  }
+
+  void trackSequence();
+  void reportGaps() const;
+};
+
+// 255 → 0 の折り返しとみなす範囲。これより大きく後戻りした場合は再起動として扱う
+static const uint8_t kSeqWrapWindow = 32;
+
+// シーケンス番号の欠落検出は入力順に行う必要があるため、並列デコード後に逐次処理する
+void Pipeline::trackSequence() {
+  for (const auto &c : parts) {
+    for (const SeqMark &m : c.seqs) {
+      uint8_t node = m.node;
+      uint8_t seq = m.seq;
+      if (seen[node]) {
+        uint8_t gap = (uint8_t)(seq - lastSeq[node] - 1);
+        if (seq == lastSeq[node]) {
+          duplicates[node]++;
+        } else if (seq < lastSeq[node] && gap >= kSeqWrapWindow) {
+          restarts[node]++;
+        } else {
+          lost[node] += gap;
+        }
+      }
+      seen[node] = true;
+      lastSeq[node] = seq;
+    }
+  }
+}
+
+void Pipeline::reportGaps() const {
+  for (int node = 0; node < 256; node++) {
+    if (!seen[node]) {
+      continue;
+    }
+    fprintf(stderr, "node %d: %llu frames lost, %llu duplicates, %llu restarts\n", node,
+            (unsigned long long)lost[node], (unsigned long long)duplicates[node],
+            (unsigned long long)restarts[node]);
+  }
+}
+
+// 入力形式の判定とCSVヘッダの解釈。ヘッダ行を消費した場合はその長さを返す
+static size_t resolveInput(InputSpec &spec, const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+    p++;
+  }
+  if (spec.format == INPUT_AUTO) {
+    spec.format = (p < end && *p == '{') ? INPUT_JSONL : INPUT_CSV;
+  }
+  if (spec.keys.empty()) {
+    spec.keys = {"data", "frm_payload", "payload"};
+  }
+  spec.needles.clear();
+  for (const auto &key : spec.keys) {
+    spec.needles.push_back("\"" + key + "\"");
+  }
+  if (spec.format != INPUT_CSV) {
+    return 0;
+  }
+
+  const char *nl = (const char *)memchr(p, '\n', end - p);
+  const char *lineEnd = nl ? nl : end;
+  for (const auto &key : spec.keys) {
+    const char *q = p;
+    for (int col = 0; q <= lineEnd; col++) {
+      const char *comma = (const char *)memchr(q, ',', lineEnd - q);
+      const char *fe = comma ? comma : lineEnd;
+      std::string name(q, fe);
+      while (!name.empty() && (name.back() == '\r' || name.back() == '"')) {
+        name.pop_back();
+      }
+      if (!name.empty() && name.front() == '"') {
+        name.erase(0, 1);
+      }
+      if (name == key) {
+        spec.csvColumn = col;
+        return (size_t)((nl ? nl + 1 : end) - p);
+      }
+      if (comma == nullptr) {
+        break;
+      }
+      q = comma + 1;
+    }
+  }
+  fprintf(stderr, "Error: payload column not found in CSV header\n");
+  exit(1);
+}
+
+static const size_t kBlockBytes = 64u << 20;
+
+static void runMapped(Pipeline &pl, const char *data, size_t size) {
+  const char *p = data;
+  const char *end = data + size;
+  p += resolveInput(pl.spec, p, end);
+  while (p < end) {
+    const char *blockEnd = p + std::min(kBlockBytes, (size_t)(end - p));
+    if (blockEnd < end) {
+      const char *nl = (const char *)memchr(blockEnd, '\n', end - blockEnd);
+      blockEnd = nl ? nl + 1 : end;
+    }
+    pl.processBlock(p, blockEnd);
+    p = blockEnd;
+  }
+}
+
+static void runStream(Pipeline &pl, FILE *in) {
+  std::vector<char> buf(kBlockBytes + 1);
+  size_t carry = 0;
+  bool first = true;
+  for (;;) {
+    size_t n = fread(buf.data() + carry, 1, kBlockBytes - carry, in);
+    size_t have = carry + n;
+    if (have == 0) {
+      break;
+    }
+    const char *begin = buf.data();
+    const char *end = begin + have;
+    if (first) {
+      begin += resolveInput(pl.spec, begin, end);
+      first = false;
+    }
+    const char *cut = end;
+    if (n > 0) {
+      // 最後の改行までを処理し、残りは次のブロックへ持ち越す
+      const char *q = end;
+      while (q > begin && q[-1] != '\n') {
+        q--;
+      }
+      if (q > begin) {
+        cut = q;
+      } else if (have < kBlockBytes) {
+        carry = (size_t)(end - begin);
+        memmove(buf.data(), begin, carry);
+        continue;
+      }
+    }
+    pl.processBlock(begin, cut);
+    carry = (size_t)(end - cut);
+    memmove(buf.data(), cut, carry);
+    if (n == 0) {
+      break;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// ベンチマーク
+// ---------------------------------------------------------------------------
+
+static void encodeBase64(const uint8_t *src, size_t len, std::string &out) {
+  const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t i = 0;
+  for (; i + 3 <= len; i += 3) {
+    uint32_t v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 63];
+    out += alphabet[(v >> 6) & 63];
+    out += alphabet[v & 63];
+  }
+  if (len - i == 1) {
+    uint32_t v = src[i] << 16;
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 63];
+    out += "==";
+  } else if (len - i == 2) {
+    uint32_t v = (src[i] << 16) | (src[i + 1] << 8);
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 63];
+    out += alphabet[(v >> 6) & 63];
+    out += '=';
+  }
+}
+
+// 4件に1件は10サンプルの時刻付きバッチフレーム（現行ファームウェア）、残りは SensorData（旧形式）。
+// 出力の整形と書き込み（/dev/null）まで含めて計測する
+static int runBench(Pipeline &pl, size_t records) {
+  fprintf(stderr, "Generating %zu synthetic uplinks...\n", records);
+  std::string input;
+  input.reserve(records * 96);
+  uint32_t rng = 12345;
+  size_t expectedRows = 0;
+  size_t payloadChars = 0;
+  Timebase tb;
+  uint8_t batch[64];
+  for (size_t i = 0; i < records; i++) {
+    rng = rng * 1664525u + 1013904223u;
+    uint8_t nodeId = (uint8_t)(i % 11);
+    input += "{\"deviceName\":\"node";
+    input += std::to_string(nodeId);
+    input += "\",\"fPort\":1,\"data\":\"";
+    size_t before = input.size();
+    if (i % 4 == 3) {
+      SampleRing ring;
+      for (uint32_t k = 0; k < 10; k++) {
+        BatchSample bs = {(uint16_t)((rng >> 8) % 361), (uint16_t)((rng >> 4 ^ k * 97) % 5001),
+                          (uint16_t)((rng + k) % 5001), (uint8_t)((rng >> 20) % 100)};
+        ring.push((uint32_t)(i * 1000 + k * 1000), bs);
+      }
+      size_t count;
+      size_t len = encodeSampleBatch(ring, tb, nodeId, (uint8_t)(i / 11), 0, 1000, batch, sizeof(batch), count);
+      encodeBase64(batch, len, input);
+      expectedRows += count;
+    } else {
+      SensorData d;
+      d.seq = (uint8_t)(i / 11);
+      d.nodeId = nodeId;
+      d.windDirection = (uint16_t)((rng >> 8) % 361);
+      d.airSpeed100 = (uint16_t)((rng >> 4) % 5001);
+      d.virtualTemp100 = (uint16_t)(rng % 5001);
+      d.rssiAbs = (uint8_t)((rng >> 20) % 100);
+      encodeBase64((const uint8_t *)&d, sizeof(d), input);
+      expectedRows++;
+    }
+    payloadChars += input.size() - before;
+    input += "\"}\n";
+  }
+
+  pl.out = fopen("/dev/null", "w");
+  if (pl.out == nullptr) {
+    perror("/dev/null");
+    return 1;
+  }
+  auto t0 = std::chrono::steady_clock::now();
+  writeHeader(pl.output, pl.out);
+  runMapped(pl, input.data(), input.size());
+  fflush(pl.out);
+  auto t1 = std::chrono::steady_clock::now();
+  double sec = std::chrono::duration<double>(t1 - t0).count();
+  fclose(pl.out);
+
+  static const char *outputNames[] = {"csv", "bin", "none"};
+  fprintf(stderr, "[BENCH] %zu records -> %zu rows (%zu errors) in %.3f s, threads: %u, base64: %s, output: %s\n",
+          records, pl.rows, pl.errors, sec, pl.threads,
+          gUseSimd ? "simd (>= 16 chars)" : "scalar", outputNames[pl.output]);
+  fprintf(stderr, "[BENCH] %.0f records/s, %.0f rows/s, %.1f MB/s, mean payload %.1f chars\n",
+          records / sec, pl.rows / sec, input.size() / sec / 1e6, (double)payloadChars / records);
+  return pl.rows == expectedRows && pl.errors == 0 ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: uplink_decoder [-i jsonl|csv] [-k key] [-o csv|bin|none] [-j threads] [--scalar] [file]\n"
+          "       uplink_decoder --bench [records]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  initB64Table();
+
+  Pipeline pl;
+  pl.threads = std::max(1u, std::thread::hardware_concurrency());
+  const char *path = nullptr;
+  size_t benchRecords = 0;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a == "-i" && i + 1 < argc) {
+      std::string v = argv[++i];
+      pl.spec.format = (v == "csv") ? INPUT_CSV : INPUT_JSONL;
+    } else if (a == "-k" && i + 1 < argc) {
+      pl.spec.keys.push_back(argv[++i]);
+    } else if (a == "-o" && i + 1 < argc) {
+      std::string v = argv[++i];
+      pl.output = (v == "bin") ? OUTPUT_BIN : (v == "none") ? OUTPUT_NONE : OUTPUT_CSV;
+    } else if (a == "-j" && i + 1 < argc) {
+      pl.threads = std::max(1, atoi(argv[++i]));
+    } else if (a == "--scalar") {
+      gUseSimd = false;
+    } else if (a == "--bench") {
+      benchRecords = 10000000;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        benchRecords = strtoull(argv[++i], nullptr, 10);
+      }
+    } else if (a[0] == '-' && a.size() > 1) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
+#if !defined(__SSSE3__)
+  gUseSimd = false;
+#endif
+
+  if (benchRecords > 0) {
+    return runBench(pl, benchRecords);
+  }
+
+  writeHeader(pl.output, pl.out);
+
+  if (path != nullptr) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      perror(path);
+      return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size > 0) {
+      void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+      }
+      madvise(m, st.st_size, MADV_SEQUENTIAL);
+      runMapped(pl, (const char *)m, st.st_size);
+      munmap(m, st.st_size);
+    }
+    close(fd);
+  } else {
+    runStream(pl, stdin);
+  }
+
+  fflush(pl.out);
+  fprintf(stderr, "%zu records decoded, %zu errors, %zu non-sensor frames skipped\n",
+          pl.rows, pl.errors, pl.skipped);
+  pl.reportGaps();
+  return 0;
+}
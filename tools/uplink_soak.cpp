@@ -0,0 +1,712 @@
+// アップリンク処理の長時間ソークベンチマーク（ホスト用）
+//
+// ファームウェアの loop() と同じアップリンク処理（include/uplink_loop.h の UplinkLoop）を
+// ES920LR3 エミュレータ（tools/es920_emulator.h）につなぎ、仮想時刻で数百万回の
+// 送信サイクルを実行する。NG 102 の嵐、応答なし、遅延応答、モジュールの再起動を含む。
+// 診断フレーム、時刻要求と時刻ダウンリンクによる同期、イベントの確認応答ダウンリンク（一部は届かず再送）も
+// ファームウェアと同じ経路を通す。サーバーが受け取ったフレームの seq の欠番は、応答がなかった送信要求・
+// モジュールの再起動・区切りのずれで説明できる数を超えたら失敗とする（診断フレームを含めて seq は共通）。
+// 時刻が同期しなかった場合、確認応答が1つも届かなかった場合も失敗とする。同期後の送信スロットが
+// UNIX時刻に合っていない（揺らぎの幅と送信の遅れを超えて SLOT_ALIGN_SLACK_MS 以上ずれた）場合と、
+// ばらばらに起動したノード同士の送信予定時刻がスロット間隔の半分より近づく場合も失敗とする。
+// ループの部品はヒープを使わない設計なので、受信・送信のスコープ（MEM_SESSION / MEM_UPLINK）で
+// new による確保が1回でもあれば失敗（終了コード1）とする。malloc を直接使う確保も含めたプロセス全体の
+// ヒープ使用量も区間ごとに記録し、増え続けていれば失敗とする。
+// String を返す sendCommand() や応答の組み立てなど Arduino の String を使う経路はホストでは
+// 再現できないため対象外（実機では [MEM] のテレメトリと診断フレームの確保回数で監視する）。
+// NG 102 の嵐の間に未送信サンプルのリング（SampleRing）があふれてサンプルを捨てたら失敗とする。
+// 一定間隔で突風のサンプルを混ぜ、優先クラス（EventQueue）のイベントが送信時間の予算（AirtimeBudget）の
+// もとで検出から送信（モジュールが受け付けた時刻）までにかかった遅延も報告する。最大値が
+// NG 102 の嵐の長さ + 再送間隔の上限（EventQueue::kRetryMaxMs）+ EVENT_AIR_SLACK_MS を超えたら失敗とする。
+// --rbe では変化時のみ送信するモード（DeadbandFilter）で送り、送ったフレームを BatchReader で
+// 復元した値が実際のサンプルから不感帯以内に収まっていること、送信時間がどれだけ減ったかを確認する。
+// --hex では ASCII（16進表記）で送る。エアー上のペイロードが2倍になるため、1Hz の全サンプルは
+// 送信時間の予算 2% に収まらない（約3.2%必要。--rbe か --budget 40 と組み合わせる）。
+// --drop-byte ではファームウェアからモジュールへのバイトを指定の確率で欠けさせ、バイナリのフレームの
+// 区切りがずれたときにファームウェアと同じモジュールだけのリセット（FrameSyncMonitor がずれを検出したら。
+// ModuleResetLimiter の上限を超えたら ESP32 ごと再起動）で回復すること、区切りのずれで送ってしまった
+// 別内容の送信要求が欠けたバイト数に比例する範囲に収まることを確認する。
+// --trace ではエミュレータとの送受信をファームウェアと同じ形式の UART トレースに記録する
+// （tools/uart_replay.cpp で再生し、再生結果がこの実行の統計と一致することを確認できる）。
+//
+// --sweep では代わりに送信フレームの確認を行う。バイナリ・16進文字列の各フォーマットで、
+// すべての長さ・すべてのバイト値（0x00-0xFF）を各位置に含むペイロードをエミュレータに送り、
+// 1つの送信要求として同じバイト列が届き "OK" が返ることを確認する（不一致があれば終了コード1）。
+//
+// ビルド:
+//   g++ -O2 -std=c++17 -Iinclude tools/uplink_soak.cpp -o uplink_soak
+//
+// 使い方:
+//   uplink_soak [--cycles N] [--storm-every N] [--storm-ms MS] [--reboot-every N] [--seed N] [--tolerance BYTES]
+//               [--hex] [--gust-every SAMPLES] [--budget PERMILLE] [--rbe] [--trace FILE] [--drop-byte PERMILLE]
+//   uplink_soak --sweep
+
+#include "mem_telemetry.h"
+#include "uart_trace.h"
+#include "uplink_loop.h"
+
+#include "es920_emulator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <new>
+
+// ---------------------------------------------------------------------------
+// ヒープ使用量の計測（ファームウェアの malloc ラッパーに相当）
+// ---------------------------------------------------------------------------
+
+volatile uint8_t memCurrentSubsystem = MEM_OTHER;
+volatile uint32_t memAllocCounts[MEM_SUBSYSTEM_COUNT] = {0};
+
+static size_t gLiveBytes = 0;
+static size_t gLiveBlocks = 0;
+
+void *operator new(size_t size) {
+  memCountAlloc(memCurrentSubsystem);
+  size_t *p = (size_t *)malloc(size + sizeof(size_t));
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  *p = size;
+  gLiveBytes += size;
+  gLiveBlocks++;
+  return p + 1;
+}
+
+void operator delete(void *ptr) noexcept {
+  if (ptr == nullptr) {
+    return;
+  }
+  size_t *p = (size_t *)ptr - 1;
+  gLiveBytes -= *p;
+  gLiveBlocks--;
+  free(p);
+}
+
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+
+// malloc を直接使う確保も含めたプロセス全体の使用中ヒープ
+static size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  return mallinfo2().uordblks;
+#else
+  return gLiveBytes;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+#define NODE_ID 1
+#define NODE_COUNT 11
+#define UPLINK_PERIOD_MS 10000
+#define UPLINK_JITTER_MS 200
+#define UPLINK_MODULE_TIMEOUT_MS 5000
+#define UPLINK_MODULE_TIMEOUT_MIN_MS 1000
+#define UPLINK_CONFIRM_TIMEOUT_MS 30000
+#define SAMPLE_PERIOD_MS 1000
+#define TIME_SYNC_INTERVAL_MS (6UL * 60 * 60 * 1000)
+#define EVENT_ACK_TIMEOUT_MS 60000
+#define EVENT_MAX_RETRIES 3
+#define DIAG_INTERVAL_SLOTS 360
+#define MODULE_BOOT_MS 5000
+#define UPLINK_DATARATE 5
+#define AIRTIME_BURST_MS 4000
+#define EVENT_RESERVE_FRAMES 3
+#define UPLINK_MIN_GAP_MS 2500
+#define MISFRAMED_PER_DROPPED_BYTE 4 // 欠けたバイト1つあたりに許す、区切りがずれた送信要求の数
+#define EVENT_AIR_SLACK_MS 10000     // イベントの送信遅延の上限に含める、遅れた "OK" や応答なしの待ちと送信間隔のぶん
+#define SLOT_ALIGN_SLACK_MS 50      // UNIX時刻に合わせたスロットのずれに許す、時刻同期の誤差のぶん
+#define WINDOWS 20
+
+struct Options {
+  uint64_t cycles = 2000000;
+  uint32_t seed = 1;
+  size_t toleranceBytes = 4096;
+  uint32_t gustEvery = 900; // 突風を混ぜる間隔（サンプル数）。0 なら混ぜない
+  uint32_t budgetPermille = 20;
+  bool rbe = false;
+  bool sweep = false;
+  const char *tracePath = nullptr;
+  Es920Emulator::Config emu;
+};
+
+// 変化時のみ送信するモードの確認用に、取得したサンプルを時刻ごとに保持する（約36時間ぶん）
+// 仮想時刻の millis() は49.7日で一周するため、フレームの時刻は取得済みのサンプル数から求めた
+// 64ビットの時刻の直前に戻してから番号にする
+static const size_t kTruthSize = 1 << 17;
+static BatchSample gTruth[kTruthSize];
+
+struct ReconstructStats {
+  uint64_t rows = 0;
+  uint64_t heldRows = 0;
+  uint64_t violations = 0; // 不感帯を超えた補完値、送信値の不一致、公称周期からずれた補完時刻
+  uint16_t maxDirection = 0;
+  uint16_t maxSpeed100 = 0;
+  uint16_t maxTemp100 = 0;
+};
+
+// 送ったバッチフレームを復元し、取得したサンプルと比べる
+// 時刻同期後のフレームの時刻は UNIX時刻なので、エミュレータの仮想時刻 0 の UNIX時刻（epochMs）を引いて比べる
+static void checkReconstruction(const uint8_t *payload, size_t len, uint64_t samplesTaken, uint64_t epochMs,
+                                ReconstructStats &st) {
+  static const Deadbands db;
+  BatchReader reader;
+  if (!reader.begin(payload, len)) {
+    st.violations++;
+    return;
+  }
+  BatchSample s;
+  uint64_t t;
+  uint64_t latest = samplesTaken * SAMPLE_PERIOD_MS; // 次に取得するサンプルの時刻
+  uint64_t base = (reader.header().flags & BATCH_FLAG_SYNCED) ? epochMs : 0;
+  while (reader.next(s, t)) {
+    t -= base;
+    t = latest - (uint32_t)((uint32_t)latest - (uint32_t)t);
+    uint64_t idx = t / SAMPLE_PERIOD_MS;
+    st.rows++;
+    st.heldRows += reader.held() ? 1 : 0;
+    if (t % SAMPLE_PERIOD_MS != 0 || idx >= samplesTaken || samplesTaken - idx > kTruthSize) {
+      st.violations++;
+      continue;
+    }
+    const BatchSample &truth = gTruth[idx % kTruthSize];
+    uint16_t dd = windDirectionDelta(s.windDirection, truth.windDirection);
+    uint16_t ds = (uint16_t)abs((int)s.airSpeed100 - (int)truth.airSpeed100);
+    uint16_t dt = (uint16_t)abs((int)s.virtualTemp100 - (int)truth.virtualTemp100);
+    st.maxDirection = std::max(st.maxDirection, dd);
+    st.maxSpeed100 = std::max(st.maxSpeed100, ds);
+    st.maxTemp100 = std::max(st.maxTemp100, dt);
+    bool ok = reader.held() ? dd <= db.windDirection && ds <= db.airSpeed100 && dt <= db.virtualTemp100
+                            : dd == 0 && ds == 0 && dt == 0;
+    st.violations += ok ? 0 : 1;
+  }
+  st.violations += reader.truncated() ? 1 : 0;
+}
+
+// 各ノードがばらばらの時刻に起動し（ローカルの epoch が違う）、時刻同期でスロットを UNIX時刻に合わせたとして、
+// 隣り合うノードの送信予定時刻の最小間隔を UNIX時刻上で求める（位相は等間隔、揺らぎの幅はスロット間隔の
+// 半分未満なので、間隔の半分以上離れているはず。合わせる前の epoch 基準では起動のタイミング次第で重なる）
+static uint32_t minNodeSeparationMs(uint32_t slots) {
+  const uint64_t unixBase = 1700000000000ULL;
+  const int64_t period = UPLINK_PERIOD_MS;
+  uint32_t rng = 12345;
+  uint32_t minSep = UINT32_MAX;
+  for (int i = 0; i < NODE_COUNT; i++) {
+    int j = (i + 1) % NODE_COUNT;
+    UplinkScheduler a(UPLINK_PERIOD_MS, UPLINK_JITTER_MS, NODE_COUNT);
+    UplinkScheduler b(UPLINK_PERIOD_MS, UPLINK_JITTER_MS, NODE_COUNT);
+    UplinkScheduler *node[2] = {&a, &b};
+    uint64_t bootUnix[2];
+    uint32_t bootLocal[2];
+    for (int n = 0; n < 2; n++) {
+      rng = rng * 1664525u + 1013904223u;
+      bootUnix[n] = unixBase + rng % 86400000u;
+      rng = rng * 1664525u + 1013904223u;
+      bootLocal[n] = rng;
+      node[n]->begin((uint8_t)(n == 0 ? i : j), bootLocal[n]);
+      node[n]->alignToUnix(bootUnix[n] + (uint32_t)(node[n]->slotBaseMs() - bootLocal[n]));
+    }
+    for (uint32_t k = 0; k < slots; k++) {
+      int64_t ua = (int64_t)(bootUnix[0] + (uint32_t)(a.dueMs() - bootLocal[0]));
+      int64_t ub = (int64_t)(bootUnix[1] + (uint32_t)(b.dueMs() - bootLocal[1]));
+      minSep = std::min(minSep, (uint32_t)(((ub - ua) % period + period) % period));
+      a.markSent(a.dueMs());
+      b.markSent(b.dueMs());
+    }
+  }
+  return minSep;
+}
+
+// UART トレースの記録（ファームウェアの SD 書き込みタスクに相当し、リングがあふれないうちにファイルへ書き出す）
+static uint8_t gTraceBuffer[1 << 20];
+static UartTraceRecorder gTrace(gTraceBuffer, sizeof(gTraceBuffer));
+static FILE *gTraceFile = nullptr;
+
+static void drainTrace(bool all) {
+  if (gTraceFile == nullptr || (!all && gTrace.pending() < sizeof(gTraceBuffer) / 2)) {
+    return;
+  }
+  static uint8_t block[65536];
+  size_t n;
+  while ((n = gTrace.read(block, sizeof(block))) > 0) {
+    fwrite(block, 1, n, gTraceFile);
+  }
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: uplink_soak [--cycles N] [--storm-every N] [--storm-ms MS] [--reboot-every N] [--seed N]\n"
+          "                   [--tolerance BYTES] [--hex] [--gust-every SAMPLES] [--budget PERMILLE] [--rbe]\n"
+          "                   [--trace FILE] [--drop-byte PERMILLE]\n"
+          "       uplink_soak --sweep\n");
+  exit(2);
+}
+
+// エミュレータが最後に受け付けた送信要求が、このフレームのエアー上のペイロードと一致するか
+// （ASCII では16進表記の文字列そのものが送られる）
+static bool deliveredAsFramed(const Es920Emulator &emu, FrameFormat fmt, const uint8_t *frame,
+                              const uint8_t *payload, size_t len) {
+  const uint8_t *air = fmt == FRAME_FORMAT_BINARY ? payload : frame;
+  size_t airLen = airPayloadSize(fmt, len);
+  return emu.lastPayloadLen() == airLen && memcmp(emu.lastPayload(), air, airLen) == 0;
+}
+
+// 1つの送信要求を送り、エミュレータが同じペイロードを受け取って "OK" を返したか
+static bool sweepOne(Es920Emulator &emu, FrameFormat fmt, const uint8_t *payload, size_t len, uint32_t &now) {
+  static uint8_t frame[2 * 255 + 2];
+  size_t n = encodeUplinkFrame(fmt, payload, len, frame, sizeof(frame));
+  uint32_t before = emu.requests();
+  emu.write(frame, n, now);
+  if (n == 0 || emu.requests() != before + 1 || !deliveredAsFramed(emu, fmt, frame, payload, len)) {
+    return false;
+  }
+  now += 1000;
+  char line[8];
+  size_t pos = 0;
+  int c;
+  while ((c = emu.read(now)) >= 0) {
+    if (pos < sizeof(line) - 1) {
+      line[pos++] = (char)c;
+    }
+  }
+  line[pos] = '\0';
+  return strcmp(line, "OK\r\n") == 0;
+}
+
+static int runSweep(uint32_t seed) {
+  int failures = 0;
+  for (int f = 0; f < 2; f++) {
+    FrameFormat fmt = f == 0 ? FRAME_FORMAT_BINARY : FRAME_FORMAT_HEX;
+    Es920Emulator::Config cfg;
+    cfg.lateOkPermille = 0;
+    cfg.silentPermille = 0;
+    cfg.stormEvery = 0;
+    cfg.rebootEvery = 0;
+    cfg.downlinks = false;
+    cfg.binaryFormat = fmt == FRAME_FORMAT_BINARY;
+    Es920Emulator emu(cfg, seed);
+
+    uint8_t payload[255];
+    uint32_t now = 0;
+    uint32_t cases = 0;
+    uint64_t uartBytes = 0;
+    size_t maxLen = cfg.maxPayload / (fmt == FRAME_FORMAT_BINARY ? 1 : 2);
+    for (size_t len = 1; len <= maxLen; len++) {
+      // v をずらすことで、すべてのバイト値が各位置に1回ずつ現れる
+      for (int v = 0; v < 256; v++) {
+        for (size_t i = 0; i < len; i++) {
+          payload[i] = (uint8_t)(v + i);
+        }
+        cases++;
+        uartBytes += uplinkFrameSize(fmt, len);
+        if (!sweepOne(emu, fmt, payload, len, now)) {
+          if (failures < 10) {
+            printf("[SWEEP] FAIL: %s len=%zu first=0x%02X\n", f == 0 ? "binary" : "hex", len, v);
+          }
+          failures++;
+        }
+      }
+    }
+    printf("[SWEEP] %s: %u payloads, %.2f UART bytes per payload byte\n", f == 0 ? "binary" : "hex", cases,
+           (double)uartBytes / ((double)cases * (maxLen + 1) / 2));
+  }
+  if (failures > 0) {
+    printf("[SWEEP] FAIL: %d mismatches\n", failures);
+    return 1;
+  }
+  printf("[SWEEP] PASS: every byte value at every position delivered intact\n");
+  return 0;
+}
+
+// ファームウェアの UplinkPort に相当する、エミュレータへの書き込みと送信内容の確認
+struct SoakPort : UplinkPort {
+  Es920Emulator *emu = nullptr;
+  FrameFormat format = FRAME_FORMAT_BINARY;
+  uint32_t now = 0;
+  bool moduleReset = false;
+  uint64_t samplesTaken = 0;
+  uint64_t samplesSent = 0;
+  uint32_t eventsSent = 0;
+  uint32_t diagsSent = 0;
+  uint32_t misframed = 0; // エミュレータが受け取った内容が送ったフレームと違った送信要求
+  uint32_t timeSyncs = 0;
+  uint32_t unmatchedTimeDownlinks = 0;
+  ReconstructStats rec;
+
+  void writeFrame(const uint8_t *frame, size_t n) override {
+    uint32_t before = emu->requests();
+    emu->write(frame, n, now);
+    size_t len = format == FRAME_FORMAT_BINARY ? n - 1 : (n - 2) / 2;
+    if (emu->requests() != before + 1 || !deliveredAsFramed(*emu, format, frame, frame + 1, len)) {
+      misframed++;
+    }
+    gTrace.bytes(UTRACE_CH_LORA_TX, frame, n, now);
+  }
+
+  // ファームウェアの recoverModule() に相当（ループ側でモジュールだけをリセットする）
+  void onModuleReboot() override { moduleReset = true; }
+  void onFrameDesync() override { moduleReset = true; }
+
+  void fillDiag(DiagData &diag) override {
+    size_t inUse = heapInUse();
+    diag.freeHeap8 = (uint16_t)std::min(inUse / 8, (size_t)UINT16_MAX);
+    diag.uptimeMin = (uint16_t)std::min(now / 60000, (uint32_t)UINT16_MAX);
+  }
+
+  void onSent(UplinkKind kind, uint8_t seq, const uint8_t *payload, size_t len, size_t count,
+              uint32_t airtimeUs) override {
+    (void)airtimeUs;
+    gTrace.mark(UTRACE_MARK_UPLINK, seq, now);
+    if (kind == UPLINK_EVENT) {
+      eventsSent++;
+    } else if (kind == UPLINK_DIAG) {
+      diagsSent++;
+    } else {
+      checkReconstruction(payload, len, samplesTaken, emu->config().unixEpochMs, rec);
+      samplesSent += count;
+    }
+  }
+
+  void onTimeDownlink(uint8_t seq, uint64_t unixMs, bool applied) override {
+    (void)seq, (void)unixMs;
+    if (applied) {
+      timeSyncs++;
+    } else {
+      unmatchedTimeDownlinks++;
+    }
+  }
+};
+
+int main(int argc, char **argv) {
+  Options opt;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--sweep") == 0) {
+      opt.sweep = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--hex") == 0) {
+      opt.emu.binaryFormat = false;
+      continue;
+    }
+    if (strcmp(argv[i], "--rbe") == 0) {
+      opt.rbe = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+    }
+    const char *a = argv[i];
+    if (strcmp(a, "--trace") == 0) {
+      opt.tracePath = argv[++i];
+      continue;
+    }
+    unsigned long long v = strtoull(argv[++i], nullptr, 10);
+    if (strcmp(a, "--cycles") == 0) {
+      opt.cycles = v;
+    } else if (strcmp(a, "--storm-every") == 0) {
+      opt.emu.stormEvery = (uint32_t)v;
+    } else if (strcmp(a, "--storm-ms") == 0) {
+      opt.emu.stormMs = (uint32_t)v;
+    } else if (strcmp(a, "--reboot-every") == 0) {
+      opt.emu.rebootEvery = (uint32_t)v;
+    } else if (strcmp(a, "--seed") == 0) {
+      opt.seed = (uint32_t)v;
+    } else if (strcmp(a, "--tolerance") == 0) {
+      opt.toleranceBytes = (size_t)v;
+    } else if (strcmp(a, "--gust-every") == 0) {
+      opt.gustEvery = (uint32_t)v;
+    } else if (strcmp(a, "--budget") == 0) {
+      opt.budgetPermille = (uint32_t)v;
+    } else if (strcmp(a, "--drop-byte") == 0) {
+      opt.emu.dropBytePermille = (uint32_t)v;
+    } else {
+      usage();
+    }
+  }
+  if (opt.sweep) {
+    return runSweep(opt.seed);
+  }
+  if (opt.cycles < WINDOWS) {
+    opt.cycles = WINDOWS;
+  }
+
+  Es920Emulator emu(opt.emu, opt.seed);
+  FrameFormat format = opt.emu.binaryFormat ? FRAME_FORMAT_BINARY : FRAME_FORMAT_HEX;
+  uint32_t rng = opt.seed * 2654435761u + 1;
+
+  // ファームウェアの uplinkLoopConfig() と同じ設定（確認応答はエミュレータが返すので要求する）
+  UplinkLoopConfig cfg;
+  cfg.nodeId = NODE_ID;
+  cfg.nodeCount = NODE_COUNT;
+  cfg.periodMs = UPLINK_PERIOD_MS;
+  cfg.jitterMs = UPLINK_JITTER_MS;
+  cfg.moduleTimeoutMs = UPLINK_MODULE_TIMEOUT_MS;
+  cfg.moduleTimeoutMinMs = UPLINK_MODULE_TIMEOUT_MIN_MS;
+  cfg.confirmTimeoutMs = UPLINK_CONFIRM_TIMEOUT_MS;
+  cfg.samplePeriodMs = SAMPLE_PERIOD_MS;
+  cfg.timeSyncIntervalMs = TIME_SYNC_INTERVAL_MS;
+  cfg.budgetPermille = opt.budgetPermille;
+  cfg.burstMs = AIRTIME_BURST_MS;
+  cfg.eventReserveFrames = EVENT_RESERVE_FRAMES;
+  cfg.minGapMs = UPLINK_MIN_GAP_MS;
+  cfg.eventAckRequired = true;
+  cfg.eventAckTimeoutMs = EVENT_ACK_TIMEOUT_MS;
+  cfg.eventMaxRetries = EVENT_MAX_RETRIES;
+  cfg.reportByException = opt.rbe;
+  cfg.diagIntervalSlots = DIAG_INTERVAL_SLOTS;
+  cfg.datarate = UPLINK_DATARATE;
+  cfg.format = format;
+  static SoakPort port;
+  static UplinkLoop uplink(cfg, port);
+  port.emu = &emu;
+  port.format = format;
+
+  UplinkScheduler &sched = uplink.scheduler;
+  uint32_t minSep = minNodeSeparationMs(10000);
+  printf("[SOAK] slots: %d nodes, spacing %u ms, jitter +/-%u ms, min separation %u ms\n", NODE_COUNT,
+         sched.slotSpacingMs(), sched.jitterMaxMs(), minSep);
+  if (minSep < sched.slotSpacingMs() / 2) {
+    printf("[SOAK] FAIL: nodes scheduled %u ms apart\n", minSep);
+    return 1;
+  }
+
+  uint32_t now = 0;
+  uint32_t nextSampleMs = 0;
+  uint32_t moduleResets = 0;
+  uint32_t fullRestarts = 0;
+  ModuleResetLimiter resetLimiter;
+  BatchSample walk = {180, 300, 2000, 50}; // 風向・風速・温度はランダムウォーク
+  uplink.begin(now);
+  if (opt.tracePath != nullptr) {
+    gTraceFile = fopen(opt.tracePath, "wb");
+    if (gTraceFile == nullptr) {
+      perror(opt.tracePath);
+      return 2;
+    }
+    gTrace.begin(now, 0);
+  }
+
+  size_t windowPeak[WINDOWS] = {0};
+  size_t windowBlocks[WINDOWS] = {0};
+  uint64_t cycles = 0;
+  uint64_t windowLen = opt.cycles / WINDOWS;
+  uint64_t virtualMs = 0;
+  uint64_t alignedSlots = 0;
+  int32_t slotAlignErrorMs = INT32_MIN; // 揺らぎの幅を超えたぶんの最大
+
+  auto t0 = std::chrono::steady_clock::now();
+  while (cycles < opt.cycles) {
+    // 次のイベント（送信スロット・モジュール出力）まで仮想時刻を進める。タイムアウト判定のため最大250ms刻み
+    uint32_t next = now + 250;
+    uint32_t due = uplink.scheduler.dueMs();
+    if ((int32_t)(due - now) > 0 && (int32_t)(due - next) < 0) {
+      next = due;
+    }
+    uint32_t out;
+    if (emu.nextOutputMs(out) && (int32_t)(out - now) > 0 && (int32_t)(out - next) < 0) {
+      next = out;
+    }
+    virtualMs += next - now;
+    now = next;
+    port.now = now;
+
+    // 1秒周期のサンプル取得（弱い風と緩やかな温度変化のランダムウォーク、一定間隔で突風）
+    while ((int32_t)(now - nextSampleMs) >= 0) {
+      rng = rng * 1664525u + 1013904223u;
+      bool gust = opt.gustEvery > 0 && port.samplesTaken % opt.gustEvery == opt.gustEvery - 1;
+      walk.windDirection = (uint16_t)((walk.windDirection + 360 + (int)((rng >> 8) % 7) - 3) % 360);
+      walk.airSpeed100 = (uint16_t)std::min(1000, std::max(0, (int)walk.airSpeed100 + (int)((rng >> 4) % 21) - 10));
+      walk.virtualTemp100 = (uint16_t)std::min(3000, std::max(1000, (int)walk.virtualTemp100 + (int)(rng % 5) - 2));
+      walk.rssiAbs = (uint8_t)(40 + (rng >> 20) % 20);
+      BatchSample sample = walk;
+      if (gust) {
+        sample.airSpeed100 = (uint16_t)(1500 + (rng >> 4) % 1500);
+      }
+      gTruth[port.samplesTaken % kTruthSize] = sample;
+      uplink.onSample(sample, nextSampleMs);
+      nextSampleMs += SAMPLE_PERIOD_MS;
+      port.samplesTaken++;
+    }
+
+    // モジュール応答の処理
+    {
+      MemScope memScope(MEM_SESSION);
+      int c;
+      while ((c = emu.read(now)) >= 0) {
+        gTrace.byte(UTRACE_CH_LORA_RX, (uint8_t)c, now);
+        uplink.feed((char)c, now);
+      }
+      uplink.poll(now);
+    }
+    if (port.moduleReset) {
+      // NRST と設定・Join のやり直しに相当。上限を超えた場合のファームウェアは ESP32 ごと再起動するが、
+      // ここでは数えるだけで同じくモジュールだけをやり直す（推定値は NVS から復元される想定で引き継ぐ）
+      port.moduleReset = false;
+      moduleResets++;
+      if (!resetLimiter.allow(now)) {
+        fullRestarts++;
+        resetLimiter = ModuleResetLimiter();
+      }
+      emu.reset();
+      uplink.reset(now + MODULE_BOOT_MS);
+      continue;
+    }
+
+    MemScope memScope(MEM_UPLINK);
+    // 優先クラス：イベントはモジュールが空いていて予算が許せばすぐ送る
+    if (uplink.sendPendingEvent(now)) {
+      continue;
+    }
+    if (uplink.serviceSlot(now) != UplinkLoop::SLOT_BATCH_SENT) {
+      continue;
+    }
+    cycles++;
+    drainTrace(false);
+    if (uplink.scheduler.unixAligned()) {
+      // UNIX時刻に合わせたスロットからのずれ（揺らぎと送信の遅れを除いたぶんは時刻同期の誤差）
+      int64_t off = (int64_t)((opt.emu.unixEpochMs + virtualMs) % UPLINK_PERIOD_MS) - uplink.scheduler.phaseMs();
+      off = ((off % UPLINK_PERIOD_MS) + UPLINK_PERIOD_MS + UPLINK_PERIOD_MS / 2) % UPLINK_PERIOD_MS - UPLINK_PERIOD_MS / 2;
+      int64_t excess = off < 0 ? -off : off - (int64_t)uplink.scheduler.lastLatenessMs();
+      slotAlignErrorMs = std::max(slotAlignErrorMs, (int32_t)(excess - (int64_t)uplink.scheduler.jitterMaxMs()));
+      alignedSlots++;
+    }
+
+    size_t w = (size_t)((cycles - 1) / windowLen);
+    if (w < WINDOWS) {
+      size_t inUse = heapInUse();
+      if (inUse > windowPeak[w]) {
+        windowPeak[w] = inUse;
+      }
+      if (gLiveBlocks > windowBlocks[w]) {
+        windowBlocks[w] = gLiveBlocks;
+      }
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  double sec = std::chrono::duration<double>(t1 - t0).count();
+  if (gTraceFile != nullptr) {
+    gTrace.end();
+    drainTrace(true);
+    fclose(gTraceFile);
+    printf("[SOAK] trace: %s, %u UART bytes recorded, %u lost\n", opt.tracePath, gTrace.recordedBytes(),
+           gTrace.lostBytes());
+  }
+
+  const UplinkSession &s = uplink.session;
+  const ReconstructStats &rec = port.rec;
+  printf("[SOAK] %llu cycles in %.2f s (%.0f cycles/s), virtual time %.1f days\n",
+         (unsigned long long)cycles, sec, cycles / sec, virtualMs / 86400000.0);
+  printf("[SOAK] sent=%u accepted=%u rejected=%u timeouts=%u stray=%u module resets=%u (full restarts %u) "
+         "missed slots=%u\n",
+         s.sent(), s.accepted(), s.rejected(), s.timeouts(), s.strayLines(), moduleResets, fullRestarts,
+         uplink.scheduler.missedSlots());
+  printf("[SOAK] module: requests=%u ng102=%u ng=%u silent=%u reboots=%u\n",
+         emu.requests(), emu.ngBusy(), emu.ngOther(), emu.silent(), emu.reboots());
+  printf("[SOAK] framing: %s, dropped UART bytes=%u, misframed requests=%u, desync resets=%u\n",
+         format == FRAME_FORMAT_BINARY ? "binary" : "hex (ascii)", emu.droppedBytes(), port.misframed,
+         uplink.desyncs());
+  printf("[SOAK] samples: sent=%llu (%.1f per uplink), backlog=%zu peak=%zu, dropped=%u\n",
+         (unsigned long long)port.samplesSent, (double)port.samplesSent / cycles, uplink.samples.size(),
+         uplink.samples.peak(), uplink.samples.dropped());
+  const EventQueue &q = uplink.events;
+  printf("[SOAK] events: queued=%u sent=%u delivered=%u resent=%u expired=%u dropped=%u, deferred slots=%u, "
+         "airtime=%.2f%% of %u.%u%%\n",
+         q.queued(), port.eventsSent, q.delivered(), q.resent(), q.expired(), q.dropped(), uplink.deferredSlots(),
+         virtualMs > 0 ? uplink.budget.usedUs() / 10.0 / virtualMs : 0.0, opt.budgetPermille / 10,
+         opt.budgetPermille % 10);
+  printf("[SOAK] downlinks: time=%u ack=%u lost=%u, time syncs=%u (unmatched %u, rejected %u), synced=%s, diag frames=%u, "
+         "seq gaps at server=%u\n",
+         emu.timeDownlinks(), emu.ackDownlinks(), emu.lostDownlinks(), port.timeSyncs, port.unmatchedTimeDownlinks,
+         uplink.timebase.rejectedSyncs(), uplink.timebase.synced() ? "yes" : "no", port.diagsSent, emu.seqGaps());
+  printf("[SOAK] slot alignment: %llu batches on unix-aligned slots, worst offset beyond jitter %d ms (limit %u)\n",
+         (unsigned long long)alignedSlots, alignedSlots > 0 ? slotAlignErrorMs : 0, SLOT_ALIGN_SLACK_MS);
+  printf("[SOAK] reconstruct: rows=%llu held=%llu violations=%llu, max error dir=%u speed100=%u temp100=%u%s\n",
+         (unsigned long long)rec.rows, (unsigned long long)rec.heldRows, (unsigned long long)rec.violations,
+         rec.maxDirection, rec.maxSpeed100, rec.maxTemp100,
+         opt.rbe ? "" : " (report-by-exception off)");
+  // NG 102 の嵐の間はどう再送しても送れないため、上限は嵐の長さ + 再送間隔の上限 + 余裕とする
+  uint32_t eventAirLimitMs = (opt.emu.stormEvery > 0 ? opt.emu.stormMs : 0) + EventQueue::kRetryMaxMs +
+                             EVENT_AIR_SLACK_MS;
+  printf("[SOAK] event->air: mean=%u p50<=%u p95<=%u max=%u ms, limit %u ms\n", q.toAir().mean(),
+         q.toAir().percentile(50), q.toAir().percentile(95), q.toAir().max(), eventAirLimitMs);
+  printf("[SOAK] event->ack: n=%u mean=%u p95<=%u max=%u ms\n", q.toAck().count(), q.toAck().mean(),
+         q.toAck().percentile(95), q.toAck().max());
+  printf("[SOAK] send->ok: mean=%u p50<=%u p95<=%u max=%u ms, uplink rto=%u ms\n",
+         s.moduleLatency().mean(), s.moduleLatency().percentile(50), s.moduleLatency().percentile(95),
+         s.moduleLatency().max(), uplink.timeouts[CMD_UPLINK].timeoutMs());
+  printf("[SOAK] allocs:");
+  for (int i = 0; i < MEM_SUBSYSTEM_COUNT; i++) {
+    printf(" %s=%u", memSubsystemName((MemSubsystem)i), memAllocCounts[i]);
+  }
+  printf("\n[SOAK] heap in use per window (bytes / live blocks):");
+  for (int w = 0; w < WINDOWS; w++) {
+    printf("%s%zu/%zu", w % 5 == 0 ? "\n  " : "  ", windowPeak[w], windowBlocks[w]);
+  }
+  printf("\n");
+
+  // 最初の区間は初期化を含むため、2番目の区間と最後の区間のピークを比べる
+  size_t base = windowPeak[1];
+  size_t last = windowPeak[WINDOWS - 1];
+  bool grew = last > base + opt.toleranceBytes || windowBlocks[WINDOWS - 1] > windowBlocks[1];
+  if (grew) {
+    printf("[SOAK] FAIL: heap grew from %zu to %zu bytes\n", base, last);
+    return 1;
+  }
+  if (port.misframed > MISFRAMED_PER_DROPPED_BYTE * emu.droppedBytes()) {
+    printf("[SOAK] FAIL: %u misframed requests for %u dropped bytes (frame boundary not recovered)\n",
+           port.misframed, emu.droppedBytes());
+    return 1;
+  }
+  uint32_t loopAllocs = memAllocCounts[MEM_SESSION] + memAllocCounts[MEM_UPLINK];
+  if (loopAllocs > 0) {
+    printf("[SOAK] FAIL: %u allocations in the session/uplink paths\n", loopAllocs);
+    return 1;
+  }
+  if (q.toAir().max() > eventAirLimitMs) {
+    printf("[SOAK] FAIL: event->air max %u ms above %u ms\n", q.toAir().max(), eventAirLimitMs);
+    return 1;
+  }
+  if (uplink.samples.dropped() > 0) {
+    printf("[SOAK] FAIL: %u samples dropped from the ring (peak backlog %zu of %zu)\n", uplink.samples.dropped(),
+           uplink.samples.peak(), SampleRing::kCapacity);
+    return 1;
+  }
+  if (rec.violations > 0) {
+    printf("[SOAK] FAIL: %llu reconstructed rows out of deadband\n", (unsigned long long)rec.violations);
+    return 1;
+  }
+  // 欠番になってよいのは、サーバーに届かなかった送信要求（応答なしでタイムアウトした・モジュールのリセットで破棄した・
+  // 区切りがずれて別内容になった）のぶんだけ
+  uint32_t seqGapLimit = s.timeouts() + moduleResets * UplinkSession::kMaxInflight + port.misframed;
+  if (emu.seqGaps() > seqGapLimit) {
+    printf("[SOAK] FAIL: %u seq gaps at the server, at most %u explained by lost requests\n", emu.seqGaps(),
+           seqGapLimit);
+    return 1;
+  }
+  if (!uplink.timebase.synced() || port.timeSyncs == 0) {
+    printf("[SOAK] FAIL: timebase never synced (%u time downlinks)\n", emu.timeDownlinks());
+    return 1;
+  }
+  if (alignedSlots == 0 || slotAlignErrorMs > (int32_t)SLOT_ALIGN_SLACK_MS) {
+    printf("[SOAK] FAIL: slots not aligned to unix time (%llu aligned, worst %d ms beyond jitter)\n",
+           (unsigned long long)alignedSlots, alignedSlots > 0 ? slotAlignErrorMs : 0);
+    return 1;
+  }
+  if (emu.ackDownlinks() > 0 && q.toAck().count() == 0) {
+    printf("[SOAK] FAIL: %u event acks sent but none matched\n", emu.ackDownlinks());
+    return 1;
+  }
+  printf("[SOAK] PASS: no allocations in the session/uplink paths, process heap flat (%zu -> %zu bytes), "
+         "no samples dropped (peak backlog %zu of %zu), event->air max %u ms within %u ms, "
+         "%u time syncs, %u event acks\n",
+         base, last, uplink.samples.peak(), SampleRing::kCapacity, q.toAir().max(), eventAirLimitMs, port.timeSyncs,
+         q.toAck().count());
+  return 0;
+}